@@ -0,0 +1,480 @@
+/*
+ *  Analysis Cache
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * Cache of parsed captures for chargeHisto.cpp, so a rerun with another
+ * integration window over an unchanged capture does not parse the CSV again.
+ *
+ * Every entry is named after the content of the capture CSV (64-bit hash
+ * plus size) and holds:
+ *   <key>.evp  - per event, the prefix sums of the samples and the minimum and
+ *                maximum of every block of eventPrefixBlock samples
+ *   <key>.evs  - the parsed waveforms, as a binary event store (eventStore.h),
+ *                only when the capture has no event store of its own
+ *
+ * The samples are those of the event store written by csvRead.cpp next to
+ * the CSV when it is given and not older than the CSV, so adding an entry
+ * only reads that store; the CSV text is parsed only when there is none.
+ *
+ * With them the sums of any baseline or window are two lookups per event,
+ * and the window minimum and maximum only read the two partial blocks at
+ * the window edges. The prefix sums add in a different order than the
+ * point loop, so results can differ in the last bits.
+ *
+ * cache_index.txt maps every capture path to its key, with the size and
+ * modification time seen when it was hashed: while both stay the same the
+ * file is not hashed again. A changed capture gets a new key, and its old
+ * entry is evicted like any other once the cache grows over its size cap
+ * (least recently used first).
+ *
+ * The cache is meant for one process at a time.
+ */
+
+#ifndef ANALYSIS_CACHE_H
+#define ANALYSIS_CACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include "TSystem.h"
+#include "ROOT/TThreadExecutor.hxx"
+
+#include "keysightCSV.h"
+#include "eventStore.h"
+#include "chargeAnalysis.h"
+
+const char eventPrefixMagic[8] = {'S', 'A', 'P', 'H', 'E', 'V', 'P', '\0'};
+const uint32_t eventPrefixVersion = 1;
+const uint32_t eventPrefixBlock = 64;
+const char analysisCacheIndex[] = "cache_index.txt";
+
+struct EventPrefixHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t blockSize;
+    uint64_t resolution;
+    uint64_t eventCount;
+};
+
+// Doubles per event in the prefix file: resolution + 1 prefix sums, then block minimums and maximums
+inline size_t eventPrefixBlocks(size_t resolution) {
+    return (resolution + eventPrefixBlock - 1) / eventPrefixBlock;
+}
+
+inline size_t eventPrefixRecord(size_t resolution) {
+    return resolution + 1 + 2 * eventPrefixBlocks(resolution);
+}
+
+// Hash of the bytes of a file, four independent lanes of 8-byte words
+inline uint64_t hashBytes(const char* data, size_t size) {
+    const uint64_t multiplier = 0x9E3779B97F4A7C15ULL;
+    uint64_t lanes[4] = {0xcbf29ce484222325ULL ^ size, 0x84222325cbf29ce4ULL, 0x100000001b3ULL, 0x27d4eb2f165667c5ULL};
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int lane = 0; lane < 4; ++lane) {
+            uint64_t word;
+            memcpy(&word, data + i + 8 * lane, sizeof(word));
+            lanes[lane] = (lanes[lane] ^ word) * multiplier;
+            lanes[lane] ^= lanes[lane] >> 29;
+        }
+    }
+    uint64_t hash = lanes[0] ^ (lanes[1] << 1) ^ (lanes[2] << 2) ^ (lanes[3] << 3);
+    for (; i < size; ++i)
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 0x100000001b3ULL;
+    hash ^= hash >> 33;
+    hash *= multiplier;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+// Writer --------------------------------------------------------------------------------------------------------------------------------
+
+// Write the prefix file of eventCount events of resolution samples, samples(event) gives the samples of a
+// zero-based event or nullptr if it is not complete. Returns false on error.
+template <typename SampleFunction>
+bool writeEventPrefix(const std::string& filename, size_t eventCount, size_t resolution, SampleFunction samples) {
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (file == nullptr)
+        return false;
+
+    EventPrefixHeader header;
+    memcpy(header.magic, eventPrefixMagic, sizeof(header.magic));
+    header.version = eventPrefixVersion;
+    header.blockSize = eventPrefixBlock;
+    header.resolution = resolution;
+    header.eventCount = eventCount;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    std::vector<double> record(eventPrefixRecord(resolution));
+    size_t blocks = eventPrefixBlocks(resolution);
+    for (size_t event = 0; ok && event < eventCount; ++event) {
+        const double* eventSamples = samples(event);
+        if (eventSamples == nullptr) {
+            ok = false;
+            break;
+        }
+        double* prefix = record.data();
+        double* blockMin = prefix + resolution + 1;
+        double* blockMax = blockMin + blocks;
+        prefix[0] = 0;
+        for (size_t point = 0; point < resolution; ++point)
+            prefix[point + 1] = prefix[point] + eventSamples[point];
+        for (size_t block = 0; block < blocks; ++block) {
+            const double* first = eventSamples + block * eventPrefixBlock;
+            const double* last = eventSamples + std::min<size_t>(resolution, (block + 1) * eventPrefixBlock);
+            auto range = std::minmax_element(first, last);
+            blockMin[block] = *range.first;
+            blockMax[block] = *range.second;
+        }
+        ok = fwrite(record.data(), sizeof(double), record.size(), file) == record.size();
+    }
+
+    ok = (fclose(file) == 0) && ok;
+    if (!ok)
+        remove(filename.c_str());
+    return ok;
+}
+
+// Prefix file of the event columns of data (odd columns, as read by readCSV)
+inline bool writeEventPrefix(const std::string& filename, const std::vector<std::vector<double>>& data, size_t resolution) {
+    return writeEventPrefix(filename, data.size() / 2, resolution, [&](size_t event) {
+        const std::vector<double>& samples = data[2 * event + 1];
+        return samples.size() == resolution ? samples.data() : nullptr;
+    });
+}
+
+// Prefix file of the events of an event store
+inline bool writeEventPrefix(const std::string& filename, const EventStore& store) {
+    return writeEventPrefix(filename, store.eventCount(), store.resolution(), [&](size_t event) { return store.event(event); });
+}
+
+// Replace target with source, also when target exists (plain rename() fails on Windows then)
+inline bool replaceFile(const std::string& source, const std::string& target) {
+    std::error_code error;
+    std::filesystem::rename(source, target, error);
+    return !error;
+}
+
+// Reader --------------------------------------------------------------------------------------------------------------------------------
+
+// One cached capture: waveforms plus prefix sums, both memory-mapped
+class CachedCapture {
+public:
+    bool open(const std::string& storeFilename, const std::string& prefixFilename) {
+        if (!store.open(storeFilename) || !prefixFile.open(prefixFilename) || prefixFile.size() < sizeof(EventPrefixHeader))
+            return false;
+        EventPrefixHeader header;
+        memcpy(&header, prefixFile.begin(), sizeof(header));
+        size_t expectedSize = sizeof(header) + header.eventCount * eventPrefixRecord(header.resolution) * sizeof(double);
+        return memcmp(header.magic, eventPrefixMagic, sizeof(header.magic)) == 0 && header.version == eventPrefixVersion &&
+               header.blockSize == eventPrefixBlock && header.resolution == store.resolution() &&
+               header.eventCount == store.eventCount() && prefixFile.size() >= expectedSize;
+    }
+
+    size_t resolution() const { return store.resolution(); }
+    size_t eventCount() const { return store.eventCount(); }
+    double t0() const { return store.t0(); }
+    double deltaT() const { return store.deltaT(); }
+    const double* event(size_t index) const { return store.event(index); }
+
+    // Same sums as sumEvent() over the samples of a zero-based event, without reading the samples
+    // between the window edges
+    EventSums eventSums(size_t index, const ChargeWindow& window) const {
+        size_t res = resolution();
+        size_t blocks = eventPrefixBlocks(res);
+        const double* prefix = reinterpret_cast<const double*>(prefixFile.begin() + sizeof(EventPrefixHeader)) + index * eventPrefixRecord(res);
+        const double* blockMin = prefix + res + 1;
+        const double* blockMax = blockMin + blocks;
+
+        EventSums sums;
+        sums.baselineCount = baselineEndFor(res, window);
+        sums.baselineSum = prefix[sums.baselineCount];
+
+        size_t begin = 0;
+        size_t count = 0;
+        windowRangeFor(res, window, begin, count);
+        if (count == 0)
+            return sums;
+        size_t end = begin + count;
+        sums.windowSum = prefix[end] - prefix[begin];
+        sums.windowCount = count;
+
+        // Whole blocks from the block extremes, partial blocks at the edges from the samples
+        const double* samples = event(index);
+        size_t firstBlock = (begin + eventPrefixBlock - 1) / eventPrefixBlock;
+        size_t lastBlock = end / eventPrefixBlock;
+        if (firstBlock >= lastBlock) {
+            WindowStats stats = windowStats(samples + begin, count, 0.0);
+            sums.windowMin = stats.min;
+            sums.windowMax = stats.max;
+            return sums;
+        }
+        for (size_t block = firstBlock; block < lastBlock; ++block) {
+            sums.windowMin = std::min(sums.windowMin, blockMin[block]);
+            sums.windowMax = std::max(sums.windowMax, blockMax[block]);
+        }
+        for (size_t point = begin; point < firstBlock * eventPrefixBlock; ++point) {
+            sums.windowMin = std::min(sums.windowMin, samples[point]);
+            sums.windowMax = std::max(sums.windowMax, samples[point]);
+        }
+        for (size_t point = lastBlock * eventPrefixBlock; point < end; ++point) {
+            sums.windowMin = std::min(sums.windowMin, samples[point]);
+            sums.windowMax = std::max(sums.windowMax, samples[point]);
+        }
+        return sums;
+    }
+
+private:
+    EventStore store;
+    MappedFile prefixFile;
+};
+
+// Cache folder --------------------------------------------------------------------------------------------------------------------------
+class AnalysisCache {
+public:
+    AnalysisCache(const std::string& folder, uint64_t maxBytes) : folder(folder), maxBytes(maxBytes) {
+        gSystem->mkdir(folder.c_str(), kTRUE);
+        loadIndex();
+    }
+
+    // Open the entry of a capture CSV in capture, adding it if it is not cached yet: from the event store
+    // storeFilename of the capture when it is usable, otherwise by parsing the CSV on the pool. hit tells
+    // which one happened. Returns false if the capture could not be read.
+    bool open(const std::string& csvFilename, ROOT::TThreadExecutor& pool, CachedCapture& capture, bool& hit,
+              const std::string& storeFilename = "") {
+        hit = false;
+        FileStat_t stat;
+        if (gSystem->GetPathInfo(csvFilename.c_str(), stat) != 0)
+            return false;
+
+        // Hash the file again only when its size or modification time changed
+        IndexEntry* entry = findEntry(csvFilename);
+        if (entry == nullptr || entry->size != static_cast<uint64_t>(stat.fSize) || entry->mtime != static_cast<long>(stat.fMtime)) {
+            MappedFile file(csvFilename);
+            if (!file.isOpen())
+                return false;
+            char key[40];
+            snprintf(key, sizeof(key), "%016llx_%llu", static_cast<unsigned long long>(hashBytes(file.begin(), file.size())),
+                     static_cast<unsigned long long>(file.size()));
+            if (entry == nullptr) {
+                entries.push_back(IndexEntry());
+                entry = &entries.back();
+                entry->path = csvFilename;
+            }
+            entry->key = key;
+            entry->size = stat.fSize;
+            entry->mtime = stat.fMtime;
+        }
+        entry->lastUsed = static_cast<long>(time(nullptr));
+        std::string key = entry->key;
+
+        // Samples from the private store of the entry, or from the store of the capture
+        std::string captureStore = storeUsable(csvFilename, storeFilename) ? storeFilename : "";
+        hit = prefixCurrent(key, samplesPath(key, captureStore)) && capture.open(samplesPath(key, captureStore), prefixPath(key));
+        if (!hit && (!addEntry(csvFilename, key, pool, captureStore) || !capture.open(samplesPath(key, captureStore), prefixPath(key)))) {
+            invalidate(csvFilename);
+            return false;
+        }
+        evict(key);
+        saveIndex();
+        return true;
+    }
+
+    // Forget a capture, removing its entry files unless another path has the same content
+    void invalidate(const std::string& csvFilename) {
+        IndexEntry* entry = findEntry(csvFilename);
+        if (entry == nullptr)
+            return;
+        std::string key = entry->key;
+        entries.erase(entries.begin() + (entry - entries.data()));
+        if (std::none_of(entries.begin(), entries.end(), [&](const IndexEntry& e) { return e.key == key; }))
+            removeFiles(key);
+        saveIndex();
+    }
+
+    // Remove every entry
+    void clear() {
+        for (const IndexEntry& entry : entries)
+            removeFiles(entry.key);
+        entries.clear();
+        saveIndex();
+    }
+
+    // Bytes on disk of all entries
+    uint64_t totalBytes() const {
+        uint64_t total = 0;
+        std::vector<std::string> keys = uniqueKeys();
+        for (const std::string& key : keys)
+            total += entryBytes(key);
+        return total;
+    }
+
+private:
+    struct IndexEntry {
+        std::string key;        // <hash>_<size> of the content
+        uint64_t size = 0;      // Size and modification time seen when the file was hashed
+        long mtime = 0;
+        long lastUsed = 0;
+        std::string path;
+    };
+
+    std::string folder;
+    uint64_t maxBytes;
+    std::vector<IndexEntry> entries;
+
+    std::string storePath(const std::string& key) const { return folder + "/" + key + ".evs"; }
+    std::string prefixPath(const std::string& key) const { return folder + "/" + key + ".evp"; }
+
+    // Store of the samples of an entry: its own one if it has it, the store of the capture otherwise
+    std::string samplesPath(const std::string& key, const std::string& captureStore) const {
+        if (captureStore.empty() || !gSystem->AccessPathName(storePath(key).c_str()))
+            return storePath(key);
+        return captureStore;
+    }
+
+    // True if the prefix file of an entry was written after the store of its samples
+    bool prefixCurrent(const std::string& key, const std::string& samples) const {
+        FileStat_t prefixStat;
+        FileStat_t samplesStat;
+        return gSystem->GetPathInfo(prefixPath(key).c_str(), prefixStat) == 0 && gSystem->GetPathInfo(samples.c_str(), samplesStat) == 0 &&
+               prefixStat.fMtime >= samplesStat.fMtime;
+    }
+
+    // True if the event store of the capture exists and was written after the CSV
+    static bool storeUsable(const std::string& csvFilename, const std::string& storeFilename) {
+        FileStat_t csvStat;
+        FileStat_t storeStat;
+        return !storeFilename.empty() && gSystem->GetPathInfo(csvFilename.c_str(), csvStat) == 0 &&
+               gSystem->GetPathInfo(storeFilename.c_str(), storeStat) == 0 && storeStat.fMtime >= csvStat.fMtime;
+    }
+
+    IndexEntry* findEntry(const std::string& path) {
+        for (IndexEntry& entry : entries) {
+            if (entry.path == path)
+                return &entry;
+        }
+        return nullptr;
+    }
+
+    std::vector<std::string> uniqueKeys() const {
+        std::vector<std::string> keys;
+        for (const IndexEntry& entry : entries)
+            keys.push_back(entry.key);
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        return keys;
+    }
+
+    uint64_t entryBytes(const std::string& key) const {
+        uint64_t bytes = 0;
+        FileStat_t stat;
+        if (gSystem->GetPathInfo(storePath(key).c_str(), stat) == 0)
+            bytes += stat.fSize;
+        if (gSystem->GetPathInfo(prefixPath(key).c_str(), stat) == 0)
+            bytes += stat.fSize;
+        return bytes;
+    }
+
+    void removeFiles(const std::string& key) const {
+        remove(storePath(key).c_str());
+        remove(prefixPath(key).c_str());
+    }
+
+    // Prefix sums of the store of the capture, or parse the capture and write both files. Files are written
+    // under temporary names, renamed once complete.
+    bool addEntry(const std::string& csvFilename, const std::string& key, ROOT::TThreadExecutor& pool, const std::string& captureStore) {
+        std::string prefixTemp = prefixPath(key) + ".tmp";
+        EventStore store;
+        if (!captureStore.empty() && store.open(captureStore)) {
+            remove(storePath(key).c_str());
+            return writeEventPrefix(prefixTemp, store) && replaceFile(prefixTemp, prefixPath(key));
+        }
+
+        std::vector<std::vector<double>> data;
+        CSVRange range;
+        size_t resolution = 0;
+        {
+            MappedFile file(csvFilename);
+            if (!file.isOpen())
+                return false;
+            resolution = parseKeysightCSVParallel(file, data, range, pool, pool.GetPoolSize() * 4);
+        }
+        std::string storeTemp = storePath(key) + ".tmp";
+        if (!writeEventStore(storeTemp, data, resolution))
+            return false;
+        if (!writeEventPrefix(prefixTemp, data, resolution)) {
+            remove(storeTemp.c_str());
+            return false;
+        }
+        return replaceFile(storeTemp, storePath(key)) && replaceFile(prefixTemp, prefixPath(key));
+    }
+
+    // Remove least recently used entries until the cache fits in maxBytes, never the one in use
+    void evict(const std::string& keyInUse) {
+        std::vector<std::string> keys = uniqueKeys();
+        std::vector<std::pair<long, std::string>> byLastUse;
+        uint64_t total = 0;
+        for (const std::string& key : keys) {
+            long lastUsed = 0;
+            for (const IndexEntry& entry : entries) {
+                if (entry.key == key)
+                    lastUsed = std::max(lastUsed, entry.lastUsed);
+            }
+            byLastUse.push_back(std::make_pair(lastUsed, key));
+            total += entryBytes(key);
+        }
+        std::sort(byLastUse.begin(), byLastUse.end());
+        for (const auto& candidate : byLastUse) {
+            if (total <= maxBytes)
+                break;
+            if (candidate.second == keyInUse)
+                continue;
+            total -= std::min(total, entryBytes(candidate.second));
+            removeFiles(candidate.second);
+            entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const IndexEntry& e) { return e.key == candidate.second; }),
+                          entries.end());
+        }
+    }
+
+    // One line per capture path: key size mtime lastUsed path
+    void loadIndex() {
+        std::ifstream indexFile(folder + "/" + analysisCacheIndex);
+        std::string line;
+        while (std::getline(indexFile, line)) {
+            std::istringstream fields(line);
+            IndexEntry entry;
+            if (fields >> entry.key >> entry.size >> entry.mtime >> entry.lastUsed) {
+                fields.get();
+                std::getline(fields, entry.path);
+                if (!entry.path.empty())
+                    entries.push_back(entry);
+            }
+        }
+    }
+
+    // Written aside and renamed over the old index, false (with a warning) if it could not be replaced
+    bool saveIndex() const {
+        std::string indexPath = folder + "/" + analysisCacheIndex;
+        std::ofstream indexFile(indexPath + ".tmp");
+        for (const IndexEntry& entry : entries)
+            indexFile << entry.key << " " << entry.size << " " << entry.mtime << " " << entry.lastUsed << " " << entry.path << '\n';
+        indexFile.close();
+        if (indexFile.fail() || !replaceFile(indexPath + ".tmp", indexPath)) {
+            std::cerr << "Warning: Could not update " << indexPath << std::endl;
+            return false;
+        }
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,245 @@
+/*
+ *  Baseline Estimation
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * Baseline of every event from the points of its baseline portion. The mean
+ * used up to version 1.3 is pulled by any pre-pulse or pick-up spike in the
+ * first 10% of the event; the median, the truncated mean and the mode of the
+ * histogram of the points are not. Every estimate comes with the RMS of the
+ * baseline points, accumulated in one pass with Welford's method.
+ *
+ * An event whose baseline RMS is far above that of the rest of the capture
+ * (a pulse or a burst of noise in its baseline portion) has a baseline that
+ * cannot be trusted. flagBaselineOutliers marks it from the per-event sums
+ * alone (median and MAD of the baseline RMS of all events), so the samples
+ * are not read a second time, and ChargeAccumulator leaves it out.
+ */
+
+#ifndef BASELINE_ESTIMATION_H
+#define BASELINE_ESTIMATION_H
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "chargeAnalysis.h"
+
+// Estimators of the baseline
+enum BaselineMethod {
+    kBaselineMean = 0,              // Mean of the baseline points, as in version 1.3
+    kBaselineMedian = 1,            // Median of the baseline points
+    kBaselineTruncatedMean = 2,     // Mean without the truncateFraction lowest and highest points
+    kBaselineMode = 3               // Mean of the points of the fullest Freedman-Diaconis bin
+};
+
+// Options of the baseline estimation
+struct BaselineOptions {
+    BaselineMethod method = kBaselineMedian;
+    double truncateFraction = 0.1;  // Fraction of the points dropped at each end by the truncated mean
+    double rmsCut = 5;              // Events with a baseline RMS above median + rmsCut sigmas of all events are excluded (0 = none)
+};
+
+inline const char* baselineMethodName(BaselineMethod method) {
+    switch (method) {
+        case kBaselineMedian:
+            return "median";
+        case kBaselineTruncatedMean:
+            return "truncated mean";
+        case kBaselineMode:
+            return "mode";
+        default:
+            return "mean";
+    }
+}
+
+// Welford mean and variance. Partial results of the pool merge with the formula of Chan et al.
+struct RunningStats {
+    size_t count = 0;
+    double mean = 0;
+    double m2 = 0;                  // Sum of squared deviations from the mean
+
+    void add(double value) {
+        count++;
+        double delta = value - mean;
+        mean += delta / count;
+        m2 += delta * (value - mean);
+    }
+
+    void merge(const RunningStats& other) {
+        if (other.count == 0)
+            return;
+        size_t total = count + other.count;
+        double delta = other.mean - mean;
+        mean += delta * other.count / total;
+        m2 += other.m2 + delta * delta * count * other.count / total;
+        count = total;
+    }
+
+    double variance() const { return count > 1 ? m2 / (count - 1) : 0.0; }
+    double rms() const { return std::sqrt(variance()); }
+};
+
+// Baseline and RMS of the baseline points of one event
+struct BaselineEstimate {
+    double value = 0;
+    double rms = 0;
+    size_t points = 0;
+};
+
+// Baseline of count points
+template <typename T>
+BaselineEstimate estimateBaseline(const T* samples, size_t count, const BaselineOptions& options = BaselineOptions()) {
+    BaselineEstimate estimate;
+    RunningStats stats;
+    for (size_t point = 0; point < count; ++point)
+        stats.add(samples[point]);
+    estimate.value = stats.mean;
+    estimate.rms = stats.rms();
+    estimate.points = count;
+    if (count < 3 || options.method == kBaselineMean)
+        return estimate;
+
+    std::vector<double> sorted(samples, samples + count);
+    if (options.method == kBaselineMedian) {
+        size_t middle = count / 2;
+        std::nth_element(sorted.begin(), sorted.begin() + middle, sorted.end());
+        estimate.value = sorted[middle];
+        if (count % 2 == 0)
+            estimate.value = 0.5 * (estimate.value + *std::max_element(sorted.begin(), sorted.begin() + middle));
+        return estimate;
+    }
+
+    std::sort(sorted.begin(), sorted.end());
+    if (options.method == kBaselineTruncatedMean) {
+        size_t cut = std::min((count - 1) / 2, static_cast<size_t>(std::floor(options.truncateFraction * count)));
+        RunningStats kept;
+        for (size_t point = cut; point < count - cut; ++point)
+            kept.add(sorted[point]);
+        estimate.value = kept.mean;
+        return estimate;
+    }
+
+    // Mode: fullest bin of the histogram of the points. They are sorted, so every bin is a run of them.
+    double iqr = sorted[(3 * count) / 4] - sorted[count / 4];
+    HistogramBinning binning = binningFor(sorted.front(), sorted.back(), 2 * iqr / std::cbrt(static_cast<double>(count)), count);
+    double width = binning.width();
+    size_t bestFirst = 0;
+    size_t bestCount = 0;
+    size_t first = 0;
+    while (first < count) {
+        int bin = std::min(binning.bins - 1, static_cast<int>((sorted[first] - binning.low) / width));
+        double binEnd = binning.low + (bin + 1) * width;
+        size_t last = first + 1;
+        while (last < count && (sorted[last] < binEnd || bin == binning.bins - 1))
+            last++;
+        if (last - first > bestCount) {
+            bestFirst = first;
+            bestCount = last - first;
+        }
+        first = last;
+    }
+    RunningStats inBin;
+    for (size_t point = bestFirst; point < bestFirst + bestCount; ++point)
+        inBin.add(sorted[point]);
+    estimate.value = inBin.mean;
+    return estimate;
+}
+
+// Baseline of a zero-based event of a waveform container over its first count points. ADC codes are
+// estimated as they are and converted to volts once.
+inline BaselineEstimate estimateBaseline(const Waveforms& waveforms, size_t event, size_t count, const BaselineOptions& options = BaselineOptions()) {
+    count = std::min(count, waveforms.points());
+    switch (waveforms.sampleType()) {
+        case kWaveformFloat32:
+            return estimateBaseline(waveforms.event<float>(event), count, options);
+        case kWaveformInt16: {
+            BaselineEstimate estimate = estimateBaseline(waveforms.event<int16_t>(event), count, options);
+            estimate.value = estimate.value * waveforms.scale() + waveforms.offset();
+            estimate.rms = estimate.rms * std::fabs(waveforms.scale());
+            return estimate;
+        }
+        default:
+            return estimateBaseline(waveforms.event<double>(event), count, options);
+    }
+}
+
+// Stores the estimate in the sums of the event, for ChargeAccumulator
+inline void setBaseline(EventSums& sums, const BaselineEstimate& estimate) {
+    sums.baseline = estimate.value;
+    sums.baselineRMS = estimate.rms;
+    sums.baselineEstimated = true;
+}
+
+// Baseline of the baseline portion of an event of resolution samples
+template <typename T>
+void estimateEventBaseline(EventSums& sums, const T* samples, size_t resolution, const ChargeWindow& window, const BaselineOptions& options) {
+    setBaseline(sums, estimateBaseline(samples, baselineEndFor(resolution, window), options));
+}
+
+inline void estimateEventBaseline(EventSums& sums, const Waveforms& waveforms, size_t event, const ChargeWindow& window, const BaselineOptions& options) {
+    setBaseline(sums, estimateBaseline(waveforms, event, baselineEndFor(waveforms.points(), window), options));
+}
+
+// Marks the events whose baseline RMS is above median + rmsCut * 1.4826 * MAD of the baseline RMS of all
+// estimated events (the standard deviation when the MAD is 0). Returns the number of events marked.
+inline size_t flagBaselineOutliers(std::vector<EventSums>& eventSums, double rmsCut) {
+    if (!(rmsCut > 0))
+        return 0;
+    std::vector<double> rms;
+    RunningStats stats;
+    for (const EventSums& sums : eventSums) {
+        if (sums.baselineEstimated) {
+            rms.push_back(sums.baselineRMS);
+            stats.add(sums.baselineRMS);
+        }
+    }
+    if (rms.size() < 3)
+        return 0;
+
+    size_t middle = rms.size() / 2;
+    std::nth_element(rms.begin(), rms.begin() + middle, rms.end());
+    double median = rms[middle];
+    for (double& value : rms)
+        value = std::fabs(value - median);
+    std::nth_element(rms.begin(), rms.begin() + middle, rms.end());
+    double sigma = 1.4826 * rms[middle];
+    if (!(sigma > 0))
+        sigma = stats.rms();
+    if (!(sigma > 0))
+        return 0;
+
+    double limit = median + rmsCut * sigma;
+    size_t flagged = 0;
+    for (EventSums& sums : eventSums) {
+        if (sums.baselineEstimated && sums.baselineRMS > limit) {
+            sums.baselineOutlier = true;
+            flagged++;
+        }
+    }
+    return flagged;
+}
+
+// Baseline, baseline RMS and exclusion of every event, in volts
+inline bool writeBaselineFile(const std::string& path, const std::vector<EventSums>& eventSums, const BaselineOptions& options) {
+    std::ofstream baselineFile(path);
+    if (!baselineFile.is_open())
+        return false;
+
+    size_t excluded = 0;
+    for (const EventSums& sums : eventSums)
+        excluded += sums.baselineOutlier ? 1 : 0;
+    baselineFile << "- SUMMARY -----------------------------------------------------" << std::endl;
+    baselineFile << "Baseline estimator: " << baselineMethodName(options.method) << std::endl;
+    baselineFile << "Baseline RMS cut: " << options.rmsCut << " sigmas" << std::endl;
+    baselineFile << "Excluded events: " << excluded << " of " << eventSums.size() << std::endl;
+    baselineFile << " " << std::endl;
+    baselineFile << "- EVENT BASELINE RMS EXCLUDED ---------------------------------" << std::endl;
+    for (const EventSums& sums : eventSums) {
+        baselineFile << sums.eventNumber << ' ' << eventBaseline(sums) << ' ' << sums.baselineRMS << ' ' << (sums.baselineOutlier ? 1 : 0) << '\n';
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,334 @@
+/*
+ *  Batch Processing by Charly
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * This code is a ROOT macro that processes every capture folder of a run
+ * campaign (an HV or LED scan) with a single command, instead of editing
+ * filefolder in csvRead.cpp and chargeHisto.cpp for every capture.
+ *
+ * A capture folder is a folder NAME that contains NAME.csv, as expected by
+ * csvRead.cpp. For every folder matching folderPattern inside campaignFolder
+ * the macro parses the CSV, writes the event store and the charge outputs of
+ * chargeHisto.cpp (baseline of every event with baselineOptions and the same
+ * baseline RMS cut, and txt/Baselines.txt), and estimates the gain and the mean number of
+ * photoelectrons from the charge distribution, both with photostatistics and
+ * with a fit of the charge spectrum (chargeFit.h). The results of all folders
+ * are written to a summary table, one line per run, with the fields used
+ * by gainandpe.py.
+ *
+ * Up to concurrentRuns folders are processed at the same time, all of them
+ * on one shared thread pool, so the machine is used fully without starting
+ * more threads than cores.
+ *
+ * Run it with: root -l -b -q batchRun.cpp
+ */
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include "TSystem.h"
+#include "TString.h"
+#include "TRegexp.h"
+#include "ROOT/TThreadExecutor.hxx"
+#include "keysightCSV.h"
+#include "eventStore.h"
+#include "chargeAnalysis.h"
+#include "baselineEstimation.h"
+#include "chargeFit.h"
+#include "signalWindow.h"
+
+using namespace std;
+
+using std::chrono::high_resolution_clock;
+using std::chrono::duration;
+
+// EDITABLE Variables
+//--------------------------------------------------------------------------------------------------------------
+// Folder that contains the capture folders of the campaign
+string campaignFolder = "/home/martinus/Escritorio/ledchar"; // <-- EDIT THIS --
+
+// Wildcard on the names of the capture folders, e.g. "800V_*" ("*" = all)
+string folderPattern = "*";
+
+// Capture folders processed at the same time (every one holds its whole CSV in memory)
+unsigned int concurrentRuns = 2;
+
+// Threads of the pool shared by all runs (0 = all cores)
+unsigned int numberOfThreads = 0;
+
+// First and last time point of the charge integration window
+double minTimeValue = 3000;
+double maxTimeValue = 4000;
+
+// Window of every run from the mean waveform of a strided sample of its events (see signalWindow.h);
+// minTimeValue and maxTimeValue are used for the runs where no pulse is found
+bool autoWindow = true;
+
+// Running baseline across events, as chargeHisto 1.2
+bool runningBaseline = false;
+
+// Baseline estimator and RMS cut of every event, as baselineOptions of chargeHisto.cpp (see baselineEstimation.h):
+// {method, truncateFraction, rmsCut}, rmsCut = 0 keeps every event
+BaselineOptions baselineOptions = {kBaselineMedian, 0.1, 5};
+
+// Write <name>.evs in every capture folder, as csvRead does
+bool writeEventStoreFiles = true;
+
+// Write the Charge Histogram, Min/MaxVoltages files and ROOT file in every capture folder, as chargeHisto does
+bool writeChargeFiles = true;
+
+// Fit the charge spectrum of every run (and write <name>_fit.txt with the charge files)
+bool fitSpectra = true;
+
+// Summary table, written inside campaignFolder
+string summaryFilename = "batch_summary.txt";
+//--------------------------------------------------------------------------------------------------------------
+
+// Result of one capture folder
+struct RunSummary {
+    string name;
+    int status = 0;             // 0 or the error code of csvRead/chargeHisto
+    size_t resolution = 0;
+    double minTimeValue = 0;    // Integration window used
+    double maxTimeValue = 0;
+    double seconds = 0;
+    GainEstimate estimate;
+    ChargeFit fit;
+};
+
+// Serializes console output and the ROOT objects of the charge outputs
+mutex outputMutex;
+
+// Function to find the capture folders of the campaign -----------------------------------------------------------------------------------
+vector<string> findCaptureFolders() {
+    vector<string> folders;
+    void* directory = gSystem->OpenDirectory(campaignFolder.c_str());
+    if (directory == nullptr) {
+        return folders;
+    }
+
+    TRegexp wildcard(folderPattern.c_str(), kTRUE);
+    while (const char* entry = gSystem->GetDirEntry(directory)) {
+        string name = entry;
+        if (name == "." || name == ".." || !TString(entry).Contains(wildcard)) {
+            continue;
+        }
+        string filefolder = campaignFolder + "/" + name;
+        if (!gSystem->AccessPathName((filefolder + "/" + name + ".csv").c_str())) {
+            folders.push_back(filefolder);
+        }
+    }
+    gSystem->FreeDirectory(directory);
+
+    sort(folders.begin(), folders.end());
+    return folders;
+}
+
+// Function to process one capture folder -------------------------------------------------------------------------------------------------
+RunSummary processRun(const string& filefolder, ROOT::TThreadExecutor& pool) {
+    RunSummary run;
+    run.name = filefolder.substr(filefolder.find_last_of("/") + 1);
+    auto start = high_resolution_clock::now();
+
+    auto report = [&](const string& message) {
+        lock_guard<mutex> lock(outputMutex);
+        cout << "[" << run.name << "] " << message << endl;
+    };
+
+    // Read data from CSV, on the shared pool
+    string filename = filefolder + "/" + run.name + ".csv";
+    vector<vector<double>> data;
+    CSVRange range;
+    {
+        MappedFile file(filename);
+        if (!file.isOpen()) {
+            report("- ERROR - Could not open file " + filename);
+            run.status = 1;
+            return run;
+        }
+        run.resolution = parseKeysightCSVParallel(file, data, range, pool, pool.GetPoolSize() * 4);
+    }
+    size_t events = data.size() / 2;
+    if (events == 0 || run.resolution < 2) {
+        report("- ERROR - No events found in " + filename);
+        run.status = 1;
+        return run;
+    }
+
+    // Integration window
+    ChargeWindow window;
+    window.baselinePortion = baselinePortionFor(run.resolution);
+    window.minTimeValue = minTimeValue;
+    window.maxTimeValue = maxTimeValue;
+    if (autoWindow) {
+        DetectedWindow detected = detectSignalWindow(events, run.resolution, [&](size_t event, double* out) {
+            copy(data[2 * event + 1].begin(), data[2 * event + 1].begin() + run.resolution, out);
+        });
+        if (detected.found) {
+            window.minTimeValue = detected.minTimeValue;
+            window.maxTimeValue = detected.maxTimeValue;
+        } else {
+            report("- WARNING - No pulse found in the mean waveform, using minTimeValue and maxTimeValue");
+        }
+    }
+    run.minTimeValue = window.minTimeValue;
+    run.maxTimeValue = window.maxTimeValue;
+    if (window.maxTimeValue > run.resolution) {
+        report("- ERROR - maxTimeValue > resolution");
+        run.status = 2;
+        return run;
+    } else if (window.minTimeValue <= 0) {
+        report("- ERROR - Invalid minTimeValue");
+        run.status = 3;
+        return run;
+    }
+
+    // Event store
+    string storeFilename = filefolder + "/" + run.name + ".evs";
+    if (writeEventStoreFiles && !writeEventStore(storeFilename, data, run.resolution)) {
+        report("- ERROR - Could not write event store " + storeFilename);
+        run.status = 9;
+        return run;
+    }
+
+    // Charges and baseline of every event, added in event order
+    vector<EventSums> eventSums = sumEventsParallel(pool, events, [&](size_t event) {
+        EventSums sums = sumEvent(data[2 * event + 1].data(), run.resolution, window);
+        estimateEventBaseline(sums, data[2 * event + 1].data(), run.resolution, window, baselineOptions);
+        return sums;
+    }, pool.GetPoolSize() * 4);
+    size_t excluded = flagBaselineOutliers(eventSums, baselineOptions.rmsCut);
+    if (excluded > 0)
+        report("- " + to_string(excluded) + " events excluded for their baseline RMS");
+    double deltaT = data[0].back() - data[0][data[0].size() - 2];
+    ChargeAccumulator charges(deltaT/50.0, runningBaseline);
+    for (const EventSums& sums : eventSums) {
+        charges.add(sums);
+    }
+    vector<double> areas = keptValues(charges.get().areas);
+    run.estimate = estimateGain(areas);
+
+    // Spectrum fit, on this worker: the fits of the concurrent runs go in parallel
+    if (fitSpectra) {
+        run.fit = fitChargeSpectrum(areas);
+        if (run.fit.status != 0) {
+            report("- WARNING - Charge spectrum fit did not converge (status " + to_string(run.fit.status) + ")");
+        }
+    }
+
+    // Charge Histogram, Min/Max Voltages Files and ROOT File
+    if (writeChargeFiles) {
+        lock_guard<mutex> lock(outputMutex);
+        gSystem->mkdir((filefolder + "/images").c_str(), kTRUE);
+        gSystem->mkdir((filefolder + "/txt").c_str(), kTRUE);
+        run.status = writeChargeOutputs(filefolder, charges.get(), window, data[0][window.minTimeValue - 1], data[0][window.maxTimeValue - 1]);
+        if (run.status == 0 && !writeBaselineFile(filefolder + "/txt/Baselines.txt", eventSums, baselineOptions)) {
+            cerr << "[" << run.name << "] - ERROR - Could not write txt/Baselines.txt" << endl;
+            run.status = 13;
+        }
+        if (run.status == 0 && fitSpectra) {
+            ofstream fitFile(filefolder + "/" + run.name + "_fit.txt");
+            if (!fitFile.is_open()) {
+                cerr << "[" << run.name << "] - ERROR - Could not write " << run.name << "_fit.txt" << endl;
+                run.status = 11;
+            } else {
+                writeChargeFitHeader(fitFile);
+                writeChargeFitLine(fitFile, run.name, run.fit);
+            }
+        }
+    }
+
+    run.seconds = duration<double>(high_resolution_clock::now() - start).count();
+    report("- " + to_string(events) + " events processed in " + to_string(run.seconds) + " seconds");
+    return run;
+}
+
+// Function to write the summary table ----------------------------------------------------------------------------------------------------
+void writeSummary(ostream& output, const vector<RunSummary>& runs) {
+    output << "# Run Events Resolution MeanCharge[pC] SigmaCharge[pC] Gain GainError MeanPE MeanPEError Seconds Status"
+           << " FitGain FitGainError FitMeanPE FitMeanPEError FitChi2 FitNDF FitStatus MinTimeValue MaxTimeValue" << endl;
+    for (const RunSummary& run : runs) {
+        output << run.name << " " << run.estimate.events << " " << run.resolution << " "
+               << run.estimate.meanCharge * chargeMultiplier << " " << run.estimate.sigmaCharge * chargeMultiplier << " "
+               << run.estimate.gain << " " << run.estimate.gainError << " "
+               << run.estimate.meanPE << " " << run.estimate.meanPEError << " "
+               << run.seconds << " " << run.status << " "
+               << run.fit.gain << " " << run.fit.gainError << " "
+               << run.fit.value[kFitMeanPE] << " " << run.fit.error[kFitMeanPE] << " "
+               << run.fit.chi2 << " " << run.fit.ndf << " " << run.fit.status << " "
+               << run.minTimeValue << " " << run.maxTimeValue << endl;
+    }
+}
+
+// Main function --------------------------------------------------------------------------------------------------------------------------
+int batchRun() {
+
+    // Record the start time
+    auto start = high_resolution_clock::now();
+
+    // Runs share ROOT objects from several threads
+    ROOT::EnableThreadSafety();
+
+    //Mode for ROOT graphics
+    gROOT->SetBatch(kTRUE);  // Set to kTRUE to run in batch mode (no GUI)
+
+    // Welcome message
+    cout << " " << endl;
+    cout << "   ***   Batch Processing by Charly   ***   " << endl;
+    cout << " " << endl;
+
+    vector<string> folders = findCaptureFolders();
+    if (folders.empty()) {
+        cerr << "Error: No capture folders matching " << folderPattern << " in " << campaignFolder << endl;
+        return 1;
+    }
+
+    // One pool for everything: the concurrent runs and the parallel steps inside every run
+    ROOT::TThreadExecutor pool(numberOfThreads);
+    unsigned int workers = max(1u, min(concurrentRuns, static_cast<unsigned int>(folders.size())));
+    cout << "Processing " << folders.size() << " capture folders, " << workers << " at a time on " << pool.GetPoolSize() << " threads..." << endl;
+    cout << " " << endl;
+
+    // Every worker takes the next folder until none are left
+    vector<RunSummary> runs(folders.size());
+    atomic<size_t> nextRun(0);
+    pool.Foreach([&](unsigned) {
+        for (size_t index = nextRun++; index < folders.size(); index = nextRun++) {
+            runs[index] = processRun(folders[index], pool);
+        }
+    }, ROOT::TSeqU(workers));
+
+    // Summary table
+    string summaryPath = campaignFolder + "/" + summaryFilename;
+    ofstream summaryFile(summaryPath);
+    if (!summaryFile.is_open()) {
+        cerr << "Error: Could not open file " << summaryPath << endl;
+        return 1;
+    }
+    writeSummary(summaryFile, runs);
+
+    int status = 0;
+    for (const RunSummary& run : runs) {
+        status = max(status, run.status);
+    }
+
+    // Print summary
+    cout << " " << endl;
+    cout << "- SUMMARY ---------------------------------------------------------------------------------------------" << endl;
+    cout << " " << endl;
+    writeSummary(cout, runs);
+    cout << " " << endl;
+    cout << "- Summary table: " << summaryPath << endl;
+    cout << "- Execution time: " << duration<double>(high_resolution_clock::now() - start).count() << " seconds." << endl;
+    cout << "-------------------------------------------------------------------------------------------------------" << endl;
+    cout << " " << endl;
+
+    return status;
+}
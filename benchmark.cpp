@@ -0,0 +1,995 @@
+/*
+ *  Benchmarks by Charly
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * This code is a ROOT macro that measures the throughput of the processing
+ * steps used by csvRead.cpp and chargeHisto.cpp on a synthetic Keysight
+ * capture, so no real scope files are needed.
+ *
+ * Run it with: root -l -b -q benchmark.cpp
+ * The synthetic capture is generated in benchFolder the first time and
+ * reused in later runs.
+ *
+ * The regression suite times the CSV parse of readCSV, the txt writer, the
+ * chargeHisto integration and the histogram fill on captures of every size
+ * in benchSuiteBytes. Its results are written to benchResultsFile and
+ * compared with benchBaselineFile: a step slower than the baseline by more
+ * than benchRegressionTolerance is reported as a regression. The baseline
+ * is written from the results of the first run on the machine (or of any
+ * run with benchUpdateBaseline), since timings of another machine do not
+ * compare. Everything runs offline.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <random>
+#include <cmath>
+#include <map>
+#include <sstream>
+#include "TSystem.h"
+#include "TCanvas.h"
+#include "TGraph.h"
+#include "TMultiGraph.h"
+#include "TH1D.h"
+#include "TH2D.h"
+#include "TImage.h"
+#include "ROOT/TThreadExecutor.hxx"
+#include "ROOT/RDataFrame.hxx"
+#include "keysightCSV.h"
+#include "eventStore.h"
+#include "chargeAnalysis.h"
+#include "analysisCache.h"
+#include "syntheticCapture.h"
+#include "eventPlots.h"
+#include "eventAccess.h"
+#include "streamingHistogram.h"
+
+using namespace std;
+
+using std::chrono::high_resolution_clock;
+using std::chrono::duration;
+
+// EDITABLE Variables
+//--------------------------------------------------------------------------------------------------------------
+// Folder for the synthetic capture
+string benchFolder = "bench"; // <-- EDIT THIS --
+
+// Size of the synthetic capture in bytes
+size_t benchTargetBytes = 1024UL * 1024UL * 1024UL;
+
+// Points per event of the synthetic capture
+size_t benchResolution = 6000;
+
+// Highest thread count for the scaling benchmarks (0 = all hardware threads)
+unsigned benchMaxThreads = 0;
+
+// Run the regression suite and the detailed benchmarks
+bool benchRunSuite = true;
+bool benchRunDetailed = true;
+
+// Capture sizes of the regression suite in bytes, one synthetic capture each
+vector<size_t> benchSuiteBytes = {16UL * 1024UL * 1024UL, 64UL * 1024UL * 1024UL, 256UL * 1024UL * 1024UL};
+
+// Repetitions of every suite step, the fastest one is kept
+int benchSuiteRepetitions = 3;
+
+// Results of the suite and baseline they are compared with, both in benchFolder
+string benchResultsFile = "benchmark_results.txt";
+string benchBaselineFile = "benchmark_baseline.txt";
+
+// A step slower than its baseline time by this factor is a regression
+double benchRegressionTolerance = 1.25;
+
+// Replace the baseline with the results of this run
+bool benchUpdateBaseline = false;
+
+// Fraction of the pixels of the overlapped plot allowed to differ between the full and the M4 decimated traces
+double benchPlotPixelTolerance = 0.001;
+//--------------------------------------------------------------------------------------------------------------
+
+// Seconds elapsed since start
+double secondsSince(high_resolution_clock::time_point start) {
+    return duration<double>(high_resolution_clock::now() - start).count();
+}
+
+// Create the synthetic capture of about targetBytes if it does not exist yet and return its path
+string syntheticCapturePath(const string& name, size_t targetBytes) {
+    string capturePath = benchFolder + "/" + name;
+    ifstream existing(capturePath);
+    if (existing.is_open())
+        return capturePath;
+
+    gSystem->mkdir(benchFolder.c_str(), kTRUE);
+    SyntheticCaptureConfig config;
+    config.resolution = benchResolution;
+    config.numberOfEvents = syntheticEventsForSize(targetBytes, benchResolution);
+    cout << "Generating synthetic capture with " << config.numberOfEvents << " events in " << capturePath << " ..." << endl;
+    auto start = high_resolution_clock::now();
+    if (!writeSyntheticCapture(capturePath, config)) {
+        cerr << "Error: Could not create " << capturePath << endl;
+        return "";
+    }
+    cout << "Generated in " << secondsSince(start) << " seconds." << endl;
+    return capturePath;
+}
+
+string syntheticCapturePath() {
+    return syntheticCapturePath("synthetic_capture.csv", benchTargetBytes);
+}
+
+// Compare the output of two readers value by value
+bool sameCSVResult(const vector<vector<double>>& a, const CSVRange& rangeA, const vector<vector<double>>& b, const CSVRange& rangeB) {
+    if (a != b)
+        return false;
+    return rangeA.minX == rangeB.minX && rangeA.maxX == rangeB.maxX && rangeA.minY == rangeB.minY && rangeA.maxY == rangeB.maxY;
+}
+
+// Benchmark of istringstream reader vs memory-mapped reader -----------------------------------------------------------------------------
+int benchmarkCSVParse(const string& capturePath) {
+
+    MappedFile file(capturePath);
+    if (!file.isOpen()) {
+        cerr << "Error: Could not open file " << capturePath << endl;
+        return 1;
+    }
+    double megabytes = file.size() / (1024.0 * 1024.0);
+
+    // Warm the page cache so both readers start from the same state
+    size_t warmLines = countLines(file.begin(), file.end());
+    cout << " " << endl;
+    cout << "- CSV PARSE -------------------------------------------------------------------------------------------" << endl;
+    cout << "- File: " << capturePath << " (" << megabytes << " MB, " << warmLines << " lines)" << endl;
+
+    // istringstream reader
+    vector<vector<double>> streamData;
+    CSVRange streamRange;
+    auto start = high_resolution_clock::now();
+    size_t streamRows = readKeysightCSVStream(capturePath, streamData, streamRange);
+    double streamSeconds = secondsSince(start);
+    cout << "- istringstream reader: " << streamSeconds << " s, " << megabytes / streamSeconds << " MB/s, " << streamRows << " rows" << endl;
+
+    // Memory-mapped reader
+    vector<vector<double>> mappedData;
+    CSVRange mappedRange;
+    start = high_resolution_clock::now();
+    size_t mappedRows = parseKeysightCSV(file, mappedData, mappedRange);
+    double mappedSeconds = secondsSince(start);
+    cout << "- Memory-mapped reader: " << mappedSeconds << " s, " << megabytes / mappedSeconds << " MB/s, " << mappedRows << " rows" << endl;
+    cout << "- Speedup: " << streamSeconds / mappedSeconds << "x" << endl;
+
+    // Both readers must give the same columns and global min/max
+    bool identical = streamRows == mappedRows && sameCSVResult(streamData, streamRange, mappedData, mappedRange);
+    cout << "- Results identical: " << (identical ? "yes" : "NO") << endl;
+    return identical ? 0 : 2;
+}
+
+// Thread counts 1, 2, 4, ... up to benchMaxThreads
+vector<unsigned> benchThreadCounts() {
+    unsigned maxThreads = benchMaxThreads > 0 ? benchMaxThreads : max(1u, thread::hardware_concurrency());
+    vector<unsigned> counts;
+    for (unsigned threads = 1; threads < maxThreads; threads *= 2)
+        counts.push_back(threads);
+    counts.push_back(maxThreads);
+    return counts;
+}
+
+// Scaling of the parallel chunked reader over thread counts -----------------------------------------------------------------------------
+int benchmarkParallelCSVParse(const string& capturePath) {
+
+    MappedFile file(capturePath);
+    if (!file.isOpen()) {
+        cerr << "Error: Could not open file " << capturePath << endl;
+        return 1;
+    }
+    double megabytes = file.size() / (1024.0 * 1024.0);
+
+    cout << " " << endl;
+    cout << "- PARALLEL CSV PARSE ----------------------------------------------------------------------------------" << endl;
+
+    // Serial reader as reference
+    vector<vector<double>> serialData;
+    CSVRange serialRange;
+    auto start = high_resolution_clock::now();
+    size_t serialRows = parseKeysightCSV(file, serialData, serialRange);
+    double serialSeconds = secondsSince(start);
+    cout << "- Serial:    " << serialSeconds << " s, " << megabytes / serialSeconds << " MB/s" << endl;
+
+    bool identical = true;
+    for (unsigned threads : benchThreadCounts()) {
+        ROOT::TThreadExecutor pool(threads);
+        vector<vector<double>> parallelData;
+        CSVRange parallelRange;
+        start = high_resolution_clock::now();
+        size_t parallelRows = parseKeysightCSVParallel(file, parallelData, parallelRange, pool, threads * 4);
+        double parallelSeconds = secondsSince(start);
+
+        bool same = parallelRows == serialRows && sameCSVResult(serialData, serialRange, parallelData, parallelRange);
+        identical = identical && same;
+        cout << "- " << threads << " threads: " << parallelSeconds << " s, " << megabytes / parallelSeconds << " MB/s, speedup "
+             << serialSeconds / parallelSeconds << "x, bit-identical: " << (same ? "yes" : "NO") << endl;
+    }
+    return identical ? 0 : 2;
+}
+
+// Size of a file in bytes (0 if it does not exist)
+double fileBytes(const string& path) {
+    ifstream file(path, ios::binary | ios::ate);
+    return file.is_open() ? static_cast<double>(file.tellg()) : 0;
+}
+
+// Event outputs: txt files vs binary store vs TTree --------------------------------------------------------------------------------------
+int benchmarkEventOutput(const string& capturePath) {
+
+    MappedFile file(capturePath);
+    if (!file.isOpen()) {
+        cerr << "Error: Could not open file " << capturePath << endl;
+        return 1;
+    }
+    vector<vector<double>> data;
+    CSVRange range;
+    ROOT::TThreadExecutor pool;
+    size_t resolution = parseKeysightCSVParallel(file, data, range, pool, pool.GetPoolSize() * 4);
+    size_t events = data.size() / 2;
+    double sampleMegabytes = events * resolution * sizeof(double) / (1024.0 * 1024.0);
+
+    cout << " " << endl;
+    cout << "- EVENT OUTPUT ----------------------------------------------------------------------------------------" << endl;
+    cout << "- " << events << " events x " << resolution << " points (" << sampleMegabytes << " MB of samples)" << endl;
+
+    // Write every format
+    gSystem->mkdir((benchFolder + "/txt").c_str(), kTRUE);
+    string storePath = benchFolder + "/bench.evs";
+    string lz4Path = benchFolder + "/bench_lz4_events.root";
+    string zstdPath = benchFolder + "/bench_zstd_events.root";
+    EventTreeOptions lz4Options;
+    lz4Options.compressionAlgorithm = ROOT::RCompressionSetting::EAlgorithm::kLZ4;
+    lz4Options.compressionLevel = 4;
+    EventTreeOptions zstdOptions;
+
+    auto reportWrite = [&](const string& name, double seconds, double bytes) {
+        cout << "- Write " << name << seconds << " s, " << sampleMegabytes / seconds << " MB/s, " << bytes / (1024.0 * 1024.0) << " MB on disk" << endl;
+    };
+
+    auto start = high_resolution_clock::now();
+    bool ok = writeEventTxtFiles(benchFolder, data);
+    double txtSeconds = secondsSince(start);
+    double txtBytes = fileBytes(benchFolder + "/txt/Time_Window.txt");
+    for (size_t event = 1; event <= events; ++event)
+        txtBytes += fileBytes(benchFolder + "/txt/Event" + to_string(event) + ".txt");
+    reportWrite("txt files:    ", txtSeconds, txtBytes);
+
+    start = high_resolution_clock::now();
+    ok = ok && writeEventStore(storePath, data, resolution);
+    reportWrite("event store:  ", secondsSince(start), fileBytes(storePath));
+
+    start = high_resolution_clock::now();
+    ok = ok && writeEventTree(lz4Path, data, resolution, lz4Options);
+    reportWrite("TTree (LZ4):  ", secondsSince(start), fileBytes(lz4Path));
+
+    start = high_resolution_clock::now();
+    ok = ok && writeEventTree(zstdPath, data, resolution, zstdOptions);
+    reportWrite("TTree (ZSTD): ", secondsSince(start), fileBytes(zstdPath));
+    if (!ok) {
+        cerr << "Error: Could not write the event outputs in " << benchFolder << endl;
+        return 1;
+    }
+    data.clear();
+    data.shrink_to_fit();
+
+    // Read every format back, summing all samples
+    auto reportRead = [&](const string& name, double seconds, double sum) {
+        cout << "- Read " << name << seconds << " s, " << sampleMegabytes / seconds << " MB/s (sum " << sum << ")" << endl;
+    };
+
+    start = high_resolution_clock::now();
+    double txtSum = 0;
+    for (size_t event = 1; event <= events; ++event) {
+        ifstream eventFile(benchFolder + "/txt/Event" + to_string(event) + ".txt");
+        double value;
+        while (eventFile >> value)
+            txtSum += value;
+    }
+    reportRead("txt files:     ", secondsSince(start), txtSum);
+
+    start = high_resolution_clock::now();
+    EventStore store;
+    double storeSum = 0;
+    if (store.open(storePath)) {
+        for (size_t event = 0; event < store.eventCount(); ++event) {
+            const double* samples = store.event(event);
+            for (size_t point = 0; point < store.resolution(); ++point)
+                storeSum += samples[point];
+        }
+    }
+    reportRead("event store:   ", secondsSince(start), storeSum);
+
+    ROOT::EnableImplicitMT();
+    for (const string& treePath : {lz4Path, zstdPath}) {
+        start = high_resolution_clock::now();
+        ROOT::RDataFrame dataFrame(eventTreeName, treePath);
+        double treeSum = *dataFrame.Define("eventSum", [](const ROOT::RVecF& samples) {
+            double sum = 0;
+            for (float value : samples)
+                sum += value;
+            return sum;
+        }, {"samples"}).Sum<double>("eventSum");
+        reportRead(treePath == lz4Path ? "TTree (LZ4):   " : "TTree (ZSTD):  ", secondsSince(start), treeSum);
+    }
+    ROOT::DisableImplicitMT();
+    return 0;
+}
+
+// Event-parallel charge computation over thread counts ----------------------------------------------------------------------------------
+int benchmarkParallelCharges() {
+
+    // Event store written by benchmarkEventOutput
+    string storePath = benchFolder + "/bench.evs";
+    EventStore store;
+    if (!store.open(storePath)) {
+        cerr << "Error: Could not open event store " << storePath << endl;
+        return 1;
+    }
+    size_t events = store.eventCount();
+    size_t resolution = store.resolution();
+    ChargeWindow window;
+    window.baselinePortion = baselinePortionFor(resolution);
+    window.minTimeValue = resolution / 2;
+    window.maxTimeValue = resolution * 2 / 3;
+    double constantFactor = store.deltaT() / 50.0;
+
+    cout << " " << endl;
+    cout << "- PARALLEL CHARGES ------------------------------------------------------------------------------------" << endl;
+    cout << "- " << events << " events x " << resolution << " points" << endl;
+
+    // Serial event loop as reference
+    auto start = high_resolution_clock::now();
+    ChargeAccumulator serialCharges(constantFactor);
+    for (size_t event = 0; event < events; ++event)
+        serialCharges.add(sumEvent(store.event(event), resolution, window));
+    double serialSeconds = secondsSince(start);
+    const ChargeResults& serial = serialCharges.get();
+    cout << "- Serial:    " << serialSeconds << " s, " << events / serialSeconds << " events/s" << endl;
+
+    bool identical = true;
+    for (unsigned threads : benchThreadCounts()) {
+        ROOT::TThreadExecutor pool(threads);
+        start = high_resolution_clock::now();
+        vector<EventSums> eventSums = sumEventsParallel(pool, events, [&](size_t event) {
+            return sumEvent(store.event(event), resolution, window);
+        }, threads * 4);
+        ChargeAccumulator charges(constantFactor);
+        for (const EventSums& sums : eventSums)
+            charges.add(sums);
+        double parallelSeconds = secondsSince(start);
+
+        const ChargeResults& parallel = charges.get();
+        bool same = parallel.areas == serial.areas && parallel.minVoltages == serial.minVoltages && parallel.maxVoltages == serial.maxVoltages;
+        identical = identical && same;
+        cout << "- " << threads << " threads: " << parallelSeconds << " s, " << events / parallelSeconds << " events/s, speedup "
+             << serialSeconds / parallelSeconds << "x, bit-identical: " << (same ? "yes" : "NO") << endl;
+    }
+    return identical ? 0 : 2;
+}
+
+// Analysis cache: first run vs reruns with new windows ----------------------------------------------------------------------------------
+int benchmarkAnalysisCache(const string& capturePath) {
+
+    cout << " " << endl;
+    cout << "- ANALYSIS CACHE --------------------------------------------------------------------------------------" << endl;
+
+    // Empty cache: hash, parse and write the entry
+    ROOT::TThreadExecutor pool;
+    AnalysisCache cache(benchFolder + "/analysis_cache", 1ULL << 40);
+    cache.clear();
+    CachedCapture cold;
+    bool hit = false;
+    auto start = high_resolution_clock::now();
+    if (!cache.open(capturePath, pool, cold, hit)) {
+        cerr << "Error: Could not add " << capturePath << " to the analysis cache" << endl;
+        return 1;
+    }
+    cout << "- First run (parse and write): " << secondsSince(start) << " s, " << cache.totalBytes() / (1024.0 * 1024.0) << " MB on disk" << endl;
+
+    // Unchanged capture: only the index lookup and the mapping
+    CachedCapture cached;
+    start = high_resolution_clock::now();
+    if (!cache.open(capturePath, pool, cached, hit) || !hit) {
+        cerr << "Error: Cache entry of " << capturePath << " not found on the second open" << endl;
+        return 2;
+    }
+    cout << "- Rerun open: " << secondsSince(start) * 1000 << " ms" << endl;
+
+    // Every window from prefix sums vs a pass over the samples, with both files already in the page cache
+    size_t resolution = cached.resolution();
+    ChargeWindow window;
+    window.baselinePortion = baselinePortionFor(resolution);
+    window.minTimeValue = 1;
+    window.maxTimeValue = resolution - 1;
+    for (size_t event = 0; event < cached.eventCount(); ++event) {
+        cached.eventSums(event, window);
+        sumEvent(cached.event(event), resolution, window);
+    }
+    bool same = true;
+    double largestDifference = 0;
+    double cacheSeconds = 0;
+    double samplesSeconds = 0;
+    for (size_t width : {resolution / 60, resolution / 6, resolution / 2}) {
+        window.minTimeValue = resolution / 3;
+        window.maxTimeValue = window.minTimeValue + width;
+        start = high_resolution_clock::now();
+        vector<EventSums> fromCache(cached.eventCount());
+        for (size_t event = 0; event < cached.eventCount(); ++event)
+            fromCache[event] = cached.eventSums(event, window);
+        cacheSeconds += secondsSince(start);
+
+        start = high_resolution_clock::now();
+        for (size_t event = 0; event < cached.eventCount(); ++event) {
+            EventSums sums = sumEvent(cached.event(event), resolution, window);
+            largestDifference = max(largestDifference, fabs(sums.windowSum - fromCache[event].windowSum));
+            largestDifference = max(largestDifference, fabs(sums.baselineSum - fromCache[event].baselineSum));
+            same = same && sums.windowMin == fromCache[event].windowMin && sums.windowMax == fromCache[event].windowMax &&
+                   sums.windowCount == fromCache[event].windowCount && sums.baselineCount == fromCache[event].baselineCount;
+        }
+        samplesSeconds += secondsSince(start);
+    }
+    cout << "- 3 windows from prefix sums: " << cacheSeconds * 1000 << " ms (pass over the samples: " << samplesSeconds * 1000 << " ms)" << endl;
+    cout << "- Largest sum difference: " << largestDifference << " V, same minimum and maximum: " << (same ? "yes" : "NO") << endl;
+    return same ? 0 : 2;
+}
+
+// Full parse vs baseline and window rows read with the CSV row index ---------------------------------------------------------------------
+int benchmarkCSVWindow(const string& capturePath) {
+
+    MappedFile file(capturePath);
+    if (!file.isOpen()) {
+        cerr << "Error: Could not open file " << capturePath << endl;
+        return 1;
+    }
+    cout << " " << endl;
+    cout << "- CSV WINDOW READ -------------------------------------------------------------------------------------" << endl;
+
+    // Full parse in double precision, the values the row reader gives
+    ROOT::TThreadExecutor pool;
+    Waveforms waveforms;
+    CSVRange range;
+    auto start = high_resolution_clock::now();
+    parseKeysightWaveforms(file, waveforms, range, kWaveformFloat64, &pool, pool.GetPoolSize() * 4);
+    cout << "- Full parse: " << secondsSince(start) << " s" << endl;
+
+    // Row index, then the rows of the baseline and of the window as chargeHisto.cpp reads them
+    EventReader reader;
+    start = high_resolution_clock::now();
+    if (!reader.openCSV(capturePath, csvIndexPath(capturePath))) {
+        cerr << "Error: Could not open the row index of " << capturePath << endl;
+        return 1;
+    }
+    cout << "- Row index " << (reader.rowIndexLoaded() ? "loaded" : "built") << ": " << secondsSince(start) << " s" << endl;
+    size_t resolution = reader.resolution();
+    size_t events = reader.eventCount();
+    if (resolution != waveforms.points() || events != waveforms.events()) {
+        cerr << "Error: Row index gives " << events << " events of " << resolution << " points, full parse " << waveforms.events()
+             << " of " << waveforms.points() << endl;
+        return 2;
+    }
+    ChargeWindow window;
+    window.baselinePortion = baselinePortionFor(resolution);
+    window.minTimeValue = resolution / 3;
+    window.maxTimeValue = window.minTimeValue + resolution / 6;
+    size_t baselineEnd = baselineEndFor(resolution, window);
+    size_t windowBegin = 0;
+    size_t windowCount = 0;
+    windowRangeFor(resolution, window, windowBegin, windowCount);
+    vector<double> baselineSamples(events * baselineEnd);
+    vector<double> windowSamples(events * windowCount);
+    start = high_resolution_clock::now();
+    if (!reader.read(0, events, 0, baselineEnd, baselineSamples.data()) ||
+        !reader.read(0, events, windowBegin, windowCount, windowSamples.data())) {
+        cerr << "Error: Could not read the window rows of " << capturePath << endl;
+        return 2;
+    }
+    cout << "- Window read: " << secondsSince(start) << " s, " << reader.bytesRead() / (1024.0 * 1024.0) << " MB of " << file.size() / (1024.0 * 1024.0)
+         << " MB read" << endl;
+
+    // Same samples and same sums, min and max for every event
+    bool same = true;
+    for (size_t event = 0; same && event < events; ++event) {
+        const double* samples = waveforms.event<double>(event);
+        const double* baseline = baselineSamples.data() + event * baselineEnd;
+        const double* windowValues = windowSamples.data() + event * windowCount;
+        same = equal(baseline, baseline + baselineEnd, samples) && equal(windowValues, windowValues + windowCount, samples + windowBegin);
+        EventSums full = sumEvent(waveforms, event, window);
+        EventSums rows = sumEventSlices(baseline, baselineEnd, windowValues, windowCount);
+        same = same && full.baselineSum == rows.baselineSum && full.windowSum == rows.windowSum && full.windowMin == rows.windowMin &&
+               full.windowMax == rows.windowMax && full.windowCount == rows.windowCount && full.baselineCount == rows.baselineCount;
+    }
+    cout << "- Window rows bit-identical to the full parse: " << (same ? "yes" : "NO") << endl;
+    return same ? 0 : 2;
+}
+
+// Charge kernels per instruction set level -----------------------------------------------------------------------------------------------
+int benchmarkChargeKernels() {
+
+    // Synthetic events in memory, one contiguous block each
+    SyntheticCaptureConfig config;
+    config.resolution = benchResolution;
+    size_t events = 2048;
+    vector<double> samples(events * config.resolution);
+    mt19937 generator(config.seed);
+    normal_distribution<double> noise(0.0, config.baselineNoise);
+    for (double& value : samples)
+        value = noise(generator);
+
+    ChargeWindow window;
+    window.baselinePortion = baselinePortionFor(config.resolution);
+    window.minTimeValue = config.resolution / 2;
+    window.maxTimeValue = config.resolution * 2 / 3;
+
+    cout << " " << endl;
+    cout << "- CHARGE KERNELS --------------------------------------------------------------------------------------" << endl;
+    cout << "- " << events << " events x " << config.resolution << " points, window " << window.minTimeValue << " to " << window.maxTimeValue << endl;
+
+    // Point by point reference
+    const int repetitions = 20;
+    double referenceSum = 0;
+    auto start = high_resolution_clock::now();
+    for (int repetition = 0; repetition < repetitions; ++repetition) {
+        for (size_t event = 0; event < events; ++event) {
+            const double* eventSamples = &samples[event * config.resolution];
+            EventSums sums;
+            for (size_t point = 0; point < config.resolution; ++point)
+                accumulateSample(sums, point, eventSamples[point], window);
+            referenceSum += sums.windowSum;
+        }
+    }
+    double seconds = secondsSince(start);
+    cout << "- Point loop: " << events * repetitions / seconds << " events/s" << endl;
+
+    SimdLevel best = detectSimdLevel();
+    for (SimdLevel level : {SimdLevel::kScalar, SimdLevel::kAVX2, SimdLevel::kAVX512}) {
+        if (level > best)
+            break;
+        setSimdLevel(level);
+        double kernelSum = 0;
+        start = high_resolution_clock::now();
+        for (int repetition = 0; repetition < repetitions; ++repetition) {
+            for (size_t event = 0; event < events; ++event) {
+                kernelSum += sumEvent(&samples[event * config.resolution], config.resolution, window).windowSum;
+            }
+        }
+        seconds = secondsSince(start);
+        cout << "- " << simdLevelName(level) << ": " << events * repetitions / seconds << " events/s (window sum difference "
+             << fabs(kernelSum - referenceSum) << ")" << endl;
+    }
+    setSimdLevel(best);
+    return 0;
+}
+
+// Sample types of the waveform container: memory and charge throughput -------------------------------------------------------------------
+int benchmarkWaveformTypes() {
+
+    // Synthetic events in memory, on the codes of an 8-bit ADC over 80 mV so int16 samples are exact
+    SyntheticCaptureConfig config;
+    config.resolution = benchResolution;
+    config.adcStep = 0.08 / 256;
+    size_t events = 2048;
+    mt19937 generator(config.seed);
+    normal_distribution<double> noise(0.0, config.baselineNoise);
+
+    ChargeWindow window;
+    window.baselinePortion = baselinePortionFor(config.resolution);
+    window.minTimeValue = config.resolution / 2;
+    window.maxTimeValue = config.resolution * 2 / 3;
+
+    cout << " " << endl;
+    cout << "- WAVEFORM SAMPLE TYPES ------------------------------------------------------------------------------" << endl;
+    cout << "- " << events << " events x " << config.resolution << " points, double columns of the CSV: "
+         << 2.0 * events * config.resolution * sizeof(double) / (1024 * 1024) << " MB" << endl;
+
+    Waveforms reference;
+    reference.allocate(events, config.resolution, kWaveformFloat64);
+    for (size_t event = 0; event < events; ++event)
+        for (size_t point = 0; point < config.resolution; ++point)
+            reference.set(event, point, round(noise(generator) / config.adcStep) * config.adcStep);
+
+    const int repetitions = 20;
+    for (WaveformSampleType type : {kWaveformFloat64, kWaveformFloat32, kWaveformInt16}) {
+        Waveforms waveforms;
+        waveforms.allocate(events, config.resolution, type, config.adcStep);
+        for (size_t event = 0; event < events; ++event)
+            for (size_t point = 0; point < config.resolution; ++point)
+                waveforms.set(event, point, reference.get(event, point));
+
+        double largestDifference = 0;
+        auto start = high_resolution_clock::now();
+        for (int repetition = 0; repetition < repetitions; ++repetition) {
+            for (size_t event = 0; event < events; ++event) {
+                EventSums sums = sumEvent(waveforms, event, window);
+                if (repetition == 0) {
+                    EventSums exact = sumEvent(reference, event, window);
+                    double area = sums.windowSum - sums.windowCount * sums.baselineSum / sums.baselineCount;
+                    double exactArea = exact.windowSum - exact.windowCount * exact.baselineSum / exact.baselineCount;
+                    largestDifference = max(largestDifference, fabs(area - exactArea));
+                }
+            }
+        }
+        double seconds = secondsSince(start);
+        cout << "- " << waveformSampleName(type) << ": " << waveforms.bytes() / (1024.0 * 1024.0) << " MB, "
+             << events * repetitions / seconds << " events/s (largest area difference " << largestDifference << " V*points)" << endl;
+    }
+    return 0;
+}
+
+// Per-event PNG rendering over thread counts, against the time of a parallel CSV parse -------------------------------------------------
+int benchmarkEventPlots(const string& capturePath) {
+
+    MappedFile file(capturePath);
+    if (!file.isOpen()) {
+        cerr << "Error: Could not open file " << capturePath << endl;
+        return 1;
+    }
+
+    cout << " " << endl;
+    cout << "- EVENT PLOTS -----------------------------------------------------------------------------------------" << endl;
+
+    // Parse of the whole capture on all threads as reference. Its pool is destroyed before the loop below:
+    // a pool alive keeps the task arena at its size and every later pool would run on maxThreads
+    unsigned maxThreads = benchThreadCounts().back();
+    Waveforms waveforms;
+    CSVRange range;
+    auto start = high_resolution_clock::now();
+    {
+        ROOT::TThreadExecutor parsePool(maxThreads);
+        parseKeysightWaveforms(file, waveforms, range, kWaveformFloat32, &parsePool, maxThreads * 4);
+    }
+    double parseSeconds = secondsSince(start);
+    cout << "- CSV parse of " << waveforms.events() << " events, " << maxThreads << " threads: " << parseSeconds << " s" << endl;
+
+    string imageFolder = benchFolder + "/plots";
+    gSystem->mkdir((imageFolder + "/images").c_str(), kTRUE);
+    EventPlotOptions options;
+    options.selection = kPlotAllEvents;
+    vector<size_t> events;
+    for (size_t event = 0; event < min<size_t>(waveforms.events(), 256); ++event)
+        events.push_back(event);
+
+    for (unsigned threads : benchThreadCounts()) {
+        ROOT::TThreadExecutor pool(threads);
+        start = high_resolution_clock::now();
+        size_t images = renderEventPlots(waveforms, events, imageFolder, range.minY, range.maxY, options, pool);
+        double seconds = secondsSince(start);
+        cout << "- " << threads << " threads: " << images << " images in " << seconds << " s, " << images / seconds << " images/s, all "
+             << waveforms.events() << " events in " << waveforms.events() / (images / seconds) / parseSeconds << "x the parse time" << endl;
+    }
+    return 0;
+}
+
+// Fraction of the pixels that differ between two PNG files of the same size, -1 if they cannot be compared
+double pixelDifference(const string& firstFilename, const string& secondFilename) {
+    TImage* first = TImage::Open(firstFilename.c_str());
+    TImage* second = TImage::Open(secondFilename.c_str());
+    double fraction = -1;
+    if (first != nullptr && second != nullptr && first->IsValid() && second->IsValid() &&
+        first->GetWidth() == second->GetWidth() && first->GetHeight() == second->GetHeight()) {
+        const UInt_t* firstPixels = first->GetArgbArray();
+        const UInt_t* secondPixels = second->GetArgbArray();
+        size_t pixels = static_cast<size_t>(first->GetWidth()) * first->GetHeight();
+        size_t differing = 0;
+        for (size_t pixel = 0; pixel < pixels; ++pixel)
+            differing += firstPixels[pixel] != secondPixels[pixel];
+        fraction = pixels > 0 ? static_cast<double>(differing) / pixels : 0;
+    }
+    delete first;
+    delete second;
+    return fraction;
+}
+
+// Overlapped plot of all events: full traces vs M4 decimation vs density --------------------------------------------------------------------------
+// Returns 0, 1 if the capture cannot be read, or 2 if the M4 decimated plot does not match the full one
+int benchmarkOverlappedPlot(const string& capturePath) {
+
+    MappedFile file(capturePath);
+    if (!file.isOpen()) {
+        cerr << "Error: Could not open file " << capturePath << endl;
+        return 1;
+    }
+    ROOT::TThreadExecutor pool(benchThreadCounts().back());
+    Waveforms waveforms;
+    CSVRange range;
+    parseKeysightWaveforms(file, waveforms, range, kWaveformFloat32, &pool, pool.GetPoolSize() * 4);
+    size_t points = waveforms.points();
+    vector<double> timeMicro(points);
+    for (size_t point = 0; point < points; ++point)
+        timeMicro[point] = waveforms.time(point) * timeMultiplier;
+
+    cout << " " << endl;
+    cout << "- OVERLAPPED PLOT -------------------------------------------------------------------------------------" << endl;
+    cout << "- " << waveforms.events() << " events x " << points << " points" << endl;
+
+    string imageFolder = benchFolder + "/plots/images";
+    gSystem->mkdir(imageFolder.c_str(), kTRUE);
+    for (bool decimate : {false, true}) {
+        auto start = high_resolution_clock::now();
+        TCanvas* canvas = new TCanvas("benchOverlapped", "Graphs", 1920, 1080);
+        canvas->SetGrid();
+        auto* mg = new TMultiGraph();
+        size_t columns = plotColumnsFor(*canvas);
+        vector<double> samples(points);
+        vector<double> plotX;
+        vector<double> plotY;
+        size_t plottedPoints = 0;
+        for (size_t event = 0; event < waveforms.events(); ++event) {
+            waveforms.copyEvent(event, samples.data());
+            if (decimate) {
+                decimateM4(timeMicro.data(), samples.data(), points, columns, plotX, plotY);
+            } else {
+                plotX = timeMicro;
+                plotY = samples;
+            }
+            mg->Add(new TGraph(plotX.size(), plotX.data(), plotY.data()));
+            plottedPoints += plotX.size();
+        }
+        mg->Draw("A PMC PLC");
+        canvas->SaveAs((imageFolder + (decimate ? "/Overlapped_M4.png" : "/Overlapped_Full.png")).c_str());
+        delete mg;
+        delete canvas;
+        double seconds = secondsSince(start);
+        cout << "- " << (decimate ? "M4 decimated: " : "Full traces:  ") << plottedPoints << " points, " << seconds << " s" << endl;
+    }
+
+    // The decimation keeps the first, last, lowest and highest point of every pixel column, so both images should match
+    int status = 0;
+    double differing = pixelDifference(imageFolder + "/Overlapped_Full.png", imageFolder + "/Overlapped_M4.png");
+    if (differing < 0) {
+        cerr << "Error: Could not compare Overlapped_Full.png and Overlapped_M4.png" << endl;
+        status = 2;
+    } else if (differing > benchPlotPixelTolerance) {
+        cerr << "Error: The M4 decimated plot differs from the full one in " << differing * 100 << "% of the pixels (tolerance "
+             << benchPlotPixelTolerance * 100 << "%)" << endl;
+        status = 2;
+    } else {
+        cout << "- M4 vs full:   " << differing * 100 << "% of the pixels differ" << endl;
+    }
+
+    // Density of all events: the histogram drawn has the same size for any number of events
+    auto start = high_resolution_clock::now();
+    TCanvas* canvas = new TCanvas("benchPersistence", "Persistence", 1920, 1080);
+    size_t timeBins = min(points, plotColumnsFor(*canvas));
+    const size_t voltageBins = 400;
+    vector<uint32_t> counts = fillPersistence(waveforms, timeBins, voltageBins, range.minY, range.maxY, pool);
+    double fillSeconds = secondsSince(start);
+    TH2D* h2 = new TH2D("benchPersistence", "Persistence", timeBins, timeMicro.front(), timeMicro.back(), voltageBins, range.minY, range.maxY);
+    h2->SetDirectory(nullptr);
+    for (size_t voltageBin = 0; voltageBin < voltageBins; ++voltageBin)
+        for (size_t timeBin = 0; timeBin < timeBins; ++timeBin)
+            h2->SetBinContent(timeBin + 1, voltageBin + 1, counts[voltageBin * timeBins + timeBin]);
+    h2->Draw("COLZ");
+    canvas->SaveAs((imageFolder + "/Overlapped_Density.png").c_str());
+    delete h2;
+    delete canvas;
+    cout << "- Density:      " << timeBins << " x " << voltageBins << " bins, " << secondsSince(start) << " s (fill on "
+         << pool.GetPoolSize() << " threads " << fillSeconds << " s)" << endl;
+    return status;
+}
+
+// Regression suite ----------------------------------------------------------------------------------------------------------------------------
+
+// Time of one step of the suite on one capture size
+struct SuiteResult {
+    string step;
+    size_t megabytes = 0;
+    double seconds = 0;
+    double eventsPerSecond = 0;
+};
+
+// Fastest of benchSuiteRepetitions runs of step
+template <typename Step>
+double fastestSeconds(Step step) {
+    double best = numeric_limits<double>::max();
+    for (int repetition = 0; repetition < max(1, benchSuiteRepetitions); ++repetition) {
+        auto start = high_resolution_clock::now();
+        step();
+        best = min(best, secondsSince(start));
+    }
+    return best;
+}
+
+// Steps of csvRead and chargeHisto on one synthetic capture
+bool runSuiteSize(size_t targetBytes, vector<SuiteResult>& results) {
+    size_t megabytes = targetBytes / (1024 * 1024);
+    string capturePath = syntheticCapturePath("suite_" + to_string(megabytes) + "MB.csv", targetBytes);
+    if (capturePath.empty())
+        return false;
+    MappedFile file(capturePath);
+    if (!file.isOpen()) {
+        cerr << "Error: Could not open file " << capturePath << endl;
+        return false;
+    }
+    ROOT::TThreadExecutor pool(benchThreadCounts().back());
+    size_t chunks = pool.GetPoolSize() * 4;
+    countLines(file.begin(), file.end());  // Warm the page cache
+
+    // CSV parse as readCSV (float32 samples, chunks on the pool)
+    Waveforms waveforms;
+    double parseSeconds = fastestSeconds([&] {
+        CSVRange range;
+        parseKeysightWaveforms(file, waveforms, range, kWaveformFloat32, &pool, chunks);
+    });
+    size_t events = waveforms.events();
+    size_t resolution = waveforms.points();
+    results.push_back({"readCSV", megabytes, parseSeconds, events / parseSeconds});
+
+    // Legacy txt files
+    string txtFolder = benchFolder + "/suite_" + to_string(megabytes) + "MB";
+    gSystem->mkdir((txtFolder + "/txt").c_str(), kTRUE);
+    bool ok = true;
+    double txtSeconds = fastestSeconds([&] { ok = ok && writeEventTxtFiles(txtFolder, waveforms); });
+    results.push_back({"txtWrite", megabytes, txtSeconds, events / txtSeconds});
+
+    // Charge integration of chargeHisto, event-parallel and added in event order
+    ChargeWindow window;
+    window.baselinePortion = baselinePortionFor(resolution);
+    window.minTimeValue = resolution / 2;
+    window.maxTimeValue = resolution * 2 / 3;
+    ChargeResults charges;
+    double integrationSeconds = fastestSeconds([&] {
+        vector<EventSums> eventSums = sumEventsParallel(pool, events, [&](size_t event) {
+            return sumEvent(waveforms, event, window);
+        }, chunks);
+        ChargeAccumulator accumulator(waveforms.deltaT() / 50.0);
+        for (const EventSums& sums : eventSums)
+            accumulator.add(sums);
+        charges = accumulator.get();
+    });
+    results.push_back({"chargeIntegration", megabytes, integrationSeconds, events / integrationSeconds});
+
+    // Histogram fill: baseline points sketched and counted as in voltageHistogram, then the charge histogram
+    double histogramSeconds = fastestSeconds([&] {
+        vector<double> samples(resolution);
+        QuantileSketch sketch;
+        for (size_t event = 0; event < events; ++event) {
+            waveforms.copyEvent(event, samples.data());
+            for (int point = 1; point <= window.baselinePortion; ++point)
+                sketch.add(samples[point]);
+        }
+        BinnedCounts counts(freedmanDiaconisBinning(sketch));
+        for (size_t event = 0; event < events; ++event) {
+            waveforms.copyEvent(event, samples.data());
+            for (int point = 1; point <= window.baselinePortion; ++point)
+                counts.add(samples[point]);
+        }
+        const HistogramBinning& binning = counts.getBinning();
+        TH1D baseline("benchBaseline", "Baseline", binning.bins, binning.low, binning.high);
+        baseline.SetDirectory(nullptr);
+        counts.fill(baseline);
+
+        QuantileSketch chargeSketch;
+        for (const double area : charges.areas)
+            chargeSketch.add(area * chargeMultiplier);
+        HistogramBinning chargeBinning = freedmanDiaconisBinning(chargeSketch);
+        TH1D chargeHistogram("benchCharge", "Charge", chargeBinning.bins, chargeBinning.low, chargeBinning.high);
+        chargeHistogram.SetDirectory(nullptr);
+        for (const double area : charges.areas)
+            chargeHistogram.Fill(area * chargeMultiplier);
+    });
+    results.push_back({"histogramFill", megabytes, histogramSeconds, events / histogramSeconds});
+
+    if (!ok)
+        cerr << "Error: Could not write the txt files in " << txtFolder << endl;
+    return ok;
+}
+
+// Suite results, one line per step and size: step, megabytes, seconds, events per second
+bool writeSuiteResults(const string& path, const vector<SuiteResult>& results) {
+    ofstream file(path);
+    if (!file.is_open())
+        return false;
+    file << "# step\tMB\tseconds\tevents/s" << '\n';
+    for (const SuiteResult& result : results)
+        file << result.step << '\t' << result.megabytes << '\t' << result.seconds << '\t' << result.eventsPerSecond << '\n';
+    return file.good();
+}
+
+// Seconds of every "step MB" of a results file, empty if it does not exist
+map<string, double> readSuiteResults(const string& path) {
+    map<string, double> seconds;
+    ifstream file(path);
+    string line;
+    while (getline(file, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        istringstream fields(line);
+        SuiteResult result;
+        if (fields >> result.step >> result.megabytes >> result.seconds)
+            seconds[result.step + " " + to_string(result.megabytes)] = result.seconds;
+    }
+    return seconds;
+}
+
+// Run the suite on every size, write the results and compare them with the baseline
+int benchmarkSuite() {
+
+    cout << " " << endl;
+    cout << "- REGRESSION SUITE ------------------------------------------------------------------------------------" << endl;
+
+    vector<SuiteResult> results;
+    for (size_t targetBytes : benchSuiteBytes) {
+        if (!runSuiteSize(targetBytes, results))
+            return 1;
+    }
+
+    string resultsPath = benchFolder + "/" + benchResultsFile;
+    string baselinePath = benchFolder + "/" + benchBaselineFile;
+    if (!writeSuiteResults(resultsPath, results)) {
+        cerr << "Error: Could not write " << resultsPath << endl;
+        return 1;
+    }
+    map<string, double> baseline = readSuiteResults(baselinePath);
+    bool newBaseline = baseline.empty() || benchUpdateBaseline;
+
+    int regressions = 0;
+    char line[160];
+    for (const SuiteResult& result : results) {
+        auto found = baseline.find(result.step + " " + to_string(result.megabytes));
+        double ratio = found != baseline.end() && found->second > 0 ? result.seconds / found->second : 0;
+        bool regression = !newBaseline && ratio > benchRegressionTolerance;
+        regressions += regression ? 1 : 0;
+        snprintf(line, sizeof(line), "- %-18s %5zu MB: %9.4f s, %10.0f events/s", result.step.c_str(), result.megabytes,
+                 result.seconds, result.eventsPerSecond);
+        cout << line;
+        if (ratio > 0)
+            cout << ", " << ratio << "x baseline" << (regression ? "  <-- REGRESSION" : "");
+        cout << endl;
+    }
+
+    cout << "- Results: " << resultsPath << endl;
+    if (newBaseline) {
+        if (!writeSuiteResults(baselinePath, results)) {
+            cerr << "Error: Could not write " << baselinePath << endl;
+            return 1;
+        }
+        cout << "- Baseline written to " << baselinePath << endl;
+        return 0;
+    }
+    cout << "- Regressions (slower than " << benchRegressionTolerance << "x baseline): " << regressions << endl;
+    return regressions > 0 ? 3 : 0;
+}
+
+// Main function --------------------------------------------------------------------------------------------------------------------------
+int benchmark() {
+
+    cout << " " << endl;
+    cout << "   ***   Benchmarks by Charly   ***   " << endl;
+    cout << " " << endl;
+
+    int status = 0;
+    if (benchRunSuite) {
+        status = benchmarkSuite();
+    }
+    if (!benchRunDetailed) {
+        cout << "-------------------------------------------------------------------------------------------------------" << endl;
+        return status;
+    }
+
+    string capturePath = syntheticCapturePath();
+    if (capturePath.empty())
+        return 1;
+
+    status = max(status, benchmarkCSVParse(capturePath));
+    status = max(status, benchmarkParallelCSVParse(capturePath));
+    status = max(status, benchmarkEventOutput(capturePath));
+    status = max(status, benchmarkParallelCharges());
+    status = max(status, benchmarkAnalysisCache(capturePath));
+    status = max(status, benchmarkCSVWindow(capturePath));
+    status = max(status, benchmarkChargeKernels());
+    status = max(status, benchmarkWaveformTypes());
+    status = max(status, benchmarkEventPlots(capturePath));
+    status = max(status, benchmarkOverlappedPlot(capturePath));
+
+    cout << "-------------------------------------------------------------------------------------------------------" << endl;
+    return status;
+}
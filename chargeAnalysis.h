@@ -0,0 +1,481 @@
+/*
+ *  Charge Analysis
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * Per-event charge integration shared by chargeHisto.cpp and the fused
+ * analyze mode of csvRead.cpp, plus the outputs of the charge analysis:
+ * Charge Histogram (PNG and ROOT file) and Min/MaxVoltages txt files.
+ *
+ * The charge of an event only needs a few sums over its samples, so they
+ * can be accumulated from any source: a whole event, or one point at a
+ * time while the CSV rows are being parsed.
+ */
+
+#ifndef CHARGE_ANALYSIS_H
+#define CHARGE_ANALYSIS_H
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+#include "TH1D.h"
+#include "TCanvas.h"
+#include "TFile.h"
+#include "ROOT/TThreadExecutor.hxx"
+#include "waveformKernels.h"
+#include "waveform.h"
+#include "streamingHistogram.h"
+
+const double chargeMultiplier = 1000000000000.0; // Default value is 1000000000000.0 for pico coulombs
+const double timeMultiplier = 1000000.0;         // Default value is 1000000.0 for microseconds
+
+// Integration window, in points of the event
+struct ChargeWindow {
+    int baselinePortion = 0;        // Points 0..baselinePortion are the baseline
+    double minTimeValue = 3000;     // First point of the pulse window
+    double maxTimeValue = 4000;     // Last point of the pulse window
+};
+
+// Portion of 10% of the resolution used for the baseline
+inline int baselinePortionFor(size_t resolution) {
+    return static_cast<int>(round((resolution*10)/100));
+}
+
+// Sums of one event needed for its charge -----------------------------------------------------------------------------------------------
+struct EventSums {
+    size_t eventNumber = 0;
+    double baselineSum = 0;         // Sum of points 0..baselinePortion
+    size_t baselineCount = 0;
+    double windowSum = 0;           // Sum of points in [minTimeValue, maxTimeValue] after the baseline portion
+    size_t windowCount = 0;
+    double windowMin = std::numeric_limits<double>::max();
+    double windowMax = std::numeric_limits<double>::lowest();
+    double baseline = 0;            // Baseline estimate of baselineEstimation.h, used when baselineEstimated
+    double baselineRMS = 0;         // RMS of the baseline points
+    bool baselineEstimated = false;
+    bool baselineOutlier = false;   // Anomalous baseline RMS: the event is left out of the charges
+};
+
+// Baseline of one event: its estimate when there is one, the mean of its baseline portion otherwise
+inline double eventBaseline(const EventSums& sums) {
+    if (sums.baselineEstimated)
+        return sums.baseline;
+    return sums.baselineCount > 0 ? sums.baselineSum / sums.baselineCount : 0.0;
+}
+
+// Add one point of an event
+inline void accumulateSample(EventSums& sums, size_t point, double voltageValue, const ChargeWindow& window) {
+    if (point <= static_cast<size_t>(window.baselinePortion)) {
+        // Baseline values
+        sums.baselineSum = sums.baselineSum + voltageValue;
+        sums.baselineCount++;
+    } else if (point >= window.minTimeValue && point <= window.maxTimeValue) {
+        // Pulse voltage points
+        sums.windowSum = sums.windowSum + voltageValue;
+        sums.windowCount++;
+        sums.windowMin = std::min(sums.windowMin, voltageValue);
+        sums.windowMax = std::max(sums.windowMax, voltageValue);
+    }
+}
+
+// Single pass over the samples of one event
+template <typename T>
+EventSums sumEvent(const T* samples, size_t resolution, const ChargeWindow& window) {
+    EventSums sums;
+    for (size_t point = 0; point < resolution; ++point)
+        accumulateSample(sums, point, samples[point], window);
+    return sums;
+}
+
+// Number of baseline points of an event
+inline size_t baselineEndFor(size_t resolution, const ChargeWindow& window) {
+    return std::min(resolution, static_cast<size_t>(window.baselinePortion) + 1);
+}
+
+// Points [begin, begin + count) of the window after the baseline portion, count is 0 if it is empty
+inline void windowRangeFor(size_t resolution, const ChargeWindow& window, size_t& begin, size_t& count) {
+    double first = std::max(std::ceil(window.minTimeValue), static_cast<double>(baselineEndFor(resolution, window)));
+    double last = std::min(std::floor(window.maxTimeValue), static_cast<double>(resolution) - 1);
+    begin = 0;
+    count = 0;
+    if (first <= last) {
+        begin = static_cast<size_t>(first);
+        count = static_cast<size_t>(last) - begin + 1;
+    }
+}
+
+// Vectorized version for contiguous double or float samples, see waveformKernels.h
+template <typename T>
+inline EventSums sumEventKernels(const T* samples, size_t resolution, const ChargeWindow& window) {
+    EventSums sums;
+    size_t baselineEnd = baselineEndFor(resolution, window);
+    sums.baselineSum = sumSamples(samples, baselineEnd);
+    sums.baselineCount = baselineEnd;
+
+    // Window points after the baseline portion
+    size_t begin = 0;
+    size_t count = 0;
+    windowRangeFor(resolution, window, begin, count);
+    if (count > 0) {
+        WindowStats stats = windowStats(samples + begin, count, 0.0);
+        sums.windowSum = stats.sum;
+        sums.windowCount = count;
+        sums.windowMin = stats.min;
+        sums.windowMax = stats.max;
+    }
+    return sums;
+}
+
+inline EventSums sumEvent(const double* samples, size_t resolution, const ChargeWindow& window) {
+    return sumEventKernels(samples, resolution, window);
+}
+
+inline EventSums sumEvent(const float* samples, size_t resolution, const ChargeWindow& window) {
+    return sumEventKernels(samples, resolution, window);
+}
+
+// Sums of an event from its baseline points and its window points read on their own, e.g. the rows of
+// both ranges of the capture CSV (see eventAccess.h)
+inline EventSums sumEventSlices(const double* baseline, size_t baselineCount, const double* windowSamples, size_t windowCount) {
+    EventSums sums;
+    sums.baselineSum = sumSamples(baseline, baselineCount);
+    sums.baselineCount = baselineCount;
+    if (windowCount > 0) {
+        WindowStats stats = windowStats(windowSamples, windowCount, 0.0);
+        sums.windowSum = stats.sum;
+        sums.windowCount = windowCount;
+        sums.windowMin = stats.min;
+        sums.windowMax = stats.max;
+    }
+    return sums;
+}
+
+// Sums of int16 ADC codes in integer arithmetic, converted to volts once: value = code * scale + offset
+inline EventSums sumEventCodes(const int16_t* codes, size_t resolution, const ChargeWindow& window, double scale, double offset) {
+    EventSums sums;
+    size_t baselineEnd = baselineEndFor(resolution, window);
+    sums.baselineSum = sumCodes(codes, baselineEnd)*scale + baselineEnd*offset;
+    sums.baselineCount = baselineEnd;
+
+    size_t begin = 0;
+    size_t count = 0;
+    windowRangeFor(resolution, window, begin, count);
+    if (count > 0) {
+        CodeStats stats = codeStats(codes + begin, count);
+        double first = stats.min*scale + offset;
+        double last = stats.max*scale + offset;
+        sums.windowSum = stats.sum*scale + count*offset;
+        sums.windowCount = count;
+        sums.windowMin = std::min(first, last);
+        sums.windowMax = std::max(first, last);
+    }
+    return sums;
+}
+
+// Sums of a zero-based event of a waveform container
+inline EventSums sumEvent(const Waveforms& waveforms, size_t event, const ChargeWindow& window) {
+    switch (waveforms.sampleType()) {
+        case kWaveformFloat32:
+            return sumEvent(waveforms.event<float>(event), waveforms.points(), window);
+        case kWaveformInt16:
+            return sumEventCodes(waveforms.event<int16_t>(event), waveforms.points(), window, waveforms.scale(), waveforms.offset());
+        default:
+            return sumEvent(waveforms.event<double>(event), waveforms.points(), window);
+    }
+}
+
+// Sums of events 0..numberOfEvents-1 computed on the pool in contiguous chunks of events, returned in
+// event order whatever the number of threads. sumOne(event) gives the sums of one zero-based event.
+template <typename SumFunction>
+std::vector<EventSums> sumEventsParallel(ROOT::TThreadExecutor& pool, size_t numberOfEvents, SumFunction sumOne, size_t numberOfChunks) {
+    size_t chunks = std::max<size_t>(1, std::min(numberOfChunks, numberOfEvents));
+    std::vector<std::vector<EventSums>> chunkSums = pool.Map([&](unsigned chunk) {
+        size_t first = numberOfEvents * chunk / chunks;
+        size_t last = numberOfEvents * (chunk + 1) / chunks;
+        std::vector<EventSums> sums;
+        sums.reserve(last - first);
+        for (size_t event = first; event < last; ++event) {
+            sums.push_back(sumOne(event));
+            sums.back().eventNumber = event + 1;
+        }
+        return sums;
+    }, ROOT::TSeqU(chunks));
+
+    std::vector<EventSums> eventSums;
+    eventSums.reserve(numberOfEvents);
+    for (const std::vector<EventSums>& sums : chunkSums)
+        eventSums.insert(eventSums.end(), sums.begin(), sums.end());
+    return eventSums;
+}
+
+// Charges ---------------------------------------------------------------------------------------------------------------------------------
+// Index i is the event added i-th; excluded events hold NaN in the three vectors
+struct ChargeResults {
+    std::vector<double> areas;          // Area behind the curve of every event, in coulombs
+    std::vector<double> minVoltages;    // Baseline-corrected minimum in the window
+    std::vector<double> maxVoltages;    // Baseline-corrected maximum in the window
+};
+
+// Values of the events kept, without the NaN of the excluded events
+inline std::vector<double> keptValues(const std::vector<double>& values) {
+    std::vector<double> kept;
+    kept.reserve(values.size());
+    for (const double value : values)
+        if (!std::isnan(value))
+            kept.push_back(value);
+    return kept;
+}
+
+// Turns event sums into charges, in event order. The baseline of every event is its estimate (see
+// baselineEstimation.h) or the mean of its own baseline portion; with runningBaseline it is the running
+// mean of the baseline portion of all events added so far, as in the point by point loop of chargeHisto
+// up to version 1.2. Events flagged with an anomalous baseline RMS are counted and stored as NaN, so the
+// results stay indexed by event; use keptValues() for the histogram, the fit and the gain.
+class ChargeAccumulator {
+public:
+    explicit ChargeAccumulator(double constantFactor, bool runningBaseline = false)
+        : constantFactor(constantFactor), runningBaseline(runningBaseline) {}
+
+    void add(const EventSums& sums) {
+        if (sums.baselineOutlier) {
+            excluded++;
+            results.areas.push_back(std::numeric_limits<double>::quiet_NaN());
+            results.maxVoltages.push_back(std::numeric_limits<double>::quiet_NaN());
+            results.minVoltages.push_back(std::numeric_limits<double>::quiet_NaN());
+            return;
+        }
+        if (!runningBaseline) {
+            baseline = 0;
+            baselineCount = 0;
+        }
+        baseline = baseline + sums.baselineSum;
+        baselineCount = baselineCount + sums.baselineCount;
+        if (baselineCount > 0)
+            meanBaseline = baseline/baselineCount;
+        if (!runningBaseline && sums.baselineEstimated)
+            meanBaseline = sums.baseline;
+        double area = sums.windowSum - sums.windowCount*meanBaseline;
+        double minVoltage = std::numeric_limits<double>::max();
+        double maxVoltage = std::numeric_limits<double>::lowest();
+        if (sums.windowCount > 0) {
+            minVoltage = sums.windowMin - meanBaseline;
+            maxVoltage = sums.windowMax - meanBaseline;
+        }
+
+        // Store area behind the curve of current event
+        results.areas.push_back(area*-constantFactor);
+        results.maxVoltages.push_back(maxVoltage);
+        results.minVoltages.push_back(minVoltage);
+    }
+
+    const ChargeResults& get() const { return results; }
+    size_t excludedEvents() const { return excluded; }
+
+private:
+    double constantFactor;
+    bool runningBaseline;
+    double baseline = 0;
+    size_t baselineCount = 0;
+    double meanBaseline = 0;
+    size_t excluded = 0;
+    ChargeResults results;
+};
+
+// Gain and mean number of photoelectrons ------------------------------------------------------------------------------------------------
+const double electronCharge = 1.602176634e-19;  // Coulombs
+
+struct GainEstimate {
+    size_t events = 0;
+    double meanCharge = 0;          // Coulombs
+    double sigmaCharge = 0;         // Coulombs
+    double gain = 0;
+    double gainError = 0;
+    double meanPE = 0;              // Mean number of photoelectrons per event
+    double meanPEError = 0;
+};
+
+// Photostatistics of the charge distribution: for a Poisson number of photoelectrons
+// <PE> = mean^2 / variance and gain = variance / (mean * e). Errors from the statistical
+// errors of the mean (sigma / sqrt(N)) and of the variance (variance * sqrt(2 / (N - 1))).
+inline GainEstimate estimateGain(const std::vector<double>& areas) {
+    GainEstimate estimate;
+    estimate.events = areas.size();
+    if (areas.size() < 2)
+        return estimate;
+
+    // Welford mean and variance
+    double mean = 0;
+    double squares = 0;
+    size_t count = 0;
+    for (double area : areas) {
+        ++count;
+        double delta = area - mean;
+        mean += delta / count;
+        squares += delta * (area - mean);
+    }
+    double variance = squares / (count - 1);
+    estimate.meanCharge = mean;
+    estimate.sigmaCharge = std::sqrt(variance);
+    if (mean == 0 || variance == 0)
+        return estimate;
+
+    double meanRelativeError = estimate.sigmaCharge / std::sqrt(static_cast<double>(count)) / std::fabs(mean);
+    double varianceRelativeError = std::sqrt(2.0 / (count - 1));
+    estimate.meanPE = mean * mean / variance;
+    estimate.meanPEError = estimate.meanPE * std::sqrt(4 * meanRelativeError * meanRelativeError + varianceRelativeError * varianceRelativeError);
+    estimate.gain = variance / (mean * electronCharge);
+    estimate.gainError = std::fabs(estimate.gain) * std::sqrt(meanRelativeError * meanRelativeError + varianceRelativeError * varianceRelativeError);
+    return estimate;
+}
+
+// Outputs ---------------------------------------------------------------------------------------------------------------------------------
+
+// Write one of the Min/MaxVoltages files, returns false if it could not be opened. voltages holds one value per
+// event, NaN for the events excluded (see ChargeAccumulator), so line N of the values is still event N.
+inline bool writeVoltagesFile(const std::string& path, const std::string& kind, const std::vector<double>& voltages, double mean, double global,
+                              const ChargeWindow& window, double windowStartTime, double windowEndTime) {
+    std::ofstream voltagesFile(path);
+    if (!voltagesFile.is_open())
+        return false;
+
+    std::string upper = kind == "Minimum" ? "MIN" : "MAX";
+    voltagesFile << "- SUMMARY -----------------------------------------------------" << std::endl;
+    voltagesFile << "Time Window in microseconds: " << windowStartTime*timeMultiplier << " to " << windowEndTime*timeMultiplier << " microseconds" << std::endl;
+    voltagesFile << "Time Window in points: " << window.minTimeValue << " to " << window.maxTimeValue << " points" << std::endl;
+    voltagesFile << (kind == "Minimum" ? "Average Minimun Voltage: " : "Average Maximum Voltage: ") << mean << std::endl;
+    voltagesFile << "Global " << kind << " Voltage:  " << global << std::endl;
+    voltagesFile << " " << std::endl;
+    voltagesFile << "- " << upper << " VOLTAGE VALUES ------------------------------------------" << std::endl;
+    for (const double value : voltages) {
+        if (std::isnan(value))
+            voltagesFile << "excluded" << '\n';
+        else
+            voltagesFile << value << '\n';
+    }
+    return true;
+}
+
+// Paths of the files written by writeChargeOutputs
+inline std::vector<std::string> chargeOutputFiles(const std::string& filefolder) {
+    std::string name = filefolder.substr(filefolder.find_last_of("/") + 1);
+    return {filefolder + "/images/Charge_Histogram_" + name + ".png", filefolder + "/txt/MinVoltages.txt",
+            filefolder + "/txt/MaxVoltages.txt", filefolder + "/" + name + ".root"};
+}
+
+// Charge Histogram PNG, Min/MaxVoltages txt files and ROOT file of a capture folder. The histogram, the fit and
+// the averages use the events kept; the Min/MaxVoltages files list every event.
+// windowStartTime and windowEndTime are the times (in seconds) of the points minTimeValue and maxTimeValue.
+// Returns 0 or the error code of chargeHisto.
+inline int writeChargeOutputs(const std::string& filefolder, const ChargeResults& results, const ChargeWindow& window,
+                              double windowStartTime, double windowEndTime) {
+    std::string name = filefolder.substr(filefolder.find_last_of("/") + 1);
+    std::vector<double> areas = keptValues(results.areas);
+    std::vector<double> minVoltages = keptValues(results.minVoltages);
+    std::vector<double> maxVoltages = keptValues(results.maxVoltages);
+
+    // Charge Histogram --------------------------------------------------------------------------------------------
+
+    // Unit Conversion of areas
+    std::vector<double> areasMultiplied;
+    QuantileSketch sketch;
+    for (const double value : areas) {
+        areasMultiplied.push_back(value * chargeMultiplier);
+        sketch.add(value * chargeMultiplier);
+    }
+
+    // Calculate max value of areas
+    double maxArea = sketch.max();
+
+    // Calculate bin number: Freedman-Diaconis bins over 0..maxArea*1.05, see streamingHistogram.h
+    std::cout << " " << std::endl;
+    std::cout << " " << std::endl;
+    std::cout << "Calculating bin number..." << std::endl;
+    HistogramBinning binning = binningFor(0, maxArea*1.05, freedmanDiaconisWidth(sketch), sketch.count());
+    int binNumber = binning.bins;
+    std::cout << "- Bin number: " << binNumber << std::endl;
+    std::cout << " " << std::endl;
+    std::cout << "Creating Histogram..." << std::endl;
+
+    // Create a TCanvas
+    TCanvas *canvas = new TCanvas("canvas", "Charge Histogram", 1920, 1080);
+
+    // Set Grid
+    canvas->SetGrid();
+
+    // New Histrogram
+    auto h1 = new TH1D("Charge", ("Charge Histogram - " + name).c_str(), binNumber, 0, binning.high);
+
+    // Fill the histogram with voltage data of all events
+    for (double areaValue : areasMultiplied) {
+        h1->Fill(areaValue);
+    }
+
+    // Draw the histogram on the canvas
+    h1->Draw();
+
+    // Set axis label
+    h1->GetXaxis()->SetTitle(("Picocoulombs"));
+
+    // Save the canvas as a PNG file
+    std::string pngFilename = filefolder + "/images/Charge_Histogram_" + name + ".png";
+    canvas->SaveAs(pngFilename.c_str());
+
+    // Max and Min Voltages Files ----------------------------------------------------------------------------------
+
+    std::cout << " " << std::endl;
+    std::cout << "Creating Max and Min Voltage txt files..." << std::endl;
+
+    // Calculate average and absolute minimum and maximum voltage across events
+    double minVoltageSum = 0;
+    double maxVoltageSum = 0;
+    double globalMinVoltage = std::numeric_limits<double>::max();
+    double globalMaxVoltage = std::numeric_limits<double>::lowest();
+    for (const double value : minVoltages) {
+        minVoltageSum = minVoltageSum + value;
+        globalMinVoltage = std::min(globalMinVoltage, value);
+    }
+    for (const double value : maxVoltages) {
+        maxVoltageSum = maxVoltageSum + value;
+        globalMaxVoltage = std::max(globalMaxVoltage, value);
+    }
+    double minVoltageMean = minVoltageSum/(minVoltages.size());
+    double maxVoltageMean = maxVoltageSum/(maxVoltages.size());
+
+    // Print averages and absoluts Max and Mins
+    std::cout << "- Average Min Voltage: " << minVoltageMean << std::endl;
+    std::cout << "- Average Max Voltage:  " << maxVoltageMean << std::endl;
+    std::cout << "- Global Min Voltage:  " << globalMinVoltage << std::endl;
+    std::cout << "- Global Max Voltage:   " << globalMaxVoltage << std::endl;
+    std::cout << " " << std::endl;
+
+    if (!writeVoltagesFile(filefolder + "/txt/MinVoltages.txt", "Minimum", results.minVoltages, minVoltageMean, globalMinVoltage,
+                           window, windowStartTime, windowEndTime)) {
+        std::cerr << " - ERROR - Could not open file for writing MinVoltages data" << std::endl;
+        return 6;
+    }
+    if (!writeVoltagesFile(filefolder + "/txt/MaxVoltages.txt", "Maximum", results.maxVoltages, maxVoltageMean, globalMaxVoltage,
+                           window, windowStartTime, windowEndTime)) {
+        std::cerr << " - ERROR - Could not open file for writing MaxVoltages data" << std::endl;
+        return 7;
+    }
+
+    // Create a ROOT File with the histogram -----------------------------------------------------------------------
+    std::cout << "Creating ROOT File..." << std::endl;
+
+    // Create TFile
+    std::string rootFilename = filefolder + "/" + name + ".root";
+    auto *f = new TFile (rootFilename.c_str(),  "RECREATE");
+
+    // Save TFile
+    h1->Write();
+    f->Write();
+    f->Close();
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ *  Charge Spectrum Fit
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * Fit of the charge spectrum of a capture with the usual model of a
+ * photomultiplier under pulsed LED light: a pedestal plus the peaks of 1, 2,
+ * 3... photoelectrons, weighted by a Poisson distribution of mean <PE>.
+ *
+ *   P(n) = exp(-mu) mu^n / n!
+ *   peak n: Gaussian of mean Q0 + n*Q1 and sigma sqrt(sigma0^2 + n*(r*Q1)^2)
+ *
+ * Q0 and sigma0 are the pedestal, Q1 the charge of one photoelectron (the
+ * gain is Q1/e) and r its relative width. The fit is an extended binned
+ * Poisson likelihood done with ROOT::Fit::Fitter and Minuit2, which keep no
+ * global state, so several runs can be fitted at the same time from the
+ * threads of a pool. Starting values come from the spectrum itself: the
+ * photostatistics of estimateGain, refined with the fraction of events in
+ * the pedestal when it is visible.
+ *
+ * When the peaks are not resolved (large <PE>) the spectrum is close to a
+ * single Gaussian, Q1 and r are correlated and their errors grow; the fit
+ * then gives about the same gain as the photostatistics.
+ */
+
+#ifndef CHARGE_FIT_H
+#define CHARGE_FIT_H
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "Fit/Fitter.h"
+#include "Fit/BinData.h"
+#include "Math/WrappedParamFunction.h"
+#include "chargeAnalysis.h"
+
+// Parameters of the model, in picocoulombs
+enum ChargeFitParameter {
+    kFitEvents = 0,         // Number of events (extended likelihood)
+    kFitMeanPE,             // Mean number of photoelectrons mu
+    kFitPedestal,           // Q0
+    kFitPedestalSigma,      // sigma0
+    kFitSPECharge,          // Q1
+    kFitSPEResolution,      // r = sigma1/Q1
+    kFitParameters
+};
+
+struct ChargeFit {
+    int status = -1;                // Minimizer status, 0 if the fit converged, -1 if it was not done
+    size_t events = 0;
+    int bins = 0;
+    double value[kFitParameters] = {};
+    double error[kFitParameters] = {};
+    double gain = 0;
+    double gainError = 0;
+    double chi2 = 0;                // Pearson chi2 of the fitted bins
+    int ndf = 0;
+};
+
+// Fraction of the Gaussian of mean and sigma between a and b
+inline double gaussianFraction(double a, double b, double mean, double sigma) {
+    double scale = 1.0 / (std::sqrt(2.0) * sigma);
+    return 0.5 * (std::erf((b - mean) * scale) - std::erf((a - mean) * scale));
+}
+
+// Expected number of events in [a, b] for the parameters p
+inline double chargeModel(double a, double b, const double* p) {
+    double meanPE = std::max(p[kFitMeanPE], 1e-9);
+    double speSigma = p[kFitSPEResolution] * p[kFitSPECharge];
+    double spread = std::sqrt(meanPE);
+
+    // Poisson terms that matter: mu +- 8 sigma
+    int first = std::max(0, static_cast<int>(std::floor(meanPE - 8 * spread - 3)));
+    int last = static_cast<int>(std::ceil(meanPE + 8 * spread + 5));
+    double expected = 0;
+    for (int n = first; n <= last; ++n) {
+        double poisson = std::exp(-meanPE + n * std::log(meanPE) - std::lgamma(n + 1.0));
+        double sigma = std::sqrt(p[kFitPedestalSigma] * p[kFitPedestalSigma] + n * speSigma * speSigma);
+        expected += poisson * gaussianFraction(a, b, p[kFitPedestal] + n * p[kFitSPECharge], std::max(sigma, 1e-12));
+    }
+    return p[kFitEvents] * expected;
+}
+
+// Fit of the areas (in coulombs) of one run. binNumber = 0 uses Freedman-Diaconis bins (streamingHistogram.h).
+inline ChargeFit fitChargeSpectrum(const std::vector<double>& areas, int binNumber = 0) {
+    ChargeFit fit;
+    fit.events = areas.size();
+    GainEstimate estimate = estimateGain(areas);
+    double mean = estimate.meanCharge * chargeMultiplier;
+    double variance = estimate.sigmaCharge * chargeMultiplier * estimate.sigmaCharge * chargeMultiplier;
+    if (areas.size() < 10 || mean <= 0 || variance <= 0)
+        return fit;
+
+    // Spectrum in picocoulombs
+    std::vector<double> charges;
+    charges.reserve(areas.size());
+    for (const double area : areas)
+        charges.push_back(area * chargeMultiplier);
+    QuantileSketch sketch;
+    for (const double charge : charges)
+        sketch.add(charge);
+    double margin = (sketch.max() - sketch.min()) * 0.02;
+    double low = sketch.min() - margin;
+    double high = sketch.max() + margin;
+    fit.bins = binNumber > 0 ? binNumber : std::max(10, binningFor(low, high, freedmanDiaconisWidth(sketch), sketch.count()).bins);
+    double width = (high - low) / fit.bins;
+    std::vector<double> counts(fit.bins, 0);
+    for (const double charge : charges)
+        counts[std::min(fit.bins - 1, static_cast<int>((charge - low) / width))]++;
+
+    // Starting values: photostatistics, and if there is a pedestal (events below half a photoelectron)
+    // mu = -ln(P(0)) with the pedestal mean and width taken from those events
+    double meanPE = mean * mean / variance;
+    double speCharge = variance / mean;
+    double pedestal = 0;
+    double pedestalSigma = 0.1 * speCharge;
+    std::vector<double> pedestalCharges;
+    for (const double charge : charges)
+        if (charge < 0.5 * speCharge)
+            pedestalCharges.push_back(charge);
+    if (pedestalCharges.size() >= 10 && pedestalCharges.size() < charges.size()) {
+        GainEstimate pedestalEstimate = estimateGain(pedestalCharges);
+        pedestal = pedestalEstimate.meanCharge;
+        pedestalSigma = std::max(pedestalEstimate.sigmaCharge, 1e-3 * speCharge);
+        meanPE = -std::log(static_cast<double>(pedestalCharges.size()) / charges.size());
+        speCharge = (mean - pedestal) / meanPE;
+    }
+
+    double start[kFitParameters];
+    start[kFitEvents] = charges.size();
+    start[kFitMeanPE] = meanPE;
+    start[kFitPedestal] = pedestal;
+    start[kFitPedestalSigma] = pedestalSigma;
+    start[kFitSPECharge] = speCharge;
+    start[kFitSPEResolution] = 0.3;
+
+    // Binned data and model, each bin is [x - width/2, x + width/2]
+    ROOT::Fit::BinData data(fit.bins, 1);
+    for (int bin = 0; bin < fit.bins; ++bin)
+        data.Add(low + (bin + 0.5) * width, counts[bin]);
+    std::function<double(const double*, const double*)> model = [width](const double* x, const double* p) {
+        return chargeModel(x[0] - 0.5 * width, x[0] + 0.5 * width, p);
+    };
+    ROOT::Math::WrappedParamFunction<std::function<double(const double*, const double*)>> function(model, 1, kFitParameters, start);
+
+    ROOT::Fit::Fitter fitter;
+    fitter.SetFunction(function, false);
+    fitter.Config().SetParamsSettings(kFitParameters, start);
+    fitter.Config().ParSettings(kFitEvents).SetLimits(0.5 * charges.size(), 2.0 * charges.size());
+    fitter.Config().ParSettings(kFitMeanPE).SetLimits(1e-3, std::max(10.0, 5 * meanPE));
+    fitter.Config().ParSettings(kFitPedestal).SetLimits(pedestal - speCharge, pedestal + speCharge);
+    fitter.Config().ParSettings(kFitPedestalSigma).SetLimits(1e-4 * speCharge, high - low);
+    fitter.Config().ParSettings(kFitSPECharge).SetLimits(0.05 * speCharge, 20 * speCharge);
+    fitter.Config().ParSettings(kFitSPEResolution).SetLimits(0, 2);
+    fitter.Config().SetMinimizer("Minuit2", "Migrad");
+    fitter.Config().SetParabErrors(true);
+    fitter.Config().MinimizerOptions().SetPrintLevel(0);
+    fitter.LikelihoodFit(data, true);
+
+    const ROOT::Fit::FitResult& result = fitter.Result();
+    fit.status = result.IsValid() ? result.Status() : std::max(1, result.Status());
+    for (int parameter = 0; parameter < kFitParameters; ++parameter) {
+        fit.value[parameter] = result.Parameter(parameter);
+        fit.error[parameter] = result.ParError(parameter);
+    }
+    fit.gain = fit.value[kFitSPECharge] / chargeMultiplier / electronCharge;
+    fit.gainError = fit.error[kFitSPECharge] / chargeMultiplier / electronCharge;
+
+    // Goodness of fit over the bins with something expected
+    for (int bin = 0; bin < fit.bins; ++bin) {
+        double expected = chargeModel(low + bin * width, low + (bin + 1) * width, fit.value);
+        if (expected > 0) {
+            fit.chi2 += (counts[bin] - expected) * (counts[bin] - expected) / expected;
+            fit.ndf++;
+        }
+    }
+    fit.ndf = std::max(0, fit.ndf - kFitParameters);
+    return fit;
+}
+
+// Header and one line of the fit results, the table read back by the scan scripts
+inline void writeChargeFitHeader(std::ostream& output) {
+    output << "# Run Events Gain GainError MeanPE MeanPEError SPECharge[pC] SPEChargeError[pC] SPEResolution SPEResolutionError "
+           << "Pedestal[pC] PedestalError[pC] PedestalSigma[pC] PedestalSigmaError[pC] Chi2 NDF FitStatus" << std::endl;
+}
+
+inline void writeChargeFitLine(std::ostream& output, const std::string& name, const ChargeFit& fit) {
+    output << name << " " << fit.events << " " << fit.gain << " " << fit.gainError << " "
+           << fit.value[kFitMeanPE] << " " << fit.error[kFitMeanPE] << " "
+           << fit.value[kFitSPECharge] << " " << fit.error[kFitSPECharge] << " "
+           << fit.value[kFitSPEResolution] << " " << fit.error[kFitSPEResolution] << " "
+           << fit.value[kFitPedestal] << " " << fit.error[kFitPedestal] << " "
+           << fit.value[kFitPedestalSigma] << " " << fit.error[kFitPedestalSigma] << " "
+           << fit.chi2 << " " << fit.ndf << " " << fit.status << std::endl;
+}
+
+#endif
@@ -1,13 +1,16 @@
 /*
  *  Charge Histogram Generator by Charly
- *  Version: 1.2
+ *  Version: 1.3
  *  Author: Carlos Flores Melendez
  *  Date: January 2024
  *  Andres Bello University - SAPHIR
  *  Chile
  *
  * This code is a ROOT macro that generates a Charge Histogram
- * using events stored in a set of txt files.  
+ * using the events stored by csvRead.cpp, either in the binary event
+ * store or in a set of txt files.
+ * The charge spectrum is then fitted (chargeFit.h) and the gain and mean
+ * number of photoelectrons are written to <name>_fit.txt.
  * 
  * In order to use this code, is necessary to run the csvRead.cpp macro first.
  */
@@ -18,9 +21,23 @@
 #include <string>
 #include <vector>
 #include <cmath>
+#include <limits>
+#include <memory>
+#include <algorithm>
 #include "TH1D.h"
 #include "TCanvas.h"
+#include "TSystem.h"
+#include "ROOT/RDataFrame.hxx"
 #include "ROOT/TThreadExecutor.hxx"
+#include "eventStore.h"
+#include "chargeAnalysis.h"
+#include "chargeFit.h"
+#include "analysisCache.h"
+#include "eventAccess.h"
+#include "instrumentation.h"
+#include "pulseProcessing.h"
+#include "signalWindow.h"
+#include "baselineEstimation.h"
 
 using namespace std;
 
@@ -29,9 +46,6 @@ int chargeHisto() {
     // Reset ROOT
     gROOT->Reset();
 
-    // Enable ROOT's implicit multithreading
-    ROOT::EnableImplicitMT();
-
     // EDITABLE Variables
     //--------------------------------------------------------------------------------------------------------------
     // Folder path
@@ -46,66 +60,256 @@ int chargeHisto() {
     // Last Time Point for Histogram:
     double maxTimeValue = 4000;
 
+    // Choose minTimeValue and maxTimeValue from the mean waveform of a strided sample of the events
+    // (see signalWindow.h); the values above are used when no pulse is found
+    bool autoWindow = true;
+    WindowDetectionOptions windowOptions;
+    windowOptions.sampleEvents = 64;    // Events averaged
+
+    // Read events from the binary event store written by csvRead (falls back to txt files if not found)
+    bool readEventStore = true;
+
+    // Process the event tree written by csvRead with RDataFrame, when it exists (takes precedence over the store)
+    bool readEventTree = false;
+
+    // Read only the baseline and window rows of the capture CSV, seeking with its row index (<name>.csv.idx written
+    // by csvRead, see csvIndex.h), instead of the analysis cache, event store or txt files. The window is not
+    // detected and pulses are not processed in this mode.
+    bool readCSVWindow = false;
+
+    // Threads used to process the events of the tree, store or txt files (0 = all cores)
+    unsigned int numberOfThreads = 0;
+
+    // Baseline of every event from its own baseline portion (false), or running mean of the baseline
+    // portion of all events read so far, as in version 1.2 (true)
+    bool runningBaseline = false;
+
+    // Baseline estimator of every event (see baselineEstimation.h): kBaselineMean, kBaselineMedian,
+    // kBaselineTruncatedMean or kBaselineMode. Events whose baseline RMS is above rmsCut robust sigmas of the
+    // baseline RMS of all events are left out of the histogram; every baseline is written to txt/Baselines.txt
+    BaselineOptions baselineOptions;
+    baselineOptions.method = kBaselineMedian;
+    baselineOptions.rmsCut = 5;         // 0 keeps every event
+
+    // Cache of per-event prefix sums keyed by the content of the capture CSV, shared by the capture folders
+    // next to this one: reruns with another window only do two lookups per event (see analysisCache.h).
+    // Built from the event store of csvRead; a capture without one is parsed and its waveforms are cached too
+    bool useAnalysisCache = true;
+    string cacheFolder = filefolder.substr(0, filefolder.find_last_of("/")) + "/analysis_cache";
+    unsigned long long cacheMaxBytes = 20ULL * 1024 * 1024 * 1024;  // Least recently used entries are removed above this size
+    bool clearAnalysisCache = false;    // Remove every entry of the cache before reading
+
+    // Fit the charge spectrum (pedestal + Poisson photoelectron peaks, see chargeFit.h) and write the
+    // gain and mean number of photoelectrons with their errors to <name>_fit.txt
+    bool fitSpectrum = true;
+
+    // Find and measure every pulse of the events (filter, trigger, constant-fraction time, pile-up flags, see
+    // pulseProcessing.h) and write them to <name>_pulses.root. Not available when reading the event tree.
+    bool processPulses = false;
+    PulseOptions pulseOptions;
+    pulseOptions.threshold = 5.0e-3;    // Trigger level in volts
+    pulseOptions.smoothing = 4;         // Points of the moving average
+
+    // Wall/CPU time, bytes and events/s of every phase in <name>_timing.json, and optionally in Chrome
+    // trace-event format in <name>_trace.json (see instrumentation.h)
+    bool writeTimingReport = true;
+    bool writeTimingTrace = false;
+
     //--------------------------------------------------------------------------------------------------------------
 
     // Vectors to store data
     vector<double> timeWindow;
-    vector<double> areas;
-    vector<double> areasMultiplied;
-    vector<double> minVoltages;
-    vector<double> maxVoltages;
+    ChargeResults results;
 
     // Variables
     bool error = false;
-    size_t numColumns = 0;
     size_t lineCount = 0;
     size_t resolution = 0;
     size_t eventNumber = 1;
-    int baselinePortion = 0;
-    int baselineCount = 0;
-    double baseline = 0;
     double timeValue = 0;
-    double voltageValue = 0;
-    double voltageCorrected = 0;
-    double meanBaseline = 0;
-    double maxVoltageSum = 0;
-    double minVoltageSum = 0;
-    double maxVoltageMean = 0;
-    double minVoltageMean = 0;
-    double globalMinVoltage = numeric_limits<double>::max();
-    double globalMaxVoltage = numeric_limits<double>::lowest();
-    double minArea = numeric_limits<double>::max();
-    double maxArea = numeric_limits<double>::lowest();
-    const double chargeMultiplier = 1000000000000.0; // Default value is 1000000000000.0 for pico coulombs
-    const double timeMultiplier = 1000000.0;    // Default value is 1000000.0 for microseconds
+    ChargeWindow window;
+    window.minTimeValue = minTimeValue;
+    window.maxTimeValue = maxTimeValue;
     cout << " " << endl;
     cout << "   --- Charge Histogram Generator by Charly ---    " << endl;
     cout << " " << endl;
-
-    // Read Time File ----------------------------------------------------------------------------------------------
-    string timeWindowFilename = (filefolder + "/txt/Time_Window.txt");
-    ifstream timeWindowFile(timeWindowFilename);
-    if (!timeWindowFile.is_open()) {
-        cerr << "-Error: Could not open file " << timeWindowFilename << endl;
-        error = true;
-        return 1;
+    string name = filefolder.substr(filefolder.find_last_of("/") + 1);
+    RunProfile profile("chargeHisto", name);
+    unique_ptr<RunProfile::Phase> phase(new RunProfile::Phase(profile, "open"));
+
+    // Event source: event tree or binary event store written by csvRead, or txt files otherwise
+    string storeFilename = filefolder + "/" + filefolder.substr(filefolder.find_last_of("/") + 1).c_str() + ".evs";
+    string treeFilename = filefolder + "/" + filefolder.substr(filefolder.find_last_of("/") + 1).c_str() + "_events.root";
+    EventStore store;
+    bool useTree = readEventTree && !gSystem->AccessPathName(treeFilename.c_str());
+
+    // Enable ROOT's implicit multithreading (RDataFrame) with numberOfThreads: the pool shares its task arena,
+    // which keeps the size it is first created with
+    ROOT::EnableImplicitMT(numberOfThreads);
+    ROOT::TThreadExecutor pool(numberOfThreads);
+
+    // Analysis cache entry of the capture CSV, added on the first run from the event store (the CSV is
+    // parsed only when there is no store)
+    string captureFilename = filefolder + "/" + filefolder.substr(filefolder.find_last_of("/") + 1).c_str() + ".csv";
+    CachedCapture cached;
+    bool useCache = false;
+
+    // Baseline and window rows straight from the capture CSV
+    EventReader csvEvents;
+    bool useCSVWindow = !useTree && readCSVWindow && csvEvents.openCSV(captureFilename, csvIndexPath(captureFilename));
+    if (!useTree && !useCSVWindow && useAnalysisCache && !gSystem->AccessPathName(captureFilename.c_str())) {
+        AnalysisCache cache(cacheFolder, cacheMaxBytes);
+        if (clearAnalysisCache) {
+            cache.clear();
+        }
+        bool hit = false;
+        cout << "Opening analysis cache entry of " << captureFilename << " ..." << endl;
+        useCache = cache.open(captureFilename, pool, cached, hit, readEventStore ? storeFilename : "");
+        if (useCache) {
+            cout << (hit ? string("- Cache hit") : "- Cache miss: prefix sums added to " + cacheFolder) << endl;
+        } else {
+            cout << "- Could not use the analysis cache, reading events without it" << endl;
+        }
+    }
+    bool useStore = !useTree && !useCSVWindow && !useCache && readEventStore && store.open(storeFilename);
+    double deltaT = 0;
+    double t0 = 0;
+
+    if (useTree) {
+        // Read Event Tree Metadata ------------------------------------------------------------------------------------
+        cout << "Reading " << treeFilename << " ..." << endl;
+        unique_ptr<TFile> treeFile(TFile::Open(treeFilename.c_str()));
+        TTree* tree = treeFile ? treeFile->Get<TTree>(eventTreeName) : nullptr;
+        if (tree == nullptr || tree->GetEntries() == 0) {
+            cerr << "-Error: Could not read tree " << eventTreeName << " in " << treeFilename << endl;
+            error = true;
+            return 1;
+        }
+        UInt_t treeResolution = 0;
+        tree->SetBranchAddress("resolution", &treeResolution);
+        tree->SetBranchAddress("t0", &t0);
+        tree->SetBranchAddress("deltaT", &deltaT);
+        tree->GetEntry(0);
+        resolution = treeResolution;
+        cout << "Event tree reading OK" << endl;
+        cout << "- Resolution: " << resolution << endl;
+        cout << "- Events in tree: " << tree->GetEntries() << endl;
+    } else if (useCSVWindow) {
+        // Read Row Index of the Capture CSV ---------------------------------------------------------------------------
+        resolution = csvEvents.resolution();
+        deltaT = csvEvents.deltaT();
+        t0 = csvEvents.t0();
+        cout << "Row index of " << captureFilename << (csvEvents.rowIndexLoaded() ? " reading OK" : " built OK") << endl;
+        cout << "- Resolution: " << resolution << endl;
+        cout << "- Events in CSV: " << csvEvents.eventCount() << endl;
+    } else if (useCache) {
+        // Read Cached Capture Header ----------------------------------------------------------------------------------
+        resolution = cached.resolution();
+        deltaT = cached.deltaT();
+        t0 = cached.t0();
+        cout << "Analysis cache reading OK" << endl;
+        cout << "- Resolution: " << resolution << endl;
+        cout << "- Events in cache: " << cached.eventCount() << endl;
+    } else if (useStore) {
+        // Read Event Store Header -------------------------------------------------------------------------------------
+        cout << "Reading " << storeFilename << " ..." << endl;
+        resolution = store.resolution();
+        deltaT = store.deltaT();
+        t0 = store.t0();
+        cout << "Event store reading OK" << endl;
+        cout << "- Resolution: " << resolution << endl;
+        cout << "- Events in store: " << store.eventCount() << endl;
     } else {
-        cout << "Reading " << timeWindowFilename << " ..." << endl;
+        // Read Time File ----------------------------------------------------------------------------------------------
+        string timeWindowFilename = (filefolder + "/txt/Time_Window.txt");
+        ifstream timeWindowFile(timeWindowFilename);
+        if (!timeWindowFile.is_open()) {
+            cerr << "-Error: Could not open file " << timeWindowFilename << endl;
+            error = true;
+            return 1;
+        } else {
+            cout << "Reading " << timeWindowFilename << " ..." << endl;
+        }
+
+        // Read Time Data
+        while (timeWindowFile >> timeValue) {
+            timeWindow.push_back(timeValue);
+            lineCount++;
+            //cout << timeValue << endl;
+        }
+
+        // Set resolution
+        resolution = lineCount;
+        cout << "Time window reading OK" << endl;
+        cout << "- Resolution: " << resolution << endl;
+        lineCount = 0;
+        if (resolution >= 2) {
+            deltaT = timeWindow.back() - timeWindow[timeWindow.size() - 2];
+        }
     }
 
-    // Read Time Data
-    while (timeWindowFile >> timeValue) {
-        timeWindow.push_back(timeValue);
-        lineCount++;
-        //cout << timeValue << endl;
+    // Time axis of tree and store from t0 and deltaT
+    if (useTree || useCSVWindow || useCache || useStore) {
+        for (size_t i = 0; i < resolution; ++i) {
+            timeWindow.push_back(t0 + i*deltaT);
+        }
     }
 
-    // Set resolution
-    resolution = lineCount;
-    cout << "Time window reading OK" << endl;
-    cout << "- Resolution: " << resolution << endl;
-    lineCount = 0;
+    // Integration Window Detection ----------------------------------------------------------------------------------
+    if (autoWindow && useCSVWindow) {
+        cout << " - WARNING - The integration window is not detected when reading the CSV window, using "
+             << minTimeValue << " to " << maxTimeValue << " points" << endl;
+    } else if (autoWindow && resolution > 0) {
+        phase.reset(new RunProfile::Phase(profile, "window detection"));
+        cout << " " << endl;
+        cout << "Detecting integration window..." << endl;
+        size_t sampledEvents = useCache ? min(numberOfEvents, cached.eventCount()) : (useStore ? min(numberOfEvents, store.eventCount()) : numberOfEvents);
+        DetectedWindow detected;
+        if (useTree) {
+            unique_ptr<TFile> treeFile(TFile::Open(treeFilename.c_str()));
+            TTree* tree = treeFile ? treeFile->Get<TTree>(eventTreeName) : nullptr;
+            if (tree != nullptr) {
+                vector<float> samples(resolution);
+                tree->SetBranchStatus("*", 0);
+                tree->SetBranchStatus("samples", 1);
+                tree->SetBranchAddress("samples", samples.data());
+                detected = detectSignalWindow(min<size_t>(numberOfEvents, tree->GetEntries()), resolution, [&](size_t event, double* out) {
+                    tree->GetEntry(event);
+                    copy(samples.begin(), samples.end(), out);
+                }, windowOptions);
+            }
+        } else {
+            detected = detectSignalWindow(sampledEvents, resolution, [&](size_t event, double* out) {
+                if (useCache || useStore) {
+                    const double* samples = useCache ? cached.event(event) : store.event(event);
+                    copy(samples, samples + resolution, out);
+                    return;
+                }
+                ifstream eventFile(filefolder + "/txt/Event" + to_string(event + 1) + ".txt");
+                double voltageValue = 0;
+                size_t point = 0;
+                fill(out, out + resolution, 0.0);
+                while (point < resolution && eventFile >> voltageValue) {
+                    out[point++] = voltageValue;
+                }
+            }, windowOptions);
+        }
+        phase->addEvents(detected.eventsUsed);
+        if (detected.found) {
+            minTimeValue = detected.minTimeValue;
+            maxTimeValue = detected.maxTimeValue;
+            window.minTimeValue = minTimeValue;
+            window.maxTimeValue = maxTimeValue;
+            cout << "- Mean waveform of " << detected.eventsUsed << " events: peak of " << detected.peakAmplitude << " V at point "
+                 << detected.peakPoint << " (baseline RMS " << detected.noise << " V)" << endl;
+            cout << "- Integration window: " << minTimeValue << " to " << maxTimeValue << " points" << endl;
+        } else {
+            cout << " - WARNING - No pulse found in the mean waveform of " << detected.eventsUsed << " events, using "
+                 << minTimeValue << " to " << maxTimeValue << " points" << endl;
+        }
+    }
 
+    phase.reset(new RunProfile::Phase(profile, "charge integration"));
     if (maxTimeValue > resolution){
         cerr << " - ERROR - maxTimeValue > resolution" << endl;
         error = true;
@@ -117,8 +321,7 @@ int chargeHisto() {
     } else {
         // Time Calculations ---------------------------------------------------------------------------------------
 
-        // Calculate Delta T
-        double deltaT = timeWindow.back() - timeWindow[timeWindow.size() - 2];
+        // Delta T
         cout << "- Delta T: " << deltaT << endl;
 
         // Calculate constant factor with 50 ohm
@@ -126,212 +329,269 @@ int chargeHisto() {
         cout << "- Constant factor: " << constantFactor << endl;
 
         // Calculate portion of baseline to obtain meanBaseline
-        baselinePortion = static_cast<int>(round((resolution*10)/100)); // Portion of 10%
-        cout << "- Baseline portion: " << baselinePortion << " points" << endl;
+        window.baselinePortion = baselinePortionFor(resolution); // Portion of 10%
+        cout << "- Baseline portion: " << window.baselinePortion << " points" << endl;
+
+        // Charge of every event, added in event order
+        ChargeAccumulator charges(constantFactor, runningBaseline);
+        vector<EventSums> eventSums;
 
-        // Read txt Event Files ------------------------------------------------------------------------------------
+        // Read Events -----------------------------------------------------------------------------------------------
         cout << " " << endl;
-        cout << "Reading events in " << filefolder + "/txt/" << " ..." << endl;
-        for(eventNumber = 1; eventNumber <= numberOfEvents; ++eventNumber){
-            double minVoltage = numeric_limits<double>::max();
-            double maxVoltage = numeric_limits<double>::lowest();
-            string eventFilename = (filefolder + "/txt/Event" + to_string(eventNumber) + ".txt");
-            ifstream eventFile(eventFilename);
-            double area = 0;
-            if (!eventFile.is_open()) {
-                cerr << " - ERROR - Could not open file " << eventFilename << endl;
+        if (useTree) {
+            // Event sums computed in parallel by RDataFrame, then sorted back in event order
+            cout << "Processing events in " << treeFilename << " with RDataFrame ..." << endl;
+            ROOT::RDataFrame dataFrame(eventTreeName, treeFilename);
+            auto sumsResult = dataFrame
+                .Filter([=](UInt_t event) { return event <= numberOfEvents; }, {"eventNumber"})
+                .Define("sums", [=](UInt_t event, const ROOT::RVecF& samples) {
+                    EventSums sums = sumEvent(samples.data(), samples.size(), window);
+                    estimateEventBaseline(sums, samples.data(), samples.size(), window, baselineOptions);
+                    sums.eventNumber = event;
+                    return sums;
+                }, {"eventNumber", "samples"})
+                .Take<EventSums>("sums");
+            eventSums = *sumsResult;
+            sort(eventSums.begin(), eventSums.end(), [](const EventSums& a, const EventSums& b) { return a.eventNumber < b.eventNumber; });
+            if (eventSums.size() < numberOfEvents) {
+                cerr << " - ERROR - Only " << eventSums.size() << " events found in " << treeFilename << endl;
                 error = true;
                 return 4;
-            } else {
-                //cout << "Reading txt file: " << eventFilename << " ...";
             }
-            
-            // Read Voltage Data
-            while (eventFile >> voltageValue) {
-                // Store Baseline Values
-                if(lineCount <= baselinePortion){
-                    baseline = baseline + voltageValue;
-                    baselineCount++;
-
-                    // Calculate meanBaseline    
-                    if(lineCount == baselinePortion){
-                        meanBaseline = baseline/baselineCount;
-                    }
-
-                } else {
-                    // Read pulse voltage points and calculate area
-                    if(lineCount >= minTimeValue && lineCount <= maxTimeValue){
-                        voltageCorrected = voltageValue - meanBaseline;
-                        maxVoltage = max(maxVoltage, voltageCorrected);
-                        minVoltage = min(minVoltage, voltageCorrected);
-                        area = area + voltageCorrected;
-                    }
-                }
-                lineCount++;
-                //cout << voltageValue << endl;
+            flagBaselineOutliers(eventSums, baselineOptions.rmsCut);
+            for (const EventSums& sums : eventSums) {
+                charges.add(sums);
             }
-            // Line Count Error check
-            if(lineCount != resolution){
-                areas.push_back(0);
-                cerr << " - ERROR - Line count not match in " << eventFilename << endl;
-                cerr << "Line count: " << lineCount << endl;
-                error = true;
-                return 5;
-            } else {
-                // Store area behind the curve of current event
-                areas.push_back(area*-constantFactor);
-                maxVoltages.push_back(maxVoltage);
-                minVoltages.push_back(minVoltage);
-                //cout << "Event " << eventNumber <<  " reading OK" << endl;
+            phase->addBytesRead(fileSizeBytes(treeFilename));
+            phase->addEvents(eventSums.size());
+            cout << "- Events Processed: " << eventSums.size();
+            if (processPulses) {
+                cout << " " << endl;
+                cout << " - WARNING - Pulse processing needs the event store, cache or txt files, skipped with the event tree" << endl;
             }
-            lineCount = 0;
-        
-            //Print progress
-            if (eventNumber % 1 == 0) {
-                cout << "\r- Events Processed: " << eventNumber;
-                cout.flush();
+        } else {
+            // Events are independent: their sums are computed in parallel on the pool and added in event order
+            string source = useCSVWindow ? captureFilename : (useCache ? cacheFolder : (useStore ? storeFilename : filefolder + "/txt/"));
+            cout << "Reading events in " << source << " with " << pool.GetPoolSize() << " threads ..." << endl;
+            size_t availableEvents = useCSVWindow ? csvEvents.eventCount() : (useCache ? cached.eventCount() : (useStore ? store.eventCount() : numberOfEvents));
+            if (numberOfEvents > availableEvents) {
+                cerr << " - ERROR - Event " << availableEvents + 1 << " not found in " << source << endl;
+                error = true;
+                return 4;
             }
-        }
-    }
-
-    // Charge Histogram --------------------------------------------------------------------------------------------
 
-    // Calculate bin number
-    cout << " " << endl;
-    cout << " " << endl;
-    cout << "Calculating bin number..." << endl;
-    int binNumber = 7*sqrt(areas.size());
-    cout << "- Bin number: " << binNumber << endl;
-    cout << " " << endl;
-    cout << "Creating Histogram..." << endl;
-
-    // Unit Conversion of areas
-    for (const double value : areas) {
-        areasMultiplied.push_back(value * chargeMultiplier);
-    }
-
-    // Calculate min and max values of areas
-    for (const double areaValue : areasMultiplied){
-        minArea = min(minArea, areaValue);
-        maxArea = max(maxArea, areaValue);
-    }
+            // Waveforms of the events: a view over the mapped store, or filled from the txt files in the loop below
+            Waveforms waveforms;
+            if (useStore && !store.view(waveforms)) {
+                cerr << " - ERROR - Unexpected event layout in " << storeFilename << endl;
+                error = true;
+                return 4;
+            } else if (!useCSVWindow && !useCache && !useStore) {
+                waveforms.allocate(numberOfEvents, resolution, kWaveformFloat64);
+            }
 
-    // Create a TCanvas
-    TCanvas *canvas = new TCanvas("canvas", "Charge Histogram", 1920, 1080);
+            // Baseline and window rows of the CSV, the rest of the file is not read
+            size_t baselineEnd = baselineEndFor(resolution, window);
+            size_t windowBegin = 0;
+            size_t windowCount = 0;
+            windowRangeFor(resolution, window, windowBegin, windowCount);
+            vector<double> baselineSamples;
+            vector<double> windowSamples;
+            if (useCSVWindow) {
+                baselineSamples.resize(numberOfEvents * baselineEnd);
+                windowSamples.resize(numberOfEvents * windowCount);
+                if (!csvEvents.read(0, numberOfEvents, 0, baselineEnd, baselineSamples.data()) ||
+                    !csvEvents.read(0, numberOfEvents, windowBegin, windowCount, windowSamples.data())) {
+                    cerr << " - ERROR - Could not read the rows of the window in " << captureFilename << endl;
+                    error = true;
+                    return 4;
+                }
+            }
 
-    // Set Grid
-    canvas->SetGrid();
+            // Error code and line count of every txt event, reported after the parallel loop
+            vector<int> eventStatus(numberOfEvents, 0);
+            vector<size_t> eventLineCount(numberOfEvents, 0);
+            eventSums = sumEventsParallel(pool, numberOfEvents, [&](size_t event) {
+                EventSums sums;
+                if (useCSVWindow) {
+                    // Sums of the two row ranges read above
+                    const double* baseline = baselineSamples.data() + event * baselineEnd;
+                    sums = sumEventSlices(baseline, baselineEnd, windowSamples.data() + event * windowCount, windowCount);
+                    setBaseline(sums, estimateBaseline(baseline, baselineEnd, baselineOptions));
+                    return sums;
+                } else if (useCache) {
+                    // Prefix sums of the cached capture, only the baseline portion is read for its estimate
+                    sums = cached.eventSums(event, window);
+                    estimateEventBaseline(sums, cached.event(event), resolution, window, baselineOptions);
+                    return sums;
+                } else if (useStore) {
+                    // Samples straight from the mapped store
+                    sums = sumEvent(waveforms, event, window);
+                    estimateEventBaseline(sums, waveforms, event, window, baselineOptions);
+                    return sums;
+                }
 
-    // New Histrogram
-    auto h1 = new TH1D("Charge", ("Charge Histogram - " + filefolder.substr(filefolder.find_last_of("/") + 1)).c_str(), binNumber, 0, maxArea*1.05);
-    
-    // Fill the histogram with voltage data of all events
-    for (double areaValue : areasMultiplied) {
-        h1->Fill(areaValue);
-    }
+                string eventFilename = (filefolder + "/txt/Event" + to_string(event + 1) + ".txt");
+                ifstream eventFile(eventFilename);
+                if (!eventFile.is_open()) {
+                    eventStatus[event] = 4;
+                    return EventSums();
+                }
 
-    // Draw the histogram on the canvas
-    h1->Draw();
+                // Read Voltage Data
+                double* samples = waveforms.event<double>(event);
+                double voltageValue = 0;
+                size_t lineCount = 0;
+                while (eventFile >> voltageValue) {
+                    if (lineCount < resolution) {
+                        samples[lineCount] = voltageValue;
+                    }
+                    lineCount++;
+                }
+                eventLineCount[event] = lineCount;
+                if (lineCount != resolution) {
+                    eventStatus[event] = 5;
+                    return EventSums();
+                }
+                sums = sumEvent(waveforms, event, window);
+                estimateEventBaseline(sums, waveforms, event, window, baselineOptions);
+                return sums;
+            }, pool.GetPoolSize() * 4);
+            flagBaselineOutliers(eventSums, baselineOptions.rmsCut);
+
+            for(eventNumber = 1; eventNumber <= numberOfEvents; ++eventNumber){
+                string eventFilename = (filefolder + "/txt/Event" + to_string(eventNumber) + ".txt");
+                if (eventStatus[eventNumber - 1] == 4) {
+                    cerr << " - ERROR - Could not open file " << eventFilename << endl;
+                    error = true;
+                    return 4;
+                } else if (eventStatus[eventNumber - 1] == 5) {
+                    // Line Count Error check
+                    cerr << " - ERROR - Line count not match in " << eventFilename << endl;
+                    cerr << "Line count: " << eventLineCount[eventNumber - 1] << endl;
+                    error = true;
+                    return 5;
+                }
 
-    // Set axis label
-    h1->GetXaxis()->SetTitle(("Picocoulombs"));
+                charges.add(eventSums[eventNumber - 1]);
 
-    // Save the canvas as a PNG file
-    string pngFilename;
-    pngFilename = filefolder + "/images/Charge_Histogram_" + filefolder.substr(filefolder.find_last_of("/") + 1).c_str() + ".png";
-    canvas->SaveAs(pngFilename.c_str());
+                //Print progress
+                if (eventNumber % 1 == 0) {
+                    cout << "\r- Events Processed: " << eventNumber;
+                    cout.flush();
+                }
+            }
 
-    // Max and Min Voltages Files ----------------------------------------------------------------------------------
+            // Bytes of the events read (the cache only touches a few prefix sums per event)
+            if (useCSVWindow) {
+                phase->addBytesRead(csvEvents.bytesRead());
+            } else if (useStore) {
+                phase->addBytesRead(sizeof(double) * resolution * numberOfEvents);
+            } else if (!useCache) {
+                for (eventNumber = 1; eventNumber <= numberOfEvents; ++eventNumber) {
+                    phase->addBytesRead(fileSizeBytes(filefolder + "/txt/Event" + to_string(eventNumber) + ".txt"));
+                }
+            }
+            phase->addEvents(numberOfEvents);
+
+            // Pulse Processing ----------------------------------------------------------------------------------------
+            if (processPulses && useCSVWindow) {
+                cout << " " << endl;
+                cout << " - WARNING - Pulse processing needs whole events, skipped when reading the CSV window" << endl;
+            } else if (processPulses) {
+                cout << " " << endl;
+                cout << "Processing pulses..." << endl;
+                RunProfile::Phase pulsePhase = profile.phase("pulse processing");
+                pulsePhase.addEvents(numberOfEvents);
+                PulseColumns pulses = findPulsesParallel(pool, numberOfEvents, resolution, [&](size_t event) {
+                    return useCache ? cached.event(event) : waveforms.event<double>(event);
+                }, [&](size_t event) {
+                    return eventBaseline(eventSums[event]);
+                }, pulseOptions, constantFactor * chargeMultiplier, pool.GetPoolSize() * 4);
+
+                size_t pileUp = 0;
+                for (const uint8_t flags : pulses.flags) {
+                    pileUp += (flags & kPulsePileUp) ? 1 : 0;
+                }
+                cout << "- Pulses found: " << pulses.size() << " (" << pulses.cleanPulses() << " without flags, " << pileUp << " pile-up)" << endl;
 
-    cout << " " << endl;
-    cout << "Creating Max and Min Voltage txt files..." << endl;
+                string pulsesFilename = filefolder + "/" + name + "_pulses.root";
+                if (!writePulseTree(pulsesFilename, pulses, name)) {
+                    cerr << " - ERROR - Could not write " << pulsesFilename << endl;
+                    error = true;
+                    return 12;
+                }
+                pulsePhase.addFileWritten(pulsesFilename);
+                cout << "- Pulses saved in " << pulsesFilename << endl;
+            }
+        }
+        results = charges.get();
 
-    // Calculate average minimum and maximum voltage across events
-    for (const double value : minVoltages) {
-        minVoltageSum = minVoltageSum + value;
-    }
-    minVoltageMean = minVoltageSum/(minVoltages.size());
-                    
-    for (const double value : maxVoltages) {
-        maxVoltageSum = maxVoltageSum + value;
-    }                
-    maxVoltageMean = maxVoltageSum/(maxVoltages.size());
-
-    // Calculate Absolute Maximum and Minimum
-    for (const double value : minVoltages) {
-        globalMinVoltage = min(globalMinVoltage, value);
+        // Baseline of every event
+        cout << " " << endl;
+        cout << "- Baseline estimator: " << baselineMethodName(baselineOptions.method) << endl;
+        cout << "- Events excluded for their baseline RMS: " << charges.excludedEvents() << endl;
+        string baselinesFilename = filefolder + "/txt/Baselines.txt";
+        if (!writeBaselineFile(baselinesFilename, eventSums, baselineOptions)) {
+            cerr << " - ERROR - Could not open file for writing Baselines data" << endl;
+            error = true;
+            return 13;
+        }
+        phase->addFileWritten(baselinesFilename);
     }
-    for (const double value : maxVoltages) {
-        globalMaxVoltage = max(globalMaxVoltage, value);
-    } 
-    
-    // Print averages and absoluts Max and Mins
-    cout << "- Average Min Voltage: " << minVoltageMean << endl;
-    cout << "- Average Max Voltage:  " << maxVoltageMean << endl;
-    cout << "- Global Min Voltage:  " << globalMinVoltage << endl;
-    cout << "- Global Max Voltage:   " << globalMaxVoltage << endl;
-    cout << " " << endl;
-    
-    // Open a file for writing minVoltages data
-    ofstream minVoltagesFile(filefolder + "/txt/MinVoltages.txt");
-    if (!minVoltagesFile.is_open()) {
-        cerr << " - ERROR - Could not open file for writing MinVoltages data" << endl;
+
+    // Charge Histogram, Min/Max Voltages Files and ROOT File -----------------------------------------------------
+    phase.reset(new RunProfile::Phase(profile, "charge histogram and ROOT write"));
+    phase->addEvents(results.areas.size());
+    int status = writeChargeOutputs(filefolder, results, window, timeWindow[minTimeValue - 1], timeWindow[maxTimeValue - 1]);
+    if (status != 0) {
         error = true;
-        return 6;
+        return status;
     }
-
-    // Write minVoltages file
-    minVoltagesFile << "- SUMMARY -----------------------------------------------------" << endl;
-    minVoltagesFile << "Time Window in microseconds: " << (timeWindow[minTimeValue - 1])*timeMultiplier << " to " << (timeWindow[maxTimeValue - 1])*timeMultiplier << " microseconds" << endl;
-    minVoltagesFile << "Time Window in points: " << minTimeValue << " to " << maxTimeValue << " points" << endl;
-    minVoltagesFile << "Average Minimun Voltage: " << minVoltageMean << endl;
-    minVoltagesFile << "Global Minimum Voltage:  " << globalMinVoltage << endl;
-    minVoltagesFile << " " << endl;
-    minVoltagesFile << "- MIN VOLTAGE VALUES ------------------------------------------" << endl;
-    for (const double value : minVoltages) {
-        // Write maxVoltage data
-        minVoltagesFile << value << endl;
+    for (const string& path : chargeOutputFiles(filefolder)) {
+        phase->addFileWritten(path);
     }
 
-    // Close the minVoltages file
-    minVoltagesFile.close();
+    // Charge Spectrum Fit -----------------------------------------------------------------------------------------
+    if (fitSpectrum) {
+        cout << " " << endl;
+        cout << "Fitting charge spectrum..." << endl;
+        phase.reset(new RunProfile::Phase(profile, "spectrum fit"));
+        phase->addEvents(results.areas.size());
+        ChargeFit fit = fitChargeSpectrum(keptValues(results.areas));
+        if (fit.status != 0) {
+            cerr << " - WARNING - Charge spectrum fit did not converge (status " << fit.status << ")" << endl;
+        }
+        cout << "- Gain: " << fit.gain << " +- " << fit.gainError << endl;
+        cout << "- Mean PE: " << fit.value[kFitMeanPE] << " +- " << fit.error[kFitMeanPE] << endl;
+        cout << "- SPE Charge: " << fit.value[kFitSPECharge] << " +- " << fit.error[kFitSPECharge] << " pC" << endl;
+        cout << "- Chi2/NDF: " << fit.chi2 << "/" << fit.ndf << endl;
+        cout << " " << endl;
 
-    // Open a file for writing maxVoltages data
-    ofstream maxVoltagesFile(filefolder + "/txt/MaxVoltages.txt");
-    if (!maxVoltagesFile.is_open()) {
-        cerr << " - ERROR - Could not open file for writing MaxVoltages data" << endl;
-        error = true;
-        return 7;
+        string fitFilename = filefolder + "/" + name + "_fit.txt";
+        ofstream fitFile(fitFilename);
+        if (!fitFile.is_open()) {
+            cerr << " - ERROR - Could not open file " << fitFilename << endl;
+            error = true;
+            return 11;
+        }
+        writeChargeFitHeader(fitFile);
+        writeChargeFitLine(fitFile, name, fit);
     }
+    phase.reset();
 
-    // Write maxVoltages file
-    maxVoltagesFile << "- SUMMARY -----------------------------------------------------" << endl;
-    maxVoltagesFile << "Time Window in microseconds: " << (timeWindow[minTimeValue - 1])*timeMultiplier << " to " << (timeWindow[maxTimeValue - 1])*timeMultiplier << " microseconds" << endl;
-    maxVoltagesFile << "Time Window in points: " << minTimeValue << " to " << maxTimeValue << " points" << endl;
-    maxVoltagesFile << "Average Maximum Voltage: " << maxVoltageMean << endl;
-    maxVoltagesFile << "Global Maximum Voltage:  " << globalMaxVoltage << endl;
-    maxVoltagesFile << " " << endl;
-    maxVoltagesFile << "- MAX VOLTAGE VALUES ------------------------------------------" << endl;
-    for (const double value : maxVoltages) {
-        // Write maxVoltage data
-        maxVoltagesFile << value << endl;
+    // Timing Report -----------------------------------------------------------------------------------------------
+    cout << " " << endl;
+    profile.print(cout);
+    cout << " " << endl;
+    string timingFilename = filefolder + "/" + name + "_timing.json";
+    string traceFilename = filefolder + "/" + name + "_trace.json";
+    if (writeTimingReport && !profile.writeJSON(timingFilename)) {
+        cerr << " - WARNING - Could not write timing report " << timingFilename << endl;
+    }
+    if (writeTimingTrace && !profile.writeChromeTrace(traceFilename)) {
+        cerr << " - WARNING - Could not write timing trace " << traceFilename << endl;
     }
-
-    // Close the maxVoltages file
-    maxVoltagesFile.close();
-
-    // Create a ROOT File with the histogram -----------------------------------------------------------------------
-    cout << "Creating ROOT File..." << endl;
-
-    // Create TFile
-    string rootFilename;
-    rootFilename = filefolder + "/" + filefolder.substr(filefolder.find_last_of("/") + 1).c_str() + ".root";
-    auto *f = new TFile (rootFilename.c_str(),  "RECREATE");
-
-    // Save TFile
-    h1->Write();
-    f->Write();
-    f->Close();
 
     // END ---------------------------------------------------------------------------------------------------------
     if (!error) {
@@ -0,0 +1,94 @@
+/*
+ *  Allocation Counter
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * Replacement of the global operator new and delete that counts the heap
+ * allocations of a program, for the allocations field of RunProfile (see
+ * instrumentation.h). This file is not a macro: neither the ROOT
+ * interpreter nor a library loaded by ACLiC can replace operator new, so
+ * under root -l the field is null. To count allocations, build the macro
+ * as a program with g++, COUNT_ALLOCATIONS defined and a main that calls
+ * it, e.g. for csvRead.cpp:
+ *
+ *   echo 'int csvRead(); int main() { return csvRead(); }' | g++ -O2 -DCOUNT_ALLOCATIONS -o csvReadCounted \
+ *       csvRead.cpp countAllocations.cpp -x c++ - $(root-config --cflags --libs)
+ *   ./csvReadCounted
+ */
+
+#ifndef COUNT_ALLOCATIONS
+#define COUNT_ALLOCATIONS
+#endif
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include "instrumentation.h"
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+std::atomic<uint64_t>& allocationCounter() {
+    static std::atomic<uint64_t> counter(0);
+    return counter;
+}
+
+// Counted allocation, nullptr if it fails
+static void* countedMalloc(std::size_t size) {
+    allocationCounter().fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+// Counted allocation aligned to alignment (a power of two), nullptr if it fails. Released with alignedFree
+static void* countedAlignedMalloc(std::size_t size, std::align_val_t alignment) {
+    allocationCounter().fetch_add(1, std::memory_order_relaxed);
+    std::size_t bytes = static_cast<std::size_t>(alignment);
+    std::size_t rounded = ((size ? size : 1) + bytes - 1) / bytes * bytes;   // aligned_alloc needs a multiple of the alignment
+#ifdef _WIN32
+    return _aligned_malloc(rounded, bytes);
+#else
+    return std::aligned_alloc(bytes, rounded);
+#endif
+}
+
+static void alignedFree(void* pointer) {
+#ifdef _WIN32
+    _aligned_free(pointer);
+#else
+    std::free(pointer);
+#endif
+}
+
+// Plain ------------------------------------------------------------------------------------------------------------------
+void* operator new(std::size_t size) {
+    if (void* pointer = countedMalloc(size))
+        return pointer;
+    throw std::bad_alloc();
+}
+void* operator new[](std::size_t size) { return operator new(size); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return countedMalloc(size); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return countedMalloc(size); }
+void operator delete(void* pointer) noexcept { std::free(pointer); }
+void operator delete[](void* pointer) noexcept { std::free(pointer); }
+void operator delete(void* pointer, std::size_t) noexcept { std::free(pointer); }
+void operator delete[](void* pointer, std::size_t) noexcept { std::free(pointer); }
+void operator delete(void* pointer, const std::nothrow_t&) noexcept { std::free(pointer); }
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept { std::free(pointer); }
+
+// Aligned (alignas larger than the default new alignment) ----------------------------------------------------------------
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    if (void* pointer = countedAlignedMalloc(size, alignment))
+        return pointer;
+    throw std::bad_alloc();
+}
+void* operator new[](std::size_t size, std::align_val_t alignment) { return operator new(size, alignment); }
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return countedAlignedMalloc(size, alignment); }
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return countedAlignedMalloc(size, alignment); }
+void operator delete(void* pointer, std::align_val_t) noexcept { alignedFree(pointer); }
+void operator delete[](void* pointer, std::align_val_t) noexcept { alignedFree(pointer); }
+void operator delete(void* pointer, std::size_t, std::align_val_t) noexcept { alignedFree(pointer); }
+void operator delete[](void* pointer, std::size_t, std::align_val_t) noexcept { alignedFree(pointer); }
+void operator delete(void* pointer, std::align_val_t, const std::nothrow_t&) noexcept { alignedFree(pointer); }
+void operator delete[](void* pointer, std::align_val_t, const std::nothrow_t&) noexcept { alignedFree(pointer); }
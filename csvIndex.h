@@ -0,0 +1,218 @@
+/*
+ *  Keysight CSV Row Index
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * The capture CSV is row-major: one row per time point with a time and a
+ * voltage column per event, so any time range of all events is a single
+ * run of bytes, but finding where it starts means counting the newlines
+ * before it. The row index keeps the byte offset of every stride-th data
+ * row, the number of columns and the time axis, and is saved next to the
+ * capture as <name>.csv.idx by csvRead.cpp. With it a later tool seeks
+ * straight to the rows of a range of points and reads only their bytes
+ * (EventReader::openCSV in eventAccess.h).
+ *
+ * Layout (native byte order):
+ *   header   - magic, version, stride, rows, columns, size and modification
+ *              time of the CSV, t0, deltaT
+ *   offsets  - byte offset of data rows 0, stride, 2*stride...
+ *
+ * An index whose CSV changed size or modification time, or whose offsets do
+ * not fall on the start of a line, is stale and built again.
+ */
+
+#ifndef CSV_INDEX_H
+#define CSV_INDEX_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <vector>
+#include "keysightCSV.h"
+
+const char csvIndexMagic[8] = {'S', 'A', 'P', 'H', 'I', 'D', 'X', '\0'};
+const uint32_t csvIndexVersion = 2;
+const size_t csvIndexDefaultStride = 256;
+
+struct CSVIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t stride;
+    uint64_t rows;
+    uint64_t columns;
+    uint64_t fileSize;
+    int64_t modificationTime;
+    double t0;          // Time of the first row in seconds
+    double deltaT;      // Time between rows in seconds
+};
+
+struct CSVIndex {
+    size_t stride = csvIndexDefaultStride;
+    size_t rows = 0;                        // Data rows after the header lines
+    size_t columns = 0;                     // Values of the first data row, a time and a voltage column per event
+    uint64_t fileSize = 0;
+    int64_t modificationTime = 0;
+    double t0 = 0;
+    double deltaT = 0;
+    std::vector<uint64_t> rowOffsets;       // Byte offset of data rows 0, stride, 2*stride...
+
+    bool empty() const { return rows == 0; }
+    size_t events() const { return columns / 2; }
+
+    // Start of a data row in the mapped CSV, at most stride - 1 lines are skipped
+    const char* row(const MappedFile& file, size_t row) const {
+        const char* p = file.begin() + rowOffsets[row / stride];
+        return skipLines(p, file.end(), row % stride);
+    }
+};
+
+// Size and modification time of a file, false if it does not exist
+inline bool csvFileStamp(const std::string& path, uint64_t& size, int64_t& modificationTime) {
+    std::error_code error;
+    size = std::filesystem::file_size(path, error);
+    if (error)
+        return false;
+    auto time = std::filesystem::last_write_time(path, error);
+    if (error)
+        return false;
+    modificationTime = static_cast<int64_t>(time.time_since_epoch().count());
+    return true;
+}
+
+// Sidecar file of a capture CSV
+inline std::string csvIndexPath(const std::string& csvFilename) {
+    return csvFilename + ".idx";
+}
+
+// Index of a mapped capture CSV, with one newline scan. False if it has no data rows.
+inline bool buildCSVIndex(const MappedFile& file, CSVIndex& index, size_t stride = csvIndexDefaultStride) {
+    index = CSVIndex();
+    index.stride = std::max<size_t>(1, stride);
+    const char* p = skipLines(file.begin(), file.end(), keysightHeaderLines);
+    const char* end = file.end();
+    const char* previousRow = p;
+    const char* lastRow = p;
+    while (p < end) {
+        const char* lineEnd = findLineEnd(p, end);
+        if (index.rows % index.stride == 0)
+            index.rowOffsets.push_back(static_cast<uint64_t>(p - file.begin()));
+        if (index.rows == 0) {
+            index.columns = parseLine(p, lineEnd, [&](size_t column, double value) {
+                if (column == 0)
+                    index.t0 = value;
+            });
+        }
+        previousRow = lastRow;
+        lastRow = p;
+        index.rows++;
+        p = (lineEnd < end) ? lineEnd + 1 : end;
+    }
+    if (index.rows == 0)
+        return false;
+
+    // deltaT from the last two rows, as parseKeysightWaveforms()
+    double times[2] = {0, 0};
+    const char* rows[2] = {previousRow, lastRow};
+    for (size_t last = 0; last < 2; ++last) {
+        parseLine(rows[last], findLineEnd(rows[last], end), [&](size_t column, double value) {
+            if (column == 0)
+                times[last] = value;
+        });
+    }
+    index.deltaT = index.rows >= 2 ? times[1] - times[0] : 0;
+    return true;
+}
+
+// Write the index to filename. Returns false if the file could not be written.
+inline bool writeCSVIndex(const std::string& filename, const CSVIndex& index) {
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (file == nullptr)
+        return false;
+
+    CSVIndexHeader header;
+    memcpy(header.magic, csvIndexMagic, sizeof(header.magic));
+    header.version = csvIndexVersion;
+    header.stride = static_cast<uint32_t>(index.stride);
+    header.rows = index.rows;
+    header.columns = index.columns;
+    header.fileSize = index.fileSize;
+    header.modificationTime = index.modificationTime;
+    header.t0 = index.t0;
+    header.deltaT = index.deltaT;
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fwrite(index.rowOffsets.data(), sizeof(uint64_t), index.rowOffsets.size(), file) == index.rowOffsets.size();
+    ok = (fclose(file) == 0) && ok;
+    if (!ok)
+        remove(filename.c_str());
+    return ok;
+}
+
+// Read an index written by writeCSVIndex, false if it is missing or not a usable index
+inline bool readCSVIndex(const std::string& filename, CSVIndex& index) {
+    MappedFile file(filename);
+    CSVIndexHeader header;
+    if (!file.isOpen() || file.size() < sizeof(header))
+        return false;
+    memcpy(&header, file.begin(), sizeof(header));
+    if (memcmp(header.magic, csvIndexMagic, sizeof(header.magic)) != 0 || header.version != csvIndexVersion || header.stride == 0)
+        return false;
+    size_t offsets = static_cast<size_t>((header.rows + header.stride - 1) / header.stride);
+    if (file.size() != sizeof(header) + offsets * sizeof(uint64_t))
+        return false;
+
+    index = CSVIndex();
+    index.stride = header.stride;
+    index.rows = header.rows;
+    index.columns = header.columns;
+    index.fileSize = header.fileSize;
+    index.modificationTime = header.modificationTime;
+    index.t0 = header.t0;
+    index.deltaT = header.deltaT;
+    index.rowOffsets.resize(offsets);
+    memcpy(index.rowOffsets.data(), file.begin() + sizeof(header), offsets * sizeof(uint64_t));
+    return true;
+}
+
+// True if index was built from the mapped CSV at path as it is now
+inline bool csvIndexMatches(const CSVIndex& index, const std::string& path, const MappedFile& file) {
+    uint64_t size = 0;
+    int64_t modificationTime = 0;
+    if (!csvFileStamp(path, size, modificationTime) || size != index.fileSize || modificationTime != index.modificationTime ||
+        size != file.size() || index.rows == 0)
+        return false;
+    for (uint64_t offset : index.rowOffsets) {
+        if (offset == 0 || offset >= file.size() || file.begin()[offset - 1] != '\n')
+            return false;
+    }
+    return true;
+}
+
+// Index of the mapped CSV at path: read from indexFilename when it matches the CSV, built otherwise and,
+// if indexFilename is not empty, saved there. loaded tells which one happened and saved whether a built
+// index was written. False if the CSV has no data rows.
+inline bool openCSVIndex(const std::string& path, const MappedFile& file, CSVIndex& index, const std::string& indexFilename,
+                         size_t stride = csvIndexDefaultStride, bool* loaded = nullptr, bool* saved = nullptr) {
+    if (loaded != nullptr)
+        *loaded = false;
+    if (saved != nullptr)
+        *saved = false;
+    if (!indexFilename.empty() && readCSVIndex(indexFilename, index) && csvIndexMatches(index, path, file)) {
+        if (loaded != nullptr)
+            *loaded = true;
+        return true;
+    }
+    if (!buildCSVIndex(file, index, stride))
+        return false;
+    bool stamped = csvFileStamp(path, index.fileSize, index.modificationTime);
+    bool written = !indexFilename.empty() && stamped && writeCSVIndex(indexFilename, index);
+    if (saved != nullptr)
+        *saved = written;
+    return true;
+}
+
+#endif
@@ -7,12 +7,14 @@
  *  Chile
  *
  * This code is a ROOT macro that reads a .csv file from Keysight oscilloscope,  
- * then generates a TXT file and a PNG plot per each event found in the .csv file.
+ * then generates a binary event store (or, optionally, a TXT file per event) and
+ * a PNG plot per each event found in the .csv file.
  * And finally provide a histogram of the baseline voltage to find deviation from zero. 
  * 
  * In order to use this code, is necessary to put the .csv file inside a folder with 
  * the same name of the file, and then, inside this folder, create two folders;
- * one folder called "images", and other called "txt".
+ * one folder called "images", and other called "txt" (the "txt" folder is only
+ * used when writeLegacyTxt is enabled).
  */
 
 #include <iostream>
@@ -25,10 +27,21 @@
 #include <TImage.h>
 #include "TGraph.h"
 #include "TMultiGraph.h"
+#include "TH2D.h"
 #include "TCanvas.h"
 #include "TLegend.h"
 #include "TMarker.h"
 #include "ROOT/TThreadExecutor.hxx"
+#include "keysightCSV.h"
+#include "eventStore.h"
+#include "eventAccess.h"
+#include "csvIndex.h"
+#include "chargeAnalysis.h"
+#include "baselineEstimation.h"
+#include "streamingHistogram.h"
+#include "eventPlots.h"
+#include "instrumentation.h"
+#include "signalWindow.h"
 
 using namespace std;
 
@@ -53,89 +66,101 @@ bool error = false;
 size_t numColumns = 0;
 size_t selectedPair = 1;
 size_t possibleXColumns = 0;
+bool parallelRead = true;       // Parse the CSV in newline-aligned chunks on the ROOT thread pool
+size_t chunksPerThread = 4;     // Chunks per pool thread when parallelRead is enabled
+WaveformSampleType waveformSampleType = kWaveformFloat64;  // Samples in memory: kWaveformFloat64 (exact), opt-in kWaveformFloat32 (half the memory, rounded) or kWaveformInt16 (ADC codes, 4x less)
+bool writeEventStoreFile = true;    // Write all events to a single binary event store (<name>.evs)
+bool writeLegacyTxt = false;        // Also write txt/Time_Window.txt and one txt/EventN.txt per event
+bool writeEventTreeFile = false;    // Also write every waveform to a TTree in <name>_events.root
+EventTreeOptions treeOptions;       // Compression (kLZ4/kZSTD), level, basket size and auto-flush of the event tree
+bool plotOverlappedTraces = true;     // Plots of all events overlapped, one line per event
+bool plotPersistenceDensity = true;   // Time x voltage density of all events (persistence display), filled in parallel
+size_t persistenceTimeBins = 0;       // Time bins of the density plot (0 = one per pixel column, at most one per point)
+size_t persistenceVoltageBins = 400;  // Voltage bins of the density plot, between the global min and max voltage
+bool decimateOverlappedPlots = true;  // Overlapped plots drawn with first/min/max/last of every pixel column (same image, fewer points)
+bool plotEventImages = false;       // Per-event PNGs in images/, rendered in parallel (see eventPlots.h)
+EventPlotOptions eventPlotOptions;  // Events plotted (kPlotAllEvents, kPlotSampledEvents every sampleEvery, kPlotOutlierEvents), queue depth, size
+bool streamingMode = false;         // Read the CSV in bounded batches of rows instead of loading it whole (no overlapped plots)
+size_t streamBatchRows = 1024;      // Rows per batch in streaming mode
+bool analyzeMode = false;           // Fused charge analysis while parsing: Charge Histogram and Min/MaxVoltages without chargeHisto
+double analyzeMinTimeValue = 3000;  // First time point of the charge integration window in analyze mode
+double analyzeMaxTimeValue = 4000;  // Last time point of the charge integration window in analyze mode
+bool analyzeRunningBaseline = false; // Running baseline across events in analyze mode, as chargeHisto 1.2
+BaselineOptions analyzeBaselineOptions = {kBaselineMedian, 0.1, 5}; // Baseline estimator and RMS cut of analyze mode, as baselineOptions of chargeHisto (streaming mode keeps the mean of the baseline points)
+bool analyzeAutoWindow = true;      // Window of analyze mode from the mean waveform of a strided sample of events (not in streaming mode, see signalWindow.h)
+bool writeCSVIndexFile = true;      // Save the row index of the CSV next to it (<name>.csv.idx), so ranges of points can be read without a full parse (see csvIndex.h)
+size_t csvIndexStride = 256;        // Rows between the row offsets kept in the index
+bool writeTimingReport = true;      // Wall/CPU time, bytes and events/s of every phase in <name>_timing.json (see instrumentation.h)
+bool writeTimingTrace = false;      // Same phases in Chrome trace-event format, <name>_trace.json (chrome://tracing, ui.perfetto.dev)
 string filename = filefolder + "/" + filefolder.substr(filefolder.find_last_of("/") + 1).c_str() + ".csv";  // Path to CSV file
+string treeFilename = filefolder + "/" + filefolder.substr(filefolder.find_last_of("/") + 1).c_str() + "_events.root";  // Path to event tree
+string storeFilename = filefolder + "/" + filefolder.substr(filefolder.find_last_of("/") + 1).c_str() + ".evs";  // Path to event store
+string timingFilename = filefolder + "/" + filefolder.substr(filefolder.find_last_of("/") + 1).c_str() + "_timing.json";  // Path to timing report
+string traceFilename = filefolder + "/" + filefolder.substr(filefolder.find_last_of("/") + 1).c_str() + "_trace.json";  // Path to timing trace
 
 // Function to read CSV file and extract all columns --------------------------------------------------------------------------------------
-size_t readCSV(string filename, vector<vector<double>>& data) {
+size_t readCSV(string filename, Waveforms& waveforms) {
 
-    ifstream file(filename);
-    if (!file.is_open()) {
+    // Map the whole file in memory
+    MappedFile file(filename);
+    if (!file.isOpen()) {
         cerr << "Error: Could not open file " << filename << endl;
         error = true;
         return 1;
     }
 
-    string line;
-
-    // Skip the first 25 lines
-    for (size_t i = 0; i < 25; ++i)
-        getline(file, line);
-
-    // Read the first line to determine the number of columns
-    getline(file, line);
-    istringstream header(line);
-    double value;
-    size_t lineCount = 1;
-
-    // Travel first row
-    while (header >> value) {
-        // Create new inner vector
-        data.push_back(vector<double>());
-        // Store value in the last inner vector 
-        data.back().push_back(value);
-        numColumns++;
-        if (header.peek() == ','){
-            header.ignore();
-        }
-    }
-
-    // Read the rest of the file
+    // Read the rest of the file (skipping the first 25 lines)
     cout << "Reading CSV file in " << filename << endl;
-
-    while (getline(file, line)) {
-        istringstream iss(line);
-        size_t colIndex = 1; // Start column indexing from 1
-
-        while (iss >> value) {
-            data[colIndex - 1].push_back(value); // Adjust column index
-
-            // Update global min/max values for X and Y axes
-            if (colIndex % 2 == 1) {  // X-axis columns
-                globalMinX = min(globalMinX, value);
-                globalMaxX = max(globalMaxX, value);
-            } else {  // Y-axis columns
-                globalMinY = min(globalMinY, value);
-                globalMaxY = max(globalMaxY, value);
+    CSVRange range;
+    size_t lineCount = 0;
+    ROOT::TThreadExecutor* pool = parallelRead ? new ROOT::TThreadExecutor() : nullptr;
+    size_t numberOfChunks = parallelRead ? pool->GetPoolSize() * chunksPerThread : 1;
+    WaveformSampleType sampleType = waveformSampleType;
+
+    // ADC codes: find the quantization step of the scope and keep the samples as int16 codes
+    if (sampleType == kWaveformInt16) {
+        ADCQuantization quantization = detectKeysightQuantization(file);
+        if (!quantization.found) {
+            cout << "Warning: No ADC step found in the voltages, keeping float32 samples." << endl;
+            sampleType = kWaveformFloat32;
+        } else {
+            cout << "ADC step: " << quantization.step << " V (" << quantization.levels << " levels found)." << endl;
+            size_t inexactSamples = 0;
+            lineCount = parseKeysightWaveforms(file, waveforms, range, sampleType, pool, numberOfChunks,
+                                               quantization.step, quantization.offset, &inexactSamples);
+            if (inexactSamples > 0) {
+                cout << "Warning: " << inexactSamples << " samples off the ADC step, keeping float32 samples." << endl;
+                sampleType = kWaveformFloat32;
+                range = CSVRange();
             }
-
-            // Move to the next column
-            if (iss.peek() == ',')
-                iss.ignore();
-
-            colIndex++;
         }
+    }
+    if (sampleType != kWaveformInt16) {
+        lineCount = parseKeysightWaveforms(file, waveforms, range, sampleType, pool, numberOfChunks);
+    }
+    delete pool;
+    numColumns = 2 * waveforms.events();
 
-        lineCount++;
+    // Update global min/max values for X and Y axes
+    globalMinX = min(globalMinX, range.minX);
+    globalMaxX = max(globalMaxX, range.maxX);
+    globalMinY = min(globalMinY, range.minY);
+    globalMaxY = max(globalMaxY, range.maxY);
 
-        // Display progress every 1000 lines
-        if (lineCount % 100 == 0) {
-            cout << "\rReading: " << lineCount << " lines";
-            cout.flush();
-        }
-    }
     cout << "\rReading: " << " ... Done.                  " << endl;
     cout << "\rRead " << lineCount << " lines and " << numColumns << " columns." << endl;
+    cout << "Samples in memory: " << waveforms.bytes() / (1024.0 * 1024.0) << " MB (" << waveformSampleName(waveforms.sampleType()) << ")." << endl;
     cout << " " << endl;
 
     return lineCount;
 }
 
 // Function to plot a single graph --------------------------------------------------------------------------------------------------------
-void plotSelectedXAndAutoY(const vector<vector<double>>& data, const vector<vector<double>>& dataMultiplied, size_t resolution) {
+void plotSelectedXAndAutoY(const Waveforms& waveforms, const vector<double>& timeMicro, size_t resolution) {
 
-    // Calculate the corresponding X and Y axis columns
-    size_t selectedXAxis = (selectedPair - 1) * 2;
-    size_t selectedYAxis = selectedXAxis + 1;
+    // Voltages of the selected event
+    vector<double> samples(resolution);
+    waveforms.copyEvent(selectedPair - 1, samples.data());
 
     // Create a TCanvas
     TCanvas *canvas = new TCanvas("canvas", "CSV Data Plot", 1920, 1080);
@@ -144,7 +169,7 @@ void plotSelectedXAndAutoY(const vector<vector<double>>& data, const vector<vect
     canvas->SetGrid();
 
     // Create a TGraph for the selected pair of columns
-    TGraph *graph = new TGraph(resolution, &dataMultiplied[0][0], &data[selectedYAxis][0]);
+    TGraph *graph = new TGraph(resolution, &timeMicro[0], &samples[0]);
 
     // Set the range for X and Y axes
     graph->GetXaxis()->SetRangeUser(firstValue, lastValue);
@@ -173,7 +198,7 @@ void plotSelectedXAndAutoY(const vector<vector<double>>& data, const vector<vect
 }
 
 // Function to plot all graphs overlapped with seconds in the X axis ---------------------------------------------------------------------
-void plotAllGraphsOverlapped(const vector<vector<double>>& data, const vector<vector<double>>& dataMultiplied, size_t resolution) {
+void plotAllGraphsOverlapped(const Waveforms& waveforms, const vector<double>& timeMicro, size_t resolution) {
 
     // Create a TCanvas
     TCanvas *canvas1 = new TCanvas("canvas1", "Graphs", 1920, 1080);
@@ -183,6 +208,11 @@ void plotAllGraphsOverlapped(const vector<vector<double>>& data, const vector<ve
 
     // Create a TMultiGraph to hold all the individual TGraphs
     auto *mg = new TMultiGraph();
+    vector<double> samples(resolution);
+    vector<double> plotX;
+    vector<double> plotY;
+    size_t columns = plotColumnsFor(*canvas1);
+    size_t plottedPoints = 0;
 
     for (selectedPair = 1; selectedPair <= possibleXColumns; ++selectedPair) {
         
@@ -192,12 +222,18 @@ void plotAllGraphsOverlapped(const vector<vector<double>>& data, const vector<ve
             cout.flush();
         }
         
-        // Calculate the corresponding X and Y axis columns
-        size_t selectedXAxis = (selectedPair - 1) * 2;
-        size_t selectedYAxis = selectedXAxis + 1;
-
-        // Create a TGraph for the selected pair of columns
-        TGraph *graph = new TGraph(resolution, &dataMultiplied[0][0], &data[selectedYAxis][0]);
+        // Voltages of the event
+        waveforms.copyEvent(selectedPair - 1, samples.data());
+
+        // Create a TGraph for the event, only with first/min/max/last of every pixel column when decimating
+        TGraph *graph;
+        if (decimateOverlappedPlots) {
+            decimateM4(&timeMicro[0], &samples[0], resolution, columns, plotX, plotY);
+            graph = new TGraph(plotX.size(), &plotX[0], &plotY[0]);
+        } else {
+            graph = new TGraph(resolution, &timeMicro[0], &samples[0]);
+        }
+        plottedPoints = plottedPoints + graph->GetN();
 
         // Set the range for X and Y axes
         graph->GetXaxis()->SetRangeUser(firstValue, lastValue);
@@ -219,6 +255,7 @@ void plotAllGraphsOverlapped(const vector<vector<double>>& data, const vector<ve
 
     // Save the canvas as a PNG file
     cout << " " << endl;
+    cout << "Points drawn: " << plottedPoints << " of " << resolution * possibleXColumns << endl;
     string pngFilename = filefolder + "/images/All_Events_In_Seconds_" + filefolder.substr(filefolder.find_last_of("/") + 1).c_str() + ".png";
     canvas1->SaveAs(pngFilename.c_str());
 
@@ -228,7 +265,7 @@ void plotAllGraphsOverlapped(const vector<vector<double>>& data, const vector<ve
 }
 
 // Function to plot all graphs overlapped with points in the X axis -----------------------------------------------------------------------
-void plotAllGraphsOverlapped2(const vector<vector<double>>& data, const vector<double>& timeResolutionVect, size_t resolution) {
+void plotAllGraphsOverlapped2(const Waveforms& waveforms, const vector<double>& timeResolutionVect, size_t resolution) {
 
     //Mode for ROOT graphics
     //gROOT->SetBatch(kFALSE);  // Set to kTRUE to run in batch mode (no GUI)
@@ -241,6 +278,11 @@ void plotAllGraphsOverlapped2(const vector<vector<double>>& data, const vector<d
 
     // Create a TMultiGraph to hold all the individual TGraphs
     auto *mg = new TMultiGraph();
+    vector<double> samples(resolution);
+    vector<double> plotX;
+    vector<double> plotY;
+    size_t columns = plotColumnsFor(*canvas2);
+    size_t plottedPoints = 0;
 
     for (selectedPair = 1; selectedPair <= possibleXColumns; ++selectedPair) {
         
@@ -250,12 +292,18 @@ void plotAllGraphsOverlapped2(const vector<vector<double>>& data, const vector<d
             cout.flush();
         }
         
-        // Calculate the corresponding X and Y axis columns
-        size_t selectedXAxis = (selectedPair - 1) * 2;
-        size_t selectedYAxis = selectedXAxis + 1;
-
-        // Create a TGraph for the selected pair of columns
-        TGraph *graph = new TGraph(resolution, &timeResolutionVect[0], &data[selectedYAxis][0]);
+        // Voltages of the event
+        waveforms.copyEvent(selectedPair - 1, samples.data());
+
+        // Create a TGraph for the event, only with first/min/max/last of every pixel column when decimating
+        TGraph *graph;
+        if (decimateOverlappedPlots) {
+            decimateM4(&timeResolutionVect[0], &samples[0], resolution, columns, plotX, plotY);
+            graph = new TGraph(plotX.size(), &plotX[0], &plotY[0]);
+        } else {
+            graph = new TGraph(resolution, &timeResolutionVect[0], &samples[0]);
+        }
+        plottedPoints = plottedPoints + graph->GetN();
 
         // Set the range for X and Y axes
         graph->GetXaxis()->SetRangeUser(firstValue, lastValue);
@@ -277,6 +325,7 @@ void plotAllGraphsOverlapped2(const vector<vector<double>>& data, const vector<d
 
     // Save the canvas as a PNG file
     cout << " " << endl;
+    cout << "Points drawn: " << plottedPoints << " of " << resolution * possibleXColumns << endl;
     string pngFilename = filefolder + "/images/All_Events_In_Points_" + filefolder.substr(filefolder.find_last_of("/") + 1).c_str() + ".png";
     canvas2->SaveAs(pngFilename.c_str());
 
@@ -285,113 +334,394 @@ void plotAllGraphsOverlapped2(const vector<vector<double>>& data, const vector<d
     delete canvas2;
 }
 
+// Function to plot the density of all events in time and voltage ------------------------------------------------------------------------
+void plotPersistence(const Waveforms& waveforms, size_t resolution) {
+
+    // Create a TCanvas
+    TCanvas *canvas4 = new TCanvas("canvas4", "Persistence", 1920, 1080);
+
+    // Set Grid
+    canvas4->SetGrid();
+    canvas4->SetRightMargin(0.12);
+    canvas4->SetLogz();
+
+    // Count samples of all events per bin, on every thread
+    size_t timeBins = persistenceTimeBins > 0 ? persistenceTimeBins : plotColumnsFor(*canvas4);
+    timeBins = min(timeBins, resolution);
+    ROOT::TThreadExecutor pool;
+    vector<uint32_t> counts = fillPersistence(waveforms, timeBins, persistenceVoltageBins, globalMinY, globalMaxY, pool);
+
+    // Time axis in microseconds, one bin edge every resolution/timeBins points
+    double startTime = waveforms.time(0) * timeDataMultiplier;
+    double endTime = waveforms.time(resolution) * timeDataMultiplier;
+    TH2D *h2 = new TH2D("Persistence", ("All Events Density - " + filefolder.substr(filefolder.find_last_of("/") + 1)).c_str(),
+                        timeBins, startTime, endTime, persistenceVoltageBins, globalMinY, globalMaxY);
+    h2->SetDirectory(nullptr);
+    for (size_t voltageBin = 0; voltageBin < persistenceVoltageBins; ++voltageBin) {
+        for (size_t timeBin = 0; timeBin < timeBins; ++timeBin) {
+            h2->SetBinContent(timeBin + 1, voltageBin + 1, counts[voltageBin * timeBins + timeBin]);
+        }
+    }
+    h2->SetEntries(static_cast<double>(resolution) * waveforms.events());
+    h2->SetStats(kFALSE);
+
+    // Draw the histogram on the canvas
+    h2->Draw("COLZ");
+
+    // Set axis labels
+    h2->GetXaxis()->SetTitle(("Microseconds"));
+    h2->GetYaxis()->SetTitle(("Volts"));
+
+    // Save the canvas as a PNG file
+    string pngFilename = filefolder + "/images/All_Events_Density_" + filefolder.substr(filefolder.find_last_of("/") + 1).c_str() + ".png";
+    canvas4->SaveAs(pngFilename.c_str());
+
+    // Clean up
+    delete h2;
+    delete canvas4;
+}
+
+// Function to draw and save the Voltage Histogram ----------------------------------------------------------------------------------------
+void saveVoltageHistogram(TH1D* h1){
+
+    // Create a TCanvas
+    TCanvas *canvas3 = new TCanvas("canvas3", "Voltage Histogram", 1920, 1080);
+
+    // Set Grid
+    canvas3->SetGrid();
+
+    // Draw the histogram on the canvas
+    h1->Draw();
+
+    // Set axis label
+    h1->GetXaxis()->SetTitle(("Volts"));
+
+    // Save the canvas as a PNG file
+    string pngFilename;
+    pngFilename = filefolder + "/images/Baseline_Voltage_Histogram_" + filefolder.substr(filefolder.find_last_of("/") + 1).c_str() + ".png";
+    canvas3->SaveAs(pngFilename.c_str());
+
+    // Clean up
+    //delete h1;
+    //delete canvas3;
+}
+
 // Function to plot Voltage Histogram -----------------------------------------------------------------------------------------------------
-int voltageHistogram(size_t resolution){
+// Only the baseline points of every event are read from events (see eventAccess.h). quantum is the step of the
+// samples when they are quantized (ADC step), 0 if not known
+int voltageHistogram(const EventReader& events, double quantum){
 
     //Mode for ROOT graphics
     gROOT->SetBatch(kFALSE);  // Set to kTRUE to run in batch mode (no GUI)
 
     int baselinePortion = 0;
-    int baselineCount = 0;
-    double baseline = 0;
-    double timeValue = 0;
-    double voltageValue = 0;
-    double minTimeValue = 1;
-    double maxTimeValue = 0;
-    double minVoltage = numeric_limits<double>::max();
-    double maxVoltage = numeric_limits<double>::lowest();
-    size_t lineCount = 0;
-    size_t eventNumber = 1;
-
-    vector<double> voltages;
+    size_t minTimeValue = 1;
+    size_t maxTimeValue = 0;
+    size_t resolution = events.resolution();
 
     // Calculate portion of baseline to plot
     baselinePortion = static_cast<int>(round((resolution*10)/100)); // Portion of 10%
     cout << "Baseline portion: " << baselinePortion << endl;
-    maxTimeValue = baselinePortion;
+    maxTimeValue = min(static_cast<size_t>(baselinePortion), resolution - 1);
 
-    // Open file stream for every Event file and read data 
-    cout << " " << endl;
-    cout << "Reading events in " << filefolder << " ..." << endl;
-    for(eventNumber = 1; eventNumber <= possibleXColumns; ++eventNumber){
-        string eventFilename = (filefolder + "/txt/Event" + to_string(eventNumber) + ".txt");
-        ifstream eventFile(eventFilename);
-        if (!eventFile.is_open()) {
-            cerr << "Error: Could not open file " << eventFilename << endl;
-            error = true;
-            return 4;
-        } else {
-            //cout << "Reading txt file: " << eventFilename << " ...";
-        }
+    // Baseline points are never kept: a first pass sketches them to choose the binning, a second one counts
+    // them in the bins (see streamingHistogram.h)
+    QuantileSketch sketch;
+    BinnedCounts counts;
 
-        // Read Voltage Data
-        while (eventFile >> voltageValue) {
-            if(lineCount >= minTimeValue && lineCount <= maxTimeValue){
-                voltages.push_back(voltageValue);
-                minVoltage = min(minVoltage, voltageValue);
-                maxVoltage = max(maxVoltage, voltageValue);
-            }
-            lineCount++;
-            //cout << voltageValue << endl;
+    cout << " " << endl;
+    cout << "Reading baseline points of the events in " << filefolder << " ..." << endl;
+
+    // Events in chunks on the pool, read in blocks of eventsPerRead, per-chunk partials merged in chunk order
+    ROOT::TThreadExecutor pool;
+    const size_t eventsPerRead = 64;
+    size_t numberOfEvents = events.eventCount();
+    size_t points = maxTimeValue >= minTimeValue ? maxTimeValue - minTimeValue + 1 : 0;
+    size_t chunks = max<size_t>(1, min<size_t>(numberOfEvents, pool.GetPoolSize() * chunksPerThread));
+    auto addChunk = [&](unsigned chunk, auto& partial) {
+        vector<double> samples(eventsPerRead * points);
+        size_t last = numberOfEvents * (chunk + 1) / chunks;
+        for (size_t first = numberOfEvents * chunk / chunks; first < last; first += eventsPerRead) {
+            size_t block = min(eventsPerRead, last - first);
+            if (!events.read(first, block, minTimeValue, points, samples.data()))
+                return false;
+            for (size_t i = 0; i < block * points; ++i)
+                partial.add(samples[i]);
         }
-
-        // Error check
-        if(lineCount != resolution){
-            cerr << "Error: Line count not match in " << eventFilename << endl;
-            cerr << "Line count: " << lineCount << endl;
+        return true;
+    };
+    vector<pair<bool, QuantileSketch>> sketches = pool.Map([&](unsigned chunk) {
+        QuantileSketch partial;
+        bool ok = addChunk(chunk, partial);
+        return make_pair(ok, partial);
+    }, ROOT::TSeqU(chunks));
+    for (const auto& partial : sketches) {
+        if (!partial.first) {
+            cerr << "Error: Could not read the baseline points of the events in " << filefolder << endl;
             error = true;
-            return 5;
-        } else {
-            //cout << "Event " << eventNumber <<  " reading OK" << endl;
-        }
-        lineCount = 0;
-
-        //Print progress
-        if (eventNumber % 1 == 0) {
-            cout << "\rEvents Processed: " << eventNumber;
-            cout.flush();
+            return 4;
         }
+        sketch.merge(partial.second);
     }
+
+    HistogramBinning binning = freedmanDiaconisBinning(sketch, quantum);
+    vector<BinnedCounts> partialCounts = pool.Map([&](unsigned chunk) {
+        BinnedCounts partial(binning);
+        addChunk(chunk, partial);
+        return partial;
+    }, ROOT::TSeqU(chunks));
+    counts = BinnedCounts(binning);
+    for (const BinnedCounts& partial : partialCounts)
+        counts.merge(partial);
+    cout << "Events Processed: " << numberOfEvents;
     if(!error){
         cout << " " << endl;
         cout << "Events reading OK" << endl;
         cout << " " << endl;
     }
 
-     // Calculate bin number
-    size_t vectorSize = voltages.size();
-    int binNumber = 7*sqrt(vectorSize);
-    cout << "Bin number: " << binNumber << endl;
+    // Freedman-Diaconis bins over the exact range of the baseline points
+    cout << "Bin number: " << binning.bins << endl;
     cout << " " << endl;
 
-    // Create a TCanvas
-    TCanvas *canvas3 = new TCanvas("canvas3", "Voltage Histogram", 1920, 1080);
-
-    // Set Grid
-    canvas3->SetGrid();
-    
     // Create Histogram 
-    auto h1 = new TH1D("Voltage", ("Baseline Voltage - " + filefolder.substr(filefolder.find_last_of("/") + 1)).c_str(), binNumber, minVoltage, maxVoltage);
+    auto h1 = new TH1D("Voltage", ("Baseline Voltage - " + filefolder.substr(filefolder.find_last_of("/") + 1)).c_str(), binning.bins, binning.low, binning.high);
     
-    // Fill the histogram with voltage data
-    for (double value : voltages) {
-        h1->Fill(value);
+    // Fill the histogram with the counts of the baseline points
+    counts.fill(*h1);
+
+    saveVoltageHistogram(h1);
+    return 0;
+}
+
+// Function to check the integration window of analyze mode -------------------------------------------------------------------------------
+int checkAnalyzeWindow(size_t resolution, ChargeWindow& window) {
+    window.baselinePortion = baselinePortionFor(resolution);
+    window.minTimeValue = analyzeMinTimeValue;
+    window.maxTimeValue = analyzeMaxTimeValue;
+    if (analyzeMaxTimeValue > resolution) {
+        cerr << " - ERROR - analyzeMaxTimeValue > resolution" << endl;
+        error = true;
+        return 2;
+    } else if (analyzeMinTimeValue <= 0) {
+        cerr << " - ERROR - Invalid analyzeMinTimeValue" << endl;
+        error = true;
+        return 3;
     }
+    return 0;
+}
 
-    // Draw the histogram on the canvas
-    h1->Draw();
+// Function to turn the event sums of analyze mode into the charge outputs -----------------------------------------------------------------
+int writeAnalyzeOutputs(vector<EventSums>& eventSums, const ChargeWindow& window, double deltaT, double windowStartTime, double windowEndTime) {
 
-    // Set axis label
-    h1->GetXaxis()->SetTitle(("Volts"));
+    cout << " " << endl;
+    cout << "Making charge histogram from " << eventSums.size() << " events (analyze mode)... " << endl;
+    cout << "- Delta T: " << deltaT << endl;
+    cout << "- Baseline portion: " << window.baselinePortion << " points" << endl;
+
+    // Events with an anomalous baseline RMS, from the estimates of the parsed waveforms (none in streaming mode)
+    bool estimated = !eventSums.empty() && eventSums[0].baselineEstimated;
+    if (estimated) {
+        cout << "- Baseline estimator: " << baselineMethodName(analyzeBaselineOptions.method) << endl;
+        cout << "- Events excluded for their baseline RMS: " << flagBaselineOutliers(eventSums, analyzeBaselineOptions.rmsCut) << endl;
+    } else {
+        cout << "- Baseline: mean of the baseline points" << endl;
+    }
 
-    // Save the canvas as a PNG file
-    string pngFilename;
-    pngFilename = filefolder + "/images/Baseline_Voltage_Histogram_" + filefolder.substr(filefolder.find_last_of("/") + 1).c_str() + ".png";
-    canvas3->SaveAs(pngFilename.c_str());
+    // Calculate constant factor with 50 ohm
+    ChargeAccumulator charges(deltaT/50.0, analyzeRunningBaseline);
+    for (const EventSums& sums : eventSums) {
+        charges.add(sums);
+    }
+
+    int status = writeChargeOutputs(filefolder, charges.get(), window, windowStartTime, windowEndTime);
+    if (status == 0 && estimated && !writeBaselineFile(filefolder + "/txt/Baselines.txt", eventSums, analyzeBaselineOptions)) {
+        cerr << " - ERROR - Could not open file for writing Baselines data" << endl;
+        status = 13;
+    }
+    if (status != 0) {
+        error = true;
+    }
+    return status;
+}
+
+// Function to read the CSV in bounded batches of rows (streaming mode) -------------------------------------------------------------------
+int streamCSV(size_t& resolution) {
+
+    // The number of rows comes from the "Points" line of the header, so the event store layout and the
+    // baseline portion are known before any batch and the CSV is read once. Without it the rows are counted.
+    cout << "Streaming CSV file in " << filename << endl;
+    CSVBatchReader reader;
+    if (!reader.open(filename)) {
+        cerr << "Error: Could not open file " << filename << endl;
+        error = true;
+        return 1;
+    }
+    resolution = reader.headerPoints();
+    if (resolution == 0) {
+        cout << "Note: the header gives no number of points, counting the rows first." << endl;
+        resolution = countCSVRows(filename);
+    }
+    if (resolution < 2 || reader.columns() == 0) {
+        cerr << "Error: No data read from CSV file." << endl;
+        error = true;
+        return 6;
+    }
+    int baselinePortion = static_cast<int>(round((resolution*10)/100)); // Portion of 10%
+    cout << "Baseline portion: " << baselinePortion << endl;
+    numColumns = reader.columns();
+    possibleXColumns = numColumns / 2;
+
+    vector<double> batch;
+    size_t row = 0;
+    size_t rows = 0;
+
+    // Baseline points kept during the pass for the histogram when there is no event store to read them from
+    QuantileSketch sketch;
+    vector<double> baselineValues;
+
+    // Event store written row batch by row batch
+    EventStoreWriter storeWriter;
+    if (writeEventStoreFile && !storeWriter.open(storeFilename, resolution, possibleXColumns)) {
+        cerr << "Error: Could not create event store " << storeFilename << endl;
+        error = true;
+        return 9;
+    }
+    if (writeEventTreeFile) {
+        cout << "Note: the event tree needs whole events and is not written in streaming mode." << endl;
+    }
+
+    // Per-event sums of analyze mode, accumulated point by point
+    ChargeWindow window;
+    vector<EventSums> eventSums;
+    double windowStartTime = 0;
+    double windowEndTime = 0;
+    if (analyzeMode) {
+        int status = checkAnalyzeWindow(resolution, window);
+        if (status != 0) {
+            return status;
+        }
+        eventSums.resize(possibleXColumns);
+    }
+
+    // Single pass: writers, statistics, baseline points and charge sums fed one batch at a time
+    CSVRange range;
+    double firstTime = 0;
+    double lastTime = 0;
+    double secondLastTime = 0;
+    while (row < resolution && (rows = reader.readBatch(batch, streamBatchRows)) > 0) {
+        rows = min(rows, resolution - row);
+        if (writeEventStoreFile && !storeWriter.writeRows(row, rows, batch.data(), numColumns)) {
+            cerr << "Error: Could not write event store " << storeFilename << endl;
+            error = true;
+            return 9;
+        }
+        if (writeLegacyTxt && !appendEventTxtRows(filefolder, batch.data(), rows, numColumns, row == 0)) {
+            cerr << "Error: Could not create or write txt files in " << filefolder << "/txt" << endl;
+            error = true;
+            return 8;
+        }
+
+        for (size_t r = 0; r < rows; ++r, ++row) {
+            const double* values = &batch[r * numColumns];
+
+            // Global min/max (the first row is left out, as in readCSV)
+            if (row > 0) {
+                for (size_t colIndex = 0; colIndex < numColumns; ++colIndex) {
+                    range.update(colIndex, values[colIndex]);
+                }
+            }
+
+            // Baseline points of every event
+            if (!writeEventStoreFile && row >= 1 && row <= static_cast<size_t>(baselinePortion)) {
+                for (size_t colIndex = 1; colIndex < numColumns; colIndex += 2) {
+                    sketch.add(values[colIndex]);
+                    baselineValues.push_back(values[colIndex]);
+                }
+            }
+
+            // Charge sums of every event
+            if (analyzeMode) {
+                for (size_t event = 0; event < possibleXColumns; ++event) {
+                    accumulateSample(eventSums[event], row, values[2 * event + 1], window);
+                }
+                if (row + 1 == window.minTimeValue) {
+                    windowStartTime = values[0];
+                }
+                if (row + 1 == window.maxTimeValue) {
+                    windowEndTime = values[0];
+                }
+            }
+
+            // Time axis
+            if (row == 0) {
+                firstTime = values[0];
+            }
+            secondLastTime = lastTime;
+            lastTime = values[0];
+        }
+
+        //Print progress
+        cout << "\rStreaming: " << row << " lines";
+        cout.flush();
+    }
+    cout << "\rStreaming: " << " ... Done.                  " << endl;
+    cout << "\rRead " << row << " lines and " << numColumns << " columns in batches of " << streamBatchRows << " lines." << endl;
+    cout << " " << endl;
+    if (row != resolution) {
+        cerr << "Error: The header gives " << resolution << " points but " << row << " rows were read." << endl;
+        error = true;
+        return 6;
+    }
+
+    if (writeEventStoreFile && !storeWriter.finish(firstTime, lastTime - secondLastTime)) {
+        cerr << "Error: Could not write event store " << storeFilename << endl;
+        error = true;
+        return 9;
+    }
+
+    // Update global min/max values and time window
+    globalMinX = min(globalMinX, range.minX);
+    globalMaxX = max(globalMaxX, range.maxX);
+    globalMinY = min(globalMinY, range.minY);
+    globalMaxY = max(globalMaxY, range.maxY);
+    firstValue = firstTime * timeDataMultiplier;
+    lastValue = lastTime * timeDataMultiplier;
+    timeWindow = lastValue - firstValue;
+
+    // Print voltage histogram of baseline: only the baseline points of the event store just written are read,
+    // or the ones kept during the pass, Freedman-Diaconis bins over the exact range
+    cout << "Making baseline voltage histogram... " << endl;
+    if (writeEventStoreFile) {
+        EventReader events;
+        if (!events.openStore(storeFilename)) {
+            cerr << "Error: Could not open event store " << storeFilename << endl;
+            error = true;
+            return 9;
+        }
+        int status = voltageHistogram(events, 0);
+        if (status != 0) {
+            return status;
+        }
+    } else {
+        HistogramBinning binning = freedmanDiaconisBinning(sketch);
+        cout << "Bin number: " << binning.bins << endl;
+        auto h1 = new TH1D("Voltage", ("Baseline Voltage - " + filefolder.substr(filefolder.find_last_of("/") + 1)).c_str(), binning.bins, binning.low, binning.high);
+        for (const double value : baselineValues) {
+            h1->Fill(value);
+        }
+        saveVoltageHistogram(h1);
+    }
+    cout << "Note: overlapped plots need every event in memory and are skipped in streaming mode." << endl;
+
+    // Charge outputs of analyze mode
+    if (analyzeMode) {
+        int status = writeAnalyzeOutputs(eventSums, window, lastTime - secondLastTime, windowStartTime, windowEndTime);
+        if (status != 0) {
+            return status;
+        }
+    }
 
-    // Clean up
-    //delete h1;
-    //delete canvas3;
     return 0;
 }
 
@@ -400,6 +730,7 @@ int csvRead() {
 
     // Record the start time
     auto start = high_resolution_clock::now();
+    RunProfile profile("csvRead", filefolder.substr(filefolder.find_last_of("/") + 1));
 
     // Enable ROOT's implicit multithreading
     ROOT::EnableImplicitMT();
@@ -412,108 +743,240 @@ int csvRead() {
     cout << "   ***   Welcome to the Keysight CSV Reader by Charly!   ***   " << endl;
     cout << " " << endl;
 
-    // Vectors to store data
-    vector<double> timeResolutionVect;
-    vector<double> timeData;
-    vector<vector<double>> data;
-    vector<vector<double>> dataMultiplied;
-
-    // Read data from CSV (skipping the first 25 lines)
-    size_t resolution = readCSV(filename, data);
-    if (data.empty()) {
-        cerr << "Error: No data read from CSV file." << endl;
-        error = true;
-        return 6;
+    // Row index of the CSV, built again only when the CSV changed
+    if (writeCSVIndexFile) {
+        RunProfile::Phase phase = profile.phase("csv index");
+        string indexFilename = csvIndexPath(filename);
+        MappedFile file(filename);
+        CSVIndex index;
+        bool loaded = false;
+        bool saved = false;
+        bool opened = file.isOpen() && openCSVIndex(filename, file, index, indexFilename, csvIndexStride, &loaded, &saved);
+        if (opened && loaded) {
+            cout << "Row index of the CSV up to date in " << indexFilename << endl;
+        } else if (opened && saved) {
+            phase.addBytesRead(file.size());
+            phase.addFileWritten(indexFilename);
+            cout << "Row index of the CSV saved in " << indexFilename << " (" << index.rows << " rows, offset every " << index.stride << " rows)" << endl;
+        } else {
+            cout << "Warning: Could not write the row index of the CSV " << indexFilename << endl;
+        }
+        cout << " " << endl;
     }
 
-    // Check if data vector is not empty and write time window file
-    cout << "Creating txt file for time window..." << endl;
-    if (!data.empty() && !data[0].empty()) {
-        timeData = data[0];
-        ofstream outputFile(filefolder + "/txt/Time_Window.txt");
-        if (!outputFile.is_open()) {
-            cerr << "Error: Could not create or open output file " << "Time_Window.txt" << endl;
+    size_t resolution = 0;
+    if (streamingMode) {
+        // Bounded batches of rows: the capture is never held in memory as a whole
+        RunProfile::Phase phase = profile.phase("stream");
+        int status = streamCSV(resolution);
+        if (status != 0) {
+            return status;
+        }
+        phase.addBytesRead(fileSizeBytes(filename));
+        phase.addEvents(possibleXColumns);
+        if (writeEventStoreFile) {
+            phase.addFileWritten(storeFilename);
+        }
+    } else {
+        // Vectors to store data
+        vector<double> timeResolutionVect;
+        Waveforms waveforms;
+        vector<double> timeMicro;
+
+        // Read data from CSV (skipping the first 25 lines)
+        {
+            RunProfile::Phase phase = profile.phase("parse");
+            resolution = readCSV(filename, waveforms);
+            phase.addBytesRead(fileSizeBytes(filename));
+            phase.addEvents(waveforms.events());
+        }
+        if (waveforms.empty()) {
+            cerr << "Error: No data read from CSV file." << endl;
             error = true;
-            return 7;
+            return 6;
         }
 
-        // Write the data to the file
-        for (size_t i = 0; i < timeData.size(); ++i) {
-            outputFile << timeData[i] << endl;
+        // Write every event to the binary event store
+        if (writeEventStoreFile) {
+            cout << "Creating event store..." << endl;
+            RunProfile::Phase phase = profile.phase("event store write");
+            phase.addEvents(waveforms.events());
+            if (!writeEventStore(storeFilename, waveforms)) {
+                cerr << "Error: Could not create or write event store " << storeFilename << endl;
+                error = true;
+                return 9;
+            }
+            phase.addFileWritten(storeFilename);
+            cout << "Saved " << numColumns / 2 << " events in " << storeFilename << endl;
+            cout << " " << endl;
         }
 
-        cout << "Saved data for time window in Time_Window.txt" << endl;
-        cout << " " << endl;
-    }
+        // Write every event to a ROOT TTree
+        if (writeEventTreeFile) {
+            cout << "Creating event tree..." << endl;
+            RunProfile::Phase phase = profile.phase("event tree write");
+            phase.addEvents(waveforms.events());
+            if (!writeEventTree(treeFilename, waveforms, treeOptions, "Waveforms - " + filefolder.substr(filefolder.find_last_of("/") + 1))) {
+                cerr << "Error: Could not create or write event tree " << treeFilename << endl;
+                error = true;
+                return 10;
+            }
+            phase.addFileWritten(treeFilename);
+            cout << "Saved " << numColumns / 2 << " events in " << treeFilename << endl;
+            cout << " " << endl;
+        }
 
-    // Write odd-numbered columns to separate event files
-    cout << "Creating txt files per event..." << endl;
-    for (size_t colIndex = 1; colIndex < numColumns; colIndex += 2) {
-        ofstream outputFileEvent(filefolder + "/txt/Event" + to_string(colIndex / 2 + 1) + ".txt");
-        if (!outputFileEvent.is_open()) {
-            cerr << "Error: Could not create or open output file for Event " << colIndex / 2 + 1 << endl;
-            error = true;
-            return 8;
+        // Legacy txt output: Time_Window.txt and odd-numbered columns to separate event files
+        if (writeLegacyTxt) {
+            cout << "Creating txt files for time window and events..." << endl;
+            RunProfile::Phase phase = profile.phase("txt write");
+            phase.addEvents(waveforms.events());
+            if (!writeEventTxtFiles(filefolder, waveforms)) {
+                cerr << "Error: Could not create or write txt files in " << filefolder << "/txt" << endl;
+                error = true;
+                return 8;
+            }
+            phase.addFileWritten(filefolder + "/txt/Time_Window.txt");
+            for (size_t event = 1; event <= waveforms.events(); ++event) {
+                phase.addFileWritten(filefolder + "/txt/Event" + to_string(event) + ".txt");
+            }
+            cout << "Saved time window and " << numColumns / 2 << " events in " << filefolder << "/txt" << endl;
+            cout << " " << endl;
         }
 
-        // Write the data for the current event to the file
-        for (const auto& value : data[colIndex]) {
-            outputFileEvent << value << endl;
+        // Calculate the possible number of X-axis columns
+        possibleXColumns = numColumns / 2;
+
+        // Integration window of analyze mode (and of the outlier selection) from the mean waveform
+        if (analyzeAutoWindow && (analyzeMode || (plotEventImages && eventPlotOptions.selection == kPlotOutlierEvents))) {
+            RunProfile::Phase phase = profile.phase("window detection");
+            DetectedWindow detected = detectSignalWindow(waveforms);
+            phase.addEvents(detected.eventsUsed);
+            if (detected.found) {
+                analyzeMinTimeValue = detected.minTimeValue;
+                analyzeMaxTimeValue = detected.maxTimeValue;
+                cout << "Integration window from the mean waveform of " << detected.eventsUsed << " events: "
+                     << analyzeMinTimeValue << " to " << analyzeMaxTimeValue << " points" << endl;
+            } else {
+                cout << "Warning: No pulse found in the mean waveform, using the window " << analyzeMinTimeValue << " to " << analyzeMaxTimeValue << endl;
+            }
+            cout << " " << endl;
         }
 
-        //Print progress
-        cout << "\rEvents: " << colIndex / 2 + 1;
-        cout.flush();
-    }
-    cout << " " << endl;
+        // Adjust time values by timeDataMultiplier (only the time axis is plotted scaled)
+        {
+            RunProfile::Phase phase = profile.phase("scaling");
+            timeMicro.reserve(resolution);
+            for (size_t point = 0; point < resolution; ++point) {
+                timeMicro.push_back(waveforms.time(point) * timeDataMultiplier);
+            }
+        }
 
-    // Calculate the possible number of X-axis columns
-    possibleXColumns = numColumns / 2;
+        // Calculate Time Window
+        firstValue = timeMicro.front();  // Read the first value of first column
+        lastValue = timeMicro.back();    // Read the last value of first column
+        timeWindow = lastValue - firstValue;
+
+        // Plotting individual graphs, in parallel (outliers are judged in the analyze window)
+        if (plotEventImages) {
+            cout << " " << endl;
+            cout << "Making plots... " << endl;
+            ChargeWindow window;
+            if (eventPlotOptions.selection == kPlotOutlierEvents) {
+                int status = checkAnalyzeWindow(resolution, window);
+                if (status != 0) {
+                    return status;
+                }
+            }
+            ROOT::TThreadExecutor pool;
+            RunProfile::Phase phase = profile.phase("event plots");
+            auto plotStart = high_resolution_clock::now();
+            vector<size_t> plotEvents = selectEventsToPlot(waveforms, eventPlotOptions, window, pool);
+            size_t images = renderEventPlots(waveforms, plotEvents, filefolder, globalMinY, globalMaxY, eventPlotOptions, pool);
+            phase.addEvents(images);
+            cout << "Saved " << images << " event images in " << filefolder << "/images ("
+                 << duration_cast<microseconds>(high_resolution_clock::now() - plotStart).count() / 1000000.0 << " seconds)" << endl;
+        }
 
-    // Adjust time and volt values by timeDataMultiplier
-    for (const auto& row : data) {
-        vector<double> multipliedRow;
-        // Multiply each element by the timeDataMultiplier
-        for (double value : row) {
-            multipliedRow.push_back(value * timeDataMultiplier);
+        if (plotOverlappedTraces) {
+            RunProfile::Phase phase = profile.phase("overlapped plots");
+            phase.addEvents(2 * waveforms.events());
+
+            // Plotting all graphs overlapped with time axis in microseconds
+            cout << " " << endl;
+            cout << "Making plot of all events overlapped... " << endl;
+            selectedPair = 1;
+            plotAllGraphsOverlapped(waveforms, timeMicro, resolution);
+
+            // Plotting all graphs overlapped with time axis in points of time resolution
+            cout << " " << endl;
+            cout << "Making second plot of all events overlapped... " << endl;
+            for (int i = 1; i <= resolution; ++i) {
+                timeResolutionVect.push_back(i);
+            }
+            selectedPair = 1;
+            plotAllGraphsOverlapped2(waveforms, timeResolutionVect, resolution);
+            phase.addFileWritten(filefolder + "/images/All_Events_In_Seconds_" + filefolder.substr(filefolder.find_last_of("/") + 1) + ".png");
+            phase.addFileWritten(filefolder + "/images/All_Events_In_Points_" + filefolder.substr(filefolder.find_last_of("/") + 1) + ".png");
         }
-        // Add the multiplied row to the dataMultiplied vector of vectors
-        dataMultiplied.push_back(multipliedRow);
-    }
 
-    // Calculate Time Window
-    firstValue = dataMultiplied[0].front();  // Read the first value of first column
-    lastValue = dataMultiplied[0].back();    // Read the last value of first column
-    timeWindow = lastValue - firstValue;
+        // Density of all events in time and voltage, the cost does not grow with the number of events to draw
+        if (plotPersistenceDensity) {
+            cout << " " << endl;
+            cout << "Making density plot of all events... " << endl;
+            RunProfile::Phase phase = profile.phase("density plot");
+            phase.addEvents(waveforms.events());
+            plotPersistence(waveforms, resolution);
+            phase.addFileWritten(filefolder + "/images/All_Events_Density_" + filefolder.substr(filefolder.find_last_of("/") + 1) + ".png");
+        }
 
-/*
-    // Plotting individual graphs
-    cout << " " << endl;
-    cout << "Making plots... " << endl;
-    for (selectedPair = 1; selectedPair <= possibleXColumns; ++selectedPair) {
-        // Plot a graph with selected X and automatically selected Y axis
-        plotSelectedXAndAutoY(data, dataMultiplied, resolution);
-    }
-*/
-    // Plotting all graphs overlapped with time axis in microseconds
-    cout << " " << endl;
-    cout << "Making plot of all events overlapped... " << endl;
-    selectedPair = 1;
-    plotAllGraphsOverlapped(data, dataMultiplied, resolution);
-   
-    // Plotting all graphs overlapped with time axis in points of time resolution
-    cout << " " << endl;
-    cout << "Making second plot of all events overlapped... " << endl;
-    for (int i = 1; i <= resolution; ++i) {
-        timeResolutionVect.push_back(i);
-    }
-    selectedPair = 1;
-    plotAllGraphsOverlapped2(data, timeResolutionVect, resolution);
+        // Print voltage histogram of baseline
+        cout << " " << endl;
+        cout << "Making baseline voltage histogram... " << endl;
+        {
+            RunProfile::Phase phase = profile.phase("baseline histogram");
+            phase.addEvents(waveforms.events());
+
+            // Baseline points of the waveforms already in memory
+            EventReader events;
+            events.openWaveforms(waveforms);
+            int status = voltageHistogram(events, waveforms.sampleType() == kWaveformInt16 ? fabs(waveforms.scale()) : 0);
+            if (status != 0) {
+                return status;
+            }
+            phase.addFileWritten(filefolder + "/images/Baseline_Voltage_Histogram_" + filefolder.substr(filefolder.find_last_of("/") + 1) + ".png");
+        }
 
-    // Print voltage histogram of baseline
-    cout << " " << endl;
-    cout << "Making baseline voltage histogram... " << endl;
-    voltageHistogram(resolution);
+        // Charge outputs of analyze mode, from the parsed waveforms
+        if (analyzeMode) {
+            ChargeWindow window;
+            int status = checkAnalyzeWindow(resolution, window);
+            if (status != 0) {
+                return status;
+            }
+            ROOT::TThreadExecutor pool;
+            vector<EventSums> eventSums;
+            {
+                RunProfile::Phase phase = profile.phase("charge integration");
+                phase.addEvents(possibleXColumns);
+                eventSums = sumEventsParallel(pool, possibleXColumns, [&](size_t event) {
+                    EventSums sums = sumEvent(waveforms, event, window);
+                    estimateEventBaseline(sums, waveforms, event, window, analyzeBaselineOptions);
+                    return sums;
+                }, pool.GetPoolSize() * chunksPerThread);
+            }
+            RunProfile::Phase phase = profile.phase("charge histogram and ROOT write");
+            phase.addEvents(possibleXColumns);
+            status = writeAnalyzeOutputs(eventSums, window, waveforms.deltaT(), waveforms.time(window.minTimeValue - 1), waveforms.time(window.maxTimeValue - 1));
+            for (const string& path : chargeOutputFiles(filefolder)) {
+                phase.addFileWritten(path);
+            }
+            phase.addFileWritten(filefolder + "/txt/Baselines.txt");
+            if (status != 0) {
+                return status;
+            }
+        }
+    }
 
     // Print summary
     cout << " " << endl;
@@ -532,6 +995,10 @@ int csvRead() {
     cout << "- Minimun voltage: " << globalMinY << " volts." << endl;
     cout << "- Maximum voltage:  " << globalMaxY << " volts." << endl;
     cout << " " << endl;
+    cout << "- Peak memory (RSS high-water mark): " << peakResidentMemoryKB() / 1024.0 << " MB." << endl;
+    cout << " " << endl;
+    profile.print(cout);
+    cout << " " << endl;
     cout << "-------------------------------------------------------------------------------------------------------" << endl;
 
     // Record the end time
@@ -540,5 +1007,13 @@ int csvRead() {
     auto duration = duration_cast<microseconds>(end - start);
     cout << "Time taken by code: " << duration.count()/1000000.0 << " seconds or " << (duration.count()/1000000.0)/60.0 << " minutes. "<< endl;
 
+    // Timing report of every phase
+    if (writeTimingReport && !profile.writeJSON(timingFilename)) {
+        cerr << "Error: Could not write timing report " << timingFilename << endl;
+    }
+    if (writeTimingTrace && !profile.writeChromeTrace(traceFilename)) {
+        cerr << "Error: Could not write timing trace " << traceFilename << endl;
+    }
+
     return 0;
-}
\ No newline at end of file
+}
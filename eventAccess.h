@@ -0,0 +1,268 @@
+/*
+ *  Event Access
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * On-demand access to the events of a capture, whatever holds them: the
+ * binary event store, the txt files of every event, the capture CSV or a
+ * waveform container in memory. read() materializes only the requested
+ * events and points, so a consumer that needs the baseline portion or one
+ * window never parses or pages in the rest of the capture.
+ *
+ * Skipping to a point needs to know where it starts. The store keeps the
+ * byte offset of every event in its header. In the CSV a point is a row,
+ * shared by all events: the offset of every indexStride-th row comes from
+ * its row index (csvIndex.h), saved next to the capture or found by a
+ * newline scan when the file is opened. In the txt files the offset of
+ * every indexStride-th line of an event is kept the first time the event
+ * is read past it, so later reads seek to the nearest known line.
+ */
+
+#ifndef EVENT_ACCESS_H
+#define EVENT_ACCESS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "keysightCSV.h"
+#include "csvIndex.h"
+#include "eventStore.h"
+#include "waveform.h"
+
+// Sources of the events
+enum EventSourceType {
+    kEventSourceNone = 0,
+    kEventSourceWaveforms = 1,      // Waveform container in memory
+    kEventSourceStore = 2,          // Binary event store (<name>.evs), memory-mapped
+    kEventSourceTxt = 3,            // txt/Time_Window.txt and txt/EventN.txt
+    kEventSourceCSV = 4             // Capture CSV of the scope, memory-mapped
+};
+
+class EventReader {
+public:
+    explicit EventReader(size_t indexStride = 256) : indexStride(std::max<size_t>(1, indexStride)) {}
+
+    EventReader(const EventReader&) = delete;
+    EventReader& operator=(const EventReader&) = delete;
+
+    // Events of a container, read in place
+    bool openWaveforms(const Waveforms& waveforms) {
+        reset(kEventSourceWaveforms);
+        source = &waveforms;
+        numberOfEvents = waveforms.events();
+        numberOfPoints = waveforms.points();
+        t0_ = waveforms.t0();
+        deltaT_ = waveforms.deltaT();
+        return true;
+    }
+
+    // Events of a binary event store
+    bool openStore(const std::string& filename) {
+        reset(kEventSourceStore);
+        if (!store.open(filename)) {
+            type_ = kEventSourceNone;
+            return false;
+        }
+        numberOfEvents = store.eventCount();
+        numberOfPoints = store.resolution();
+        t0_ = store.t0();
+        deltaT_ = store.deltaT();
+        return true;
+    }
+
+    // numberOfEvents txt files of folder/txt, with the time axis of Time_Window.txt
+    bool openTxt(const std::string& folder, size_t events) {
+        reset(kEventSourceTxt);
+        std::ifstream timeWindowFile(folder + "/txt/Time_Window.txt");
+        std::vector<double> times;
+        double timeValue = 0;
+        while (timeWindowFile >> timeValue)
+            times.push_back(timeValue);
+        if (times.size() < 2) {
+            type_ = kEventSourceNone;
+            return false;
+        }
+        txtFolder = folder;
+        numberOfEvents = events;
+        numberOfPoints = times.size();
+        t0_ = times.front();
+        deltaT_ = times.back() - times[times.size() - 2];
+        lineOffsets.assign(events, std::vector<uint64_t>(1, 0));
+        return true;
+    }
+
+    // Events of a capture CSV, through its row index (see csvIndex.h): read from indexFilename when it matches
+    // the CSV, found with one newline scan otherwise and, if indexFilename is not empty, saved there
+    bool openCSV(const std::string& filename, const std::string& indexFilename = "") {
+        reset(kEventSourceCSV);
+        if (!csv.open(filename) || !openCSVIndex(filename, csv, csvIndex, indexFilename, indexStride, &indexLoaded) ||
+            csvIndex.columns < 2 || csvIndex.rows < 2) {
+            csv.close();
+            type_ = kEventSourceNone;
+            return false;
+        }
+        numberOfEvents = csvIndex.events();
+        numberOfPoints = csvIndex.rows;
+        t0_ = csvIndex.t0;
+        deltaT_ = csvIndex.deltaT;
+        return true;
+    }
+
+    EventSourceType type() const { return type_; }
+    size_t eventCount() const { return numberOfEvents; }
+    size_t resolution() const { return numberOfPoints; }
+    double t0() const { return t0_; }
+    double deltaT() const { return deltaT_; }
+
+    // Row index of the CSV source, and whether it came from its sidecar file
+    const CSVIndex& rowIndex() const { return csvIndex; }
+    bool rowIndexLoaded() const { return indexLoaded; }
+
+    // Bytes of files read so far (mapped pages touched for the store and the CSV)
+    uint64_t bytesRead() const { return bytes.load(); }
+
+    // Points [firstPoint, firstPoint + points) of the zero-based events [firstEvent, firstEvent + events), in volts,
+    // to out[event * points + point] counting from the first ones. False if the range is outside the capture or a
+    // file is missing or short. Different events can be read from different threads at the same time.
+    bool read(size_t firstEvent, size_t events, size_t firstPoint, size_t points, double* out) const {
+        if (firstEvent + events > numberOfEvents || firstPoint + points > numberOfPoints)
+            return false;
+        if (events == 0 || points == 0)
+            return true;
+        switch (type_) {
+            case kEventSourceWaveforms:
+                for (size_t event = 0; event < events; ++event) {
+                    for (size_t point = 0; point < points; ++point)
+                        out[event * points + point] = source->get(firstEvent + event, firstPoint + point);
+                }
+                return true;
+            case kEventSourceStore:
+                for (size_t event = 0; event < events; ++event) {
+                    const double* samples = store.event(firstEvent + event) + firstPoint;
+                    std::copy(samples, samples + points, out + event * points);
+                }
+                bytes += events * points * sizeof(double);
+                return true;
+            case kEventSourceTxt:
+                for (size_t event = 0; event < events; ++event) {
+                    if (!readTxt(firstEvent + event, firstPoint, points, out + event * points))
+                        return false;
+                }
+                return true;
+            case kEventSourceCSV:
+                return readCSV(firstEvent, events, firstPoint, points, out);
+            default:
+                return false;
+        }
+    }
+
+    // Points of one event
+    bool readEvent(size_t event, size_t firstPoint, size_t points, double* out) const {
+        return read(event, 1, firstPoint, points, out);
+    }
+
+private:
+    void reset(EventSourceType type) {
+        type_ = type;
+        source = nullptr;
+        csv.close();
+        txtFolder.clear();
+        lineOffsets.clear();
+        csvIndex = CSVIndex();
+        indexLoaded = false;
+        numberOfEvents = 0;
+        numberOfPoints = 0;
+        t0_ = 0;
+        deltaT_ = 0;
+        bytes = 0;
+    }
+
+    // Lines of one txt event, from the nearest known line before firstPoint
+    bool readTxt(size_t event, size_t firstPoint, size_t points, double* out) const {
+        std::ifstream eventFile(txtFolder + "/txt/Event" + std::to_string(event + 1) + ".txt", std::ios::binary);
+        if (!eventFile.is_open())
+            return false;
+        std::vector<uint64_t>& offsets = lineOffsets[event];
+        size_t known = std::min(firstPoint / indexStride, offsets.size() - 1);
+        size_t line = known * indexStride;
+        eventFile.seekg(static_cast<std::streamoff>(offsets[known]));
+
+        std::string text;
+        uint64_t readBytes = 0;
+        while (line < firstPoint + points) {
+            if (line % indexStride == 0 && line / indexStride == offsets.size())
+                offsets.push_back(static_cast<uint64_t>(eventFile.tellg()));
+            if (!std::getline(eventFile, text))
+                break;
+            readBytes += text.size() + 1;
+            if (line >= firstPoint) {
+                const char* p = text.data();
+                double value = 0;
+                if (!parseValue(p, p + text.size(), value))
+                    break;
+                out[line - firstPoint] = value;
+            }
+            line++;
+        }
+        bytes += readBytes;
+        return line == firstPoint + points;
+    }
+
+    // Skip count commas of the line, false if it has fewer
+    static bool skipColumns(const char*& q, const char* lineEnd, size_t count) {
+        for (size_t column = 0; column < count; ++column) {
+            q = static_cast<const char*>(memchr(q, ',', lineEnd - q));
+            if (q == nullptr)
+                return false;
+            ++q;
+        }
+        return true;
+    }
+
+    // Rows of the CSV, only the columns of the requested events are converted. Values are parsed as parseLine()
+    // does; false if a row is missing, short or has a value that is not a number.
+    bool readCSV(size_t firstEvent, size_t events, size_t firstPoint, size_t points, double* out) const {
+        const char* end = csv.end();
+        const char* p = csvIndex.row(csv, firstPoint);
+        const char* firstRow = p;
+        bool ok = true;
+        for (size_t point = 0; ok && point < points; ++point) {
+            if (p >= end) {
+                ok = false;
+                break;
+            }
+            const char* lineEnd = findLineEnd(p, end);
+
+            // Voltage column of the first event, then past the time column of every next event
+            const char* q = p;
+            ok = skipColumns(q, lineEnd, 2 * firstEvent + 1);
+            for (size_t event = 0; ok && event < events; ++event) {
+                ok = (event == 0 || skipColumns(q, lineEnd, 2)) && parseValue(q, lineEnd, out[event * points + point]);
+            }
+            p = (lineEnd < end) ? lineEnd + 1 : end;
+        }
+        bytes += static_cast<uint64_t>(p - firstRow);
+        return ok;
+    }
+
+    EventSourceType type_ = kEventSourceNone;
+    size_t indexStride;
+    const Waveforms* source = nullptr;
+    EventStore store;
+    MappedFile csv;
+    std::string txtFolder;
+    mutable std::vector<std::vector<uint64_t>> lineOffsets;     // Offset of every indexStride-th line of every txt event
+    CSVIndex csvIndex;                                          // Offset of every indexStride-th data row of the CSV
+    bool indexLoaded = false;
+    size_t numberOfEvents = 0;
+    size_t numberOfPoints = 0;
+    double t0_ = 0;
+    double deltaT_ = 0;
+    mutable std::atomic<uint64_t> bytes{0};
+};
+
+#endif
@@ -0,0 +1,332 @@
+/*
+ *  Event Plots
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * Per-event PNG images (images/Event_N_<name>.png, the plot of
+ * plotSelectedXAndAutoY() in csvRead.cpp) rendered in parallel.
+ *
+ * One thread converts the samples of the selected events to double into a
+ * fixed set of buffers and hands them to the renderers through a bounded
+ * queue; every renderer thread draws on its own canvas. Memory use depends
+ * on the queue depth, not on the number of events.
+ *
+ * All events can be plotted, or only every Nth event, or only the outliers:
+ * events whose area or minimum in the integration window is far from the
+ * median of the capture.
+ *
+ * decimateM4() reduces a trace to the first, minimum, maximum and last point
+ * of every pixel column of the plot before it is drawn, for the overlapped
+ * plots of all events: the line covers the same pixels with fewer points.
+ *
+ * fillPersistence() counts the samples of all events in time x voltage bins,
+ * like the persistence display of the scope, so drawing it costs the same
+ * for any number of events.
+ */
+
+#ifndef EVENT_PLOTS_H
+#define EVENT_PLOTS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "TROOT.h"
+#include "TError.h"
+#include "TCanvas.h"
+#include "TGraph.h"
+#include "TAxis.h"
+#include "ROOT/TThreadExecutor.hxx"
+#include "waveform.h"
+#include "chargeAnalysis.h"
+
+// Events plotted
+enum EventPlotSelection {
+    kPlotAllEvents = 0,
+    kPlotSampledEvents = 1,     // Events 1, 1 + sampleEvery, 1 + 2 * sampleEvery, ...
+    kPlotOutlierEvents = 2      // Events with an outlier area or minimum
+};
+
+struct EventPlotOptions {
+    EventPlotSelection selection = kPlotSampledEvents;
+    size_t sampleEvery = 100;
+    double outlierThreshold = 5;    // Robust standard deviations (1.4826 * MAD) from the median
+    size_t queueDepth = 0;          // Events converted ahead of the renderers (0 = 2 per thread)
+    int width = 1920;
+    int height = 1080;
+};
+
+// Queue with a fixed capacity: push() waits while it is full, pop() while it is empty ----------------------------------------------------
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(std::max<size_t>(1, capacity)) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [&] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+    }
+
+    // Returns false once the queue is closed and empty
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [&] { return !items.empty() || closed; });
+        if (items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    // No more items will be pushed
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    std::deque<T> items;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+};
+
+// Selection ------------------------------------------------------------------------------------------------------------------------------
+
+// Median and robust standard deviation (1.4826 * median absolute deviation) of the values
+inline void robustSpread(std::vector<double> values, double& median, double& sigma) {
+    median = 0;
+    sigma = 0;
+    if (values.empty())
+        return;
+    size_t middle = values.size() / 2;
+    std::nth_element(values.begin(), values.begin() + middle, values.end());
+    median = values[middle];
+    for (double& value : values)
+        value = std::fabs(value - median);
+    std::nth_element(values.begin(), values.begin() + middle, values.end());
+    sigma = 1.4826 * values[middle];
+}
+
+// Zero-based events to plot. Outliers are judged on the baseline-corrected area and minimum of every
+// event in the window, each with its own baseline.
+inline std::vector<size_t> selectEventsToPlot(const Waveforms& waveforms, const EventPlotOptions& options, const ChargeWindow& window,
+                                              ROOT::TThreadExecutor& pool) {
+    std::vector<size_t> events;
+    if (options.selection == kPlotAllEvents || options.selection == kPlotSampledEvents) {
+        size_t step = options.selection == kPlotAllEvents ? 1 : std::max<size_t>(1, options.sampleEvery);
+        for (size_t event = 0; event < waveforms.events(); event += step)
+            events.push_back(event);
+        return events;
+    }
+
+    std::vector<EventSums> eventSums = sumEventsParallel(pool, waveforms.events(), [&](size_t event) {
+        return sumEvent(waveforms, event, window);
+    }, pool.GetPoolSize() * 4);
+    ChargeAccumulator charges(1.0);
+    for (const EventSums& sums : eventSums)
+        charges.add(sums);
+    const ChargeResults& results = charges.get();
+
+    double areaMedian, areaSigma, minimumMedian, minimumSigma;
+    robustSpread(keptValues(results.areas), areaMedian, areaSigma);
+    robustSpread(keptValues(results.minVoltages), minimumMedian, minimumSigma);
+    auto isOutlier = [&](double value, double median, double sigma) {
+        return sigma > 0 && std::fabs(value - median) > options.outlierThreshold * sigma;
+    };
+    for (size_t event = 0; event < results.areas.size(); ++event) {
+        if (isOutlier(results.areas[event], areaMedian, areaSigma) || isOutlier(results.minVoltages[event], minimumMedian, minimumSigma))
+            events.push_back(event);
+    }
+    return events;
+}
+
+// M4 decimation --------------------------------------------------------------------------------------------------------------------------
+
+// Pixel columns of the plot area of a canvas
+inline size_t plotColumnsFor(const TCanvas& canvas) {
+    double width = canvas.GetWw() * (1.0 - canvas.GetLeftMargin() - canvas.GetRightMargin());
+    return static_cast<size_t>(std::max(1.0, width));
+}
+
+// M4 reduction of a trace with increasing x over the pixel columns between x[0] and x[n - 1]: the first,
+// lowest, highest and last point of every column, in their original order. Drawn as a line, the reduced
+// trace lights the same pixels as the full one; it keeps at most 4 points per column.
+inline void decimateM4(const double* x, const double* y, size_t n, size_t columns, std::vector<double>& outX, std::vector<double>& outY) {
+    outX.clear();
+    outY.clear();
+    double span = n > 0 ? x[n - 1] - x[0] : 0;
+    if (n < 2 || columns == 0 || !(span > 0)) {
+        outX.assign(x, x + n);
+        outY.assign(y, y + n);
+        return;
+    }
+
+    double scale = columns / span;
+    auto columnOf = [&](size_t i) {
+        return std::min(columns - 1, static_cast<size_t>((x[i] - x[0]) * scale));
+    };
+
+    size_t i = 0;
+    while (i < n) {
+        size_t column = columnOf(i);
+        size_t lowest = i;
+        size_t highest = i;
+        size_t j = i + 1;
+        for (; j < n && columnOf(j) == column; ++j) {
+            if (y[j] < y[lowest])
+                lowest = j;
+            if (y[j] > y[highest])
+                highest = j;
+        }
+
+        // First, lowest/highest in order, last, without repeating a point
+        size_t kept[4] = {i, std::min(lowest, highest), std::max(lowest, highest), j - 1};
+        for (size_t k = 0; k < 4; ++k) {
+            if (k == 0 || kept[k] != kept[k - 1]) {
+                outX.push_back(x[kept[k]]);
+                outY.push_back(y[kept[k]]);
+            }
+        }
+        i = j;
+    }
+}
+
+// Persistence ----------------------------------------------------------------------------------------------------------------------------
+
+// Samples of all events counted in timeBins x voltageBins bins, row-major by voltage bin: count of time bin
+// i and voltage bin j at [j * timeBins + i]. Time bins split the points of an event evenly, voltage bins
+// split [minY, maxY] (values outside go to the first or last bin). Every pool thread fills its own
+// counts for a block of events; they are added at the end.
+inline std::vector<uint32_t> fillPersistence(const Waveforms& waveforms, size_t timeBins, size_t voltageBins, double minY, double maxY,
+                                             ROOT::TThreadExecutor& pool) {
+    size_t points = waveforms.points();
+    size_t events = waveforms.events();
+    timeBins = std::max<size_t>(1, std::min(timeBins, points));
+    voltageBins = std::max<size_t>(1, voltageBins);
+    std::vector<uint32_t> counts(timeBins * voltageBins, 0);
+    if (events == 0 || points == 0)
+        return counts;
+
+    std::vector<size_t> timeBinOf(points);
+    for (size_t point = 0; point < points; ++point)
+        timeBinOf[point] = point * timeBins / points;
+    double binsPerVolt = maxY > minY ? voltageBins / (maxY - minY) : 0;
+
+    unsigned chunks = static_cast<unsigned>(std::min<size_t>(pool.GetPoolSize(), events));
+    std::vector<std::vector<uint32_t>> partials = pool.Map([&](unsigned chunk) {
+        std::vector<uint32_t> partial(timeBins * voltageBins, 0);
+        std::vector<double> samples(points);
+        for (size_t event = events * chunk / chunks; event < events * (chunk + 1) / chunks; ++event) {
+            waveforms.copyEvent(event, samples.data());
+            for (size_t point = 0; point < points; ++point) {
+                double bin = std::floor((samples[point] - minY) * binsPerVolt);
+                size_t voltageBin = static_cast<size_t>(std::min(static_cast<double>(voltageBins - 1), std::max(0.0, bin)));
+                ++partial[voltageBin * timeBins + timeBinOf[point]];
+            }
+        }
+        return partial;
+    }, ROOT::TSeqU(chunks));
+
+    for (const std::vector<uint32_t>& partial : partials)
+        for (size_t bin = 0; bin < counts.size(); ++bin)
+            counts[bin] += partial[bin];
+    return counts;
+}
+
+// Rendering ------------------------------------------------------------------------------------------------------------------------------
+
+// Samples of one event on their way to a renderer
+struct EventPlotJob {
+    size_t event = 0;
+    std::vector<double> samples;
+};
+
+// Render images/Event_N_<name>.png in filefolder for the given zero-based events, on every thread of the
+// pool. The time axis is in microseconds and the voltage axis spans [minY, maxY] for all events, as in
+// plotSelectedXAndAutoY(). Returns the number of images written.
+inline size_t renderEventPlots(const Waveforms& waveforms, const std::vector<size_t>& events, const std::string& filefolder,
+                               double minY, double maxY, const EventPlotOptions& options, ROOT::TThreadExecutor& pool) {
+    if (events.empty() || waveforms.empty())
+        return 0;
+
+    // Every renderer has its own canvas
+    ROOT::EnableThreadSafety();
+    std::string name = filefolder.substr(filefolder.find_last_of("/") + 1);
+    size_t points = waveforms.points();
+    std::vector<double> timeMicro(points);
+    for (size_t point = 0; point < points; ++point)
+        timeMicro[point] = waveforms.time(point) * timeMultiplier;
+
+    unsigned renderers = std::max(1u, std::min(pool.GetPoolSize(), static_cast<unsigned>(events.size())));
+    size_t depth = options.queueDepth > 0 ? options.queueDepth : 2 * renderers;
+
+    // Buffers go round: free -> converted -> rendered -> free
+    BoundedQueue<EventPlotJob> freeJobs(depth);
+    BoundedQueue<EventPlotJob> filledJobs(depth);
+    for (size_t slot = 0; slot < depth; ++slot) {
+        EventPlotJob job;
+        job.samples.resize(points);
+        freeJobs.push(std::move(job));
+    }
+
+    // Only warnings and errors, not one line per saved image
+    int ignoreLevel = gErrorIgnoreLevel;
+    gErrorIgnoreLevel = kWarning;
+
+    std::thread converter([&] {
+        EventPlotJob job;
+        for (size_t event : events) {
+            freeJobs.pop(job);
+            job.event = event;
+            waveforms.copyEvent(event, job.samples.data());
+            filledJobs.push(std::move(job));
+        }
+        filledJobs.close();
+    });
+
+    std::atomic<size_t> written(0);
+    pool.Foreach([&](unsigned renderer) {
+        TCanvas canvas(("eventCanvas" + std::to_string(renderer)).c_str(), "CSV Data Plot", options.width, options.height);
+        EventPlotJob job;
+        while (filledJobs.pop(job)) {
+            canvas.cd();
+            canvas.Clear();
+            canvas.SetGrid();
+
+            TGraph graph(points, timeMicro.data(), job.samples.data());
+            graph.GetXaxis()->SetRangeUser(timeMicro.front(), timeMicro.back());
+            graph.GetYaxis()->SetRangeUser(minY, maxY);
+            graph.SetLineWidth(3);
+            graph.SetLineColor(4);
+            graph.Draw("APL");
+            graph.GetXaxis()->SetTitle("Microseconds");
+            graph.GetYaxis()->SetTitle("Volts");
+            graph.SetTitle(("Event " + std::to_string(job.event + 1) + " - " + name).c_str());
+
+            std::string pngFilename = filefolder + "/images/Event_" + std::to_string(job.event + 1) + "_" + name + ".png";
+            canvas.SaveAs(pngFilename.c_str());
+            canvas.Clear();
+            ++written;
+            freeJobs.push(std::move(job));
+        }
+    }, ROOT::TSeqU(renderers));
+
+    converter.join();
+    gErrorIgnoreLevel = ignoreLevel;
+    return written;
+}
+
+#endif
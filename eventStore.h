@@ -0,0 +1,444 @@
+/*
+ *  Binary Event Store
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * Single binary file holding every event of a capture, written by
+ * csvRead.cpp and read by chargeHisto.cpp, so the waveforms are parsed
+ * from text only once.
+ *
+ * Layout (native byte order):
+ *   header   - magic, version, sample type, resolution, event count, t0, deltaT
+ *   offsets  - byte offset of the samples of every event
+ *   samples  - one contiguous block of 'resolution' values per event
+ *
+ * The reader memory-maps the file and hands out pointers straight into it,
+ * or a Waveforms view (waveform.h) over all events.
+ *
+ * The same events can also be written as a ROOT TTree (one fixed-size
+ * Float_t[resolution] branch plus event metadata) or, for older scripts,
+ * as one txt file per event.
+ */
+
+#ifndef EVENT_STORE_H
+#define EVENT_STORE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <algorithm>
+#include "TFile.h"
+#include "TTree.h"
+#include "Compression.h"
+
+#include "keysightCSV.h"
+#include "waveform.h"
+
+const char eventStoreMagic[8] = {'S', 'A', 'P', 'H', 'E', 'V', 'S', '\0'};
+const uint32_t eventStoreVersion = 1;
+const uint64_t eventStoreAlignment = 64;
+
+// Sample encodings of the store
+enum EventStoreSampleType : uint32_t {
+    kSampleFloat64 = 0
+};
+
+struct EventStoreHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sampleType;
+    uint64_t resolution;
+    uint64_t eventCount;
+    double t0;          // Time of the first point in seconds
+    double deltaT;      // Time between points in seconds
+};
+
+// Writer --------------------------------------------------------------------------------------------------------------------------------
+
+// Header of a float64 store, with t0 and deltaT left at zero
+inline EventStoreHeader makeEventStoreHeader(size_t resolution, size_t eventCount) {
+    EventStoreHeader header;
+    memcpy(header.magic, eventStoreMagic, sizeof(header.magic));
+    header.version = eventStoreVersion;
+    header.sampleType = kSampleFloat64;
+    header.resolution = resolution;
+    header.eventCount = eventCount;
+    header.t0 = 0;
+    header.deltaT = 0;
+    return header;
+}
+
+// Write header, offset table and padding; samples start aligned after the offset table
+inline bool writeEventStoreLayout(FILE* file, const EventStoreHeader& header, std::vector<uint64_t>& offsets) {
+    uint64_t eventBytes = header.resolution * sizeof(double);
+    uint64_t firstOffset = sizeof(header) + header.eventCount * sizeof(uint64_t);
+    firstOffset = (firstOffset + eventStoreAlignment - 1) / eventStoreAlignment * eventStoreAlignment;
+    offsets.resize(header.eventCount);
+    for (uint64_t event = 0; event < header.eventCount; ++event)
+        offsets[event] = firstOffset + event * eventBytes;
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), file) == offsets.size();
+    std::vector<char> padding(firstOffset - sizeof(header) - offsets.size() * sizeof(uint64_t), 0);
+    ok = ok && fwrite(padding.data(), 1, padding.size(), file) == padding.size();
+    return ok;
+}
+
+// Seek to a 64-bit offset
+inline bool seekEventStore(FILE* file, uint64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(file, static_cast<__int64>(offset), SEEK_SET) == 0;
+#else
+    return fseeko(file, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+}
+
+// Write the event columns of data (odd columns, as read by readCSV) to filename. t0 and deltaT are
+// taken from the first time column. Returns false if the file could not be written.
+inline bool writeEventStore(const std::string& filename, const std::vector<std::vector<double>>& data, size_t resolution) {
+    if (data.size() < 2 || data[0].size() < 2)
+        return false;
+
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (file == nullptr)
+        return false;
+
+    EventStoreHeader header = makeEventStoreHeader(resolution, data.size() / 2);
+    header.t0 = data[0].front();
+    header.deltaT = data[0].back() - data[0][data[0].size() - 2];
+
+    std::vector<uint64_t> offsets;
+    bool ok = writeEventStoreLayout(file, header, offsets);
+    for (size_t colIndex = 1; ok && colIndex < 2 * header.eventCount; colIndex += 2) {
+        if (data[colIndex].size() != resolution) {
+            ok = false;
+            break;
+        }
+        ok = fwrite(data[colIndex].data(), sizeof(double), resolution, file) == resolution;
+    }
+
+    ok = (fclose(file) == 0) && ok;
+    if (!ok)
+        remove(filename.c_str());
+    return ok;
+}
+
+// Write every event of waveforms to filename as float64. Returns false if the file could not be written.
+inline bool writeEventStore(const std::string& filename, const Waveforms& waveforms) {
+    if (waveforms.empty())
+        return false;
+
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (file == nullptr)
+        return false;
+
+    EventStoreHeader header = makeEventStoreHeader(waveforms.points(), waveforms.events());
+    header.t0 = waveforms.t0();
+    header.deltaT = waveforms.deltaT();
+
+    std::vector<uint64_t> offsets;
+    bool ok = writeEventStoreLayout(file, header, offsets);
+    std::vector<double> samples(waveforms.points());
+    for (size_t event = 0; ok && event < waveforms.events(); ++event) {
+        waveforms.copyEvent(event, samples.data());
+        ok = fwrite(samples.data(), sizeof(double), samples.size(), file) == samples.size();
+    }
+
+    ok = (fclose(file) == 0) && ok;
+    if (!ok)
+        remove(filename.c_str());
+    return ok;
+}
+
+// Incremental writer for the streaming mode: rows arrive in batches (row-major, time and voltage
+// column per event) and are written at their position inside every event block.
+class EventStoreWriter {
+public:
+    ~EventStoreWriter() {
+        if (file != nullptr) {
+            fclose(file);
+            remove(path.c_str());
+        }
+    }
+
+    // Create the file for a known resolution and number of events
+    bool open(const std::string& filename, size_t resolution, size_t eventCount) {
+        path = filename;
+        header = makeEventStoreHeader(resolution, eventCount);
+        file = fopen(filename.c_str(), "wb");
+        if (file == nullptr)
+            return false;
+        return writeEventStoreLayout(file, header, offsets);
+    }
+
+    // Write rows [firstRow, firstRow + rows) of every event
+    bool writeRows(size_t firstRow, size_t rows, const double* batch, size_t numColumns) {
+        if (file == nullptr || firstRow + rows > header.resolution)
+            return false;
+        eventRows.resize(rows);
+        for (size_t event = 0; event < header.eventCount; ++event) {
+            size_t column = 2 * event + 1;
+            for (size_t row = 0; row < rows; ++row)
+                eventRows[row] = column < numColumns ? batch[row * numColumns + column] : 0.0;
+            if (!seekEventStore(file, offsets[event] + firstRow * sizeof(double)) ||
+                fwrite(eventRows.data(), sizeof(double), rows, file) != rows)
+                return false;
+        }
+        return true;
+    }
+
+    // Store the time axis and close the file
+    bool finish(double t0, double deltaT) {
+        if (file == nullptr)
+            return false;
+        header.t0 = t0;
+        header.deltaT = deltaT;
+        bool ok = seekEventStore(file, 0) && fwrite(&header, sizeof(header), 1, file) == 1;
+        ok = (fclose(file) == 0) && ok;
+        file = nullptr;
+        if (!ok)
+            remove(path.c_str());
+        return ok;
+    }
+
+private:
+    FILE* file = nullptr;
+    std::string path;
+    EventStoreHeader header;
+    std::vector<uint64_t> offsets;
+    std::vector<double> eventRows;
+};
+
+// Reader --------------------------------------------------------------------------------------------------------------------------------
+class EventStore {
+public:
+    // Map filename and validate its header, returns false if it is not a usable store
+    bool open(const std::string& filename) {
+        if (!file.open(filename) || file.size() < sizeof(EventStoreHeader))
+            return false;
+        memcpy(&header, file.begin(), sizeof(header));
+        if (memcmp(header.magic, eventStoreMagic, sizeof(header.magic)) != 0 || header.version != eventStoreVersion ||
+            header.sampleType != kSampleFloat64) {
+            file.close();
+            return false;
+        }
+
+        // Every event must lie inside the file
+        const char* offsetTable = file.begin() + sizeof(header);
+        if (file.size() < sizeof(header) + header.eventCount * sizeof(uint64_t)) {
+            file.close();
+            return false;
+        }
+        offsets.resize(header.eventCount);
+        memcpy(offsets.data(), offsetTable, offsets.size() * sizeof(uint64_t));
+        for (uint64_t offset : offsets) {
+            if (offset + header.resolution * sizeof(double) > file.size()) {
+                file.close();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool isOpen() const { return file.isOpen(); }
+    size_t resolution() const { return header.resolution; }
+    size_t eventCount() const { return header.eventCount; }
+    double t0() const { return header.t0; }
+    double deltaT() const { return header.deltaT; }
+
+    // Samples of a zero-based event
+    const double* event(size_t index) const {
+        return reinterpret_cast<const double*>(file.begin() + offsets[index]);
+    }
+
+    // Read-only waveform container over the mapped samples, false if the events are not evenly spaced
+    bool view(Waveforms& waveforms) const {
+        for (size_t event = 1; event < offsets.size(); ++event) {
+            if (offsets[event] != offsets[0] + event * header.resolution * sizeof(double))
+                return false;
+        }
+        waveforms.view(offsets.empty() ? nullptr : event(0), header.eventCount, header.resolution, header.resolution);
+        waveforms.setTimeAxis(header.t0, header.deltaT);
+        return true;
+    }
+
+private:
+    MappedFile file;
+    EventStoreHeader header;
+    std::vector<uint64_t> offsets;
+};
+
+// Legacy txt writer ---------------------------------------------------------------------------------------------------------------------
+
+// Write txt/Time_Window.txt and one txt/EventN.txt per event inside folder, returns false on error
+inline bool writeEventTxtFiles(const std::string& folder, const std::vector<std::vector<double>>& data) {
+    if (data.empty())
+        return false;
+
+    std::ofstream timeFile(folder + "/txt/Time_Window.txt");
+    if (!timeFile.is_open())
+        return false;
+    for (double value : data[0])
+        timeFile << value << '\n';
+
+    for (size_t colIndex = 1; colIndex < data.size(); colIndex += 2) {
+        std::ofstream eventFile(folder + "/txt/Event" + std::to_string(colIndex / 2 + 1) + ".txt");
+        if (!eventFile.is_open())
+            return false;
+        for (double value : data[colIndex])
+            eventFile << value << '\n';
+    }
+    return true;
+}
+
+// Same files from a waveform container, with the time axis t0 + point * deltaT
+inline bool writeEventTxtFiles(const std::string& folder, const Waveforms& waveforms) {
+    if (waveforms.empty())
+        return false;
+
+    std::ofstream timeFile(folder + "/txt/Time_Window.txt");
+    if (!timeFile.is_open())
+        return false;
+    for (size_t point = 0; point < waveforms.points(); ++point)
+        timeFile << waveforms.time(point) << '\n';
+
+    std::vector<double> samples(waveforms.points());
+    for (size_t event = 0; event < waveforms.events(); ++event) {
+        std::ofstream eventFile(folder + "/txt/Event" + std::to_string(event + 1) + ".txt");
+        if (!eventFile.is_open())
+            return false;
+        waveforms.copyEvent(event, samples.data());
+        for (double value : samples)
+            eventFile << value << '\n';
+    }
+    return true;
+}
+
+// Append a batch of rows (row-major, as given by CSVBatchReader) to the txt files of folder.
+// The files are truncated when firstBatch is true.
+inline bool appendEventTxtRows(const std::string& folder, const double* batch, size_t rows, size_t numColumns, bool firstBatch) {
+    std::ios::openmode mode = firstBatch ? std::ios::trunc : std::ios::app;
+    std::ofstream timeFile(folder + "/txt/Time_Window.txt", std::ios::out | mode);
+    if (!timeFile.is_open())
+        return false;
+    for (size_t row = 0; row < rows; ++row)
+        timeFile << batch[row * numColumns] << '\n';
+
+    for (size_t colIndex = 1; colIndex < numColumns; colIndex += 2) {
+        std::ofstream eventFile(folder + "/txt/Event" + std::to_string(colIndex / 2 + 1) + ".txt", std::ios::out | mode);
+        if (!eventFile.is_open())
+            return false;
+        for (size_t row = 0; row < rows; ++row)
+            eventFile << batch[row * numColumns + colIndex] << '\n';
+    }
+    return true;
+}
+
+// ROOT TTree writer ---------------------------------------------------------------------------------------------------------------------
+const char eventTreeName[] = "events";
+
+// Tuning of the event tree
+struct EventTreeOptions {
+    ROOT::RCompressionSetting::EAlgorithm::EValues compressionAlgorithm = ROOT::RCompressionSetting::EAlgorithm::kZSTD;   // kLZ4 or kZSTD
+    int compressionLevel = 5;
+    int basketSize = 512000;            // Bytes per basket of the samples branch
+    Long64_t autoFlush = -30000000;     // < 0: bytes per cluster, > 0: entries per cluster
+};
+
+// Write every event of data (odd columns) as one entry of the tree eventTreeName in filename.
+// Branches: eventNumber, resolution, t0, deltaT, minVoltage, maxVoltage and samples[resolution].
+inline bool writeEventTree(const std::string& filename, const std::vector<std::vector<double>>& data, size_t resolution,
+                           const EventTreeOptions& options, const std::string& title = "Waveforms") {
+    if (data.size() < 2 || data[0].size() < 2)
+        return false;
+
+    std::unique_ptr<TFile> file(TFile::Open(filename.c_str(), "RECREATE", "",
+                                            ROOT::CompressionSettings(options.compressionAlgorithm, options.compressionLevel)));
+    if (!file || file->IsZombie())
+        return false;
+
+    // Event metadata and fixed-size samples branch
+    UInt_t eventNumber = 0;
+    UInt_t treeResolution = static_cast<UInt_t>(resolution);
+    Double_t t0 = data[0].front();
+    Double_t deltaT = data[0].back() - data[0][data[0].size() - 2];
+    Float_t minVoltage = 0;
+    Float_t maxVoltage = 0;
+    std::vector<Float_t> samples(resolution);
+
+    TTree* tree = new TTree(eventTreeName, title.c_str());
+    tree->Branch("eventNumber", &eventNumber, "eventNumber/i");
+    tree->Branch("resolution", &treeResolution, "resolution/i");
+    tree->Branch("t0", &t0, "t0/D");
+    tree->Branch("deltaT", &deltaT, "deltaT/D");
+    tree->Branch("minVoltage", &minVoltage, "minVoltage/F");
+    tree->Branch("maxVoltage", &maxVoltage, "maxVoltage/F");
+    tree->Branch("samples", samples.data(), ("samples[" + std::to_string(resolution) + "]/F").c_str(), options.basketSize);
+    tree->SetAutoFlush(options.autoFlush);
+
+    for (size_t colIndex = 1; colIndex < data.size(); colIndex += 2) {
+        if (data[colIndex].size() != resolution)
+            return false;
+        eventNumber = static_cast<UInt_t>(colIndex / 2 + 1);
+        std::copy(data[colIndex].begin(), data[colIndex].end(), samples.begin());
+        auto range = std::minmax_element(data[colIndex].begin(), data[colIndex].end());
+        minVoltage = static_cast<Float_t>(*range.first);
+        maxVoltage = static_cast<Float_t>(*range.second);
+        tree->Fill();
+    }
+
+    tree->Write();
+    file->Close();
+    return true;
+}
+
+// Same tree from a waveform container
+inline bool writeEventTree(const std::string& filename, const Waveforms& waveforms, const EventTreeOptions& options,
+                           const std::string& title = "Waveforms") {
+    if (waveforms.empty())
+        return false;
+
+    std::unique_ptr<TFile> file(TFile::Open(filename.c_str(), "RECREATE", "",
+                                            ROOT::CompressionSettings(options.compressionAlgorithm, options.compressionLevel)));
+    if (!file || file->IsZombie())
+        return false;
+
+    UInt_t eventNumber = 0;
+    UInt_t treeResolution = static_cast<UInt_t>(waveforms.points());
+    Double_t t0 = waveforms.t0();
+    Double_t deltaT = waveforms.deltaT();
+    Float_t minVoltage = 0;
+    Float_t maxVoltage = 0;
+    std::vector<double> values(waveforms.points());
+    std::vector<Float_t> samples(waveforms.points());
+
+    TTree* tree = new TTree(eventTreeName, title.c_str());
+    tree->Branch("eventNumber", &eventNumber, "eventNumber/i");
+    tree->Branch("resolution", &treeResolution, "resolution/i");
+    tree->Branch("t0", &t0, "t0/D");
+    tree->Branch("deltaT", &deltaT, "deltaT/D");
+    tree->Branch("minVoltage", &minVoltage, "minVoltage/F");
+    tree->Branch("maxVoltage", &maxVoltage, "maxVoltage/F");
+    tree->Branch("samples", samples.data(), ("samples[" + std::to_string(waveforms.points()) + "]/F").c_str(), options.basketSize);
+    tree->SetAutoFlush(options.autoFlush);
+
+    for (size_t event = 0; event < waveforms.events(); ++event) {
+        eventNumber = static_cast<UInt_t>(event + 1);
+        waveforms.copyEvent(event, values.data());
+        std::copy(values.begin(), values.end(), samples.begin());
+        auto range = std::minmax_element(values.begin(), values.end());
+        minVoltage = static_cast<Float_t>(*range.first);
+        maxVoltage = static_cast<Float_t>(*range.second);
+        tree->Fill();
+    }
+
+    tree->Write();
+    file->Close();
+    return true;
+}
+
+#endif
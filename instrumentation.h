@@ -0,0 +1,310 @@
+/*
+ *  Process Instrumentation
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * Small helpers to report resource usage of the macros, and a RunProfile
+ * that times the phases of a run (parse, writers, plots, histograms...).
+ *
+ * Every phase records its wall time and the CPU time of the whole process
+ * (all threads) over the same interval, the bytes it read and wrote and the
+ * events it went through. A phase with CPU time well below its wall time
+ * waited on the disk; one with CPU time near wall time times the threads
+ * was compute bound. The profile is written as JSON, and optionally in the
+ * Chrome trace-event format (chrome://tracing or ui.perfetto.dev).
+ *
+ * The growth of the heap in use over every phase is read from mallinfo2()
+ * on glibc (2.33 or later), which also works inside root -l. The number of
+ * heap allocations needs the global operator new replaced, which cannot be
+ * done under root -l: it is only counted when a macro is built as a program
+ * with g++, COUNT_ALLOCATIONS defined and countAllocations.cpp linked in
+ * (see the build line there).
+ * A figure that is not available is written as null in the JSON.
+ */
+
+#ifndef INSTRUMENTATION_H
+#define INSTRUMENTATION_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX             // Keep std::min/std::max usable after <windows.h>
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define HAVE_MALLINFO2 1
+#endif
+
+// Peak resident set size (memory high-water mark) of this process in kilobytes, 0 if unknown
+inline long peakResidentMemoryKB() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return static_cast<long>(counters.PeakWorkingSetSize / 1024);
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;  // bytes on macOS
+#else
+    return usage.ru_maxrss;         // kilobytes on Linux
+#endif
+#endif
+}
+
+// User plus system CPU time of all threads of this process in seconds, 0 if unknown
+inline double processCpuSeconds() {
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+        return 0;
+    auto seconds = [](const FILETIME& time) {
+        return ((static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime) * 1e-7;  // 100 ns ticks
+    };
+    return seconds(kernel) + seconds(user);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+#endif
+}
+
+// Size of a file in bytes, 0 if it cannot be opened
+inline uint64_t fileSizeBytes(const std::string& path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+        return 0;
+    std::streamoff size = file.tellg();
+    return size > 0 ? static_cast<uint64_t>(size) : 0;
+}
+
+// Heap allocations ---------------------------------------------------------------------------------------------------------------------------
+#ifdef COUNT_ALLOCATIONS
+// Defined with the replacement operator new in countAllocations.cpp
+std::atomic<uint64_t>& allocationCounter();
+#endif
+
+// Bytes of heap in use (all malloc arenas and mmapped blocks), -1 if unknown
+inline long long heapBytesInUse() {
+#ifdef HAVE_MALLINFO2
+    struct mallinfo2 info = mallinfo2();
+    return static_cast<long long>(info.uordblks + info.hblkhd);
+#else
+    return -1;
+#endif
+}
+
+// Heap allocations made with operator new so far, -1 if not counted
+inline long long allocationCount() {
+#ifdef COUNT_ALLOCATIONS
+    return static_cast<long long>(allocationCounter().load(std::memory_order_relaxed));
+#else
+    return -1;
+#endif
+}
+
+// Run profile ----------------------------------------------------------------------------------------------------------------------------------
+const long long unavailableCounter = std::numeric_limits<long long>::min();  // Counter that could not be measured
+
+struct PhaseRecord {
+    std::string name;
+    double startSeconds = 0;    // Since the start of the profile
+    double wallSeconds = 0;
+    double cpuSeconds = 0;      // All threads of the process
+    uint64_t bytesRead = 0;
+    uint64_t bytesWritten = 0;
+    uint64_t events = 0;
+    long peakRssKB = 0;         // High-water mark at the end of the phase
+    long long heapGrowthBytes = unavailableCounter;  // Change of the heap in use, negative if it shrank
+    long long allocations = unavailableCounter;      // Only counted with COUNT_ALLOCATIONS
+
+    double eventsPerSecond() const { return wallSeconds > 0 ? events / wallSeconds : 0; }
+    double cpuPerWall() const { return wallSeconds > 0 ? cpuSeconds / wallSeconds : 0; }
+};
+
+class RunProfile {
+public:
+    // A phase in progress, recorded when it goes out of scope
+    class Phase {
+    public:
+        Phase(RunProfile& profile, const std::string& name) : profile(profile) {
+            record.name = name;
+            record.startSeconds = profile.elapsedSeconds();
+            startCpu = processCpuSeconds();
+            startHeapBytes = heapBytesInUse();
+            startAllocations = allocationCount();
+        }
+        Phase(const Phase&) = delete;
+        Phase& operator=(const Phase&) = delete;
+        ~Phase() {
+            record.wallSeconds = profile.elapsedSeconds() - record.startSeconds;
+            record.cpuSeconds = processCpuSeconds() - startCpu;
+            record.peakRssKB = peakResidentMemoryKB();
+            if (startHeapBytes >= 0)
+                record.heapGrowthBytes = heapBytesInUse() - startHeapBytes;
+            if (startAllocations >= 0)
+                record.allocations = allocationCount() - startAllocations;
+            profile.phases.push_back(record);
+        }
+
+        void addBytesRead(uint64_t bytes) { record.bytesRead += bytes; }
+        void addBytesWritten(uint64_t bytes) { record.bytesWritten += bytes; }
+        void addFileWritten(const std::string& path) { record.bytesWritten += fileSizeBytes(path); }
+        void addEvents(uint64_t events) { record.events += events; }
+
+    private:
+        RunProfile& profile;
+        PhaseRecord record;
+        double startCpu = 0;
+        long long startHeapBytes = -1;
+        long long startAllocations = -1;
+    };
+
+    RunProfile(const std::string& macro, const std::string& capture)
+        : macro(macro), capture(capture), start(std::chrono::steady_clock::now()),
+          startCpu(processCpuSeconds()), startHeapBytes(heapBytesInUse()), startAllocations(allocationCount()) {}
+
+    // Usage: RunProfile::Phase phase = profile.phase("parse");
+    Phase phase(const std::string& name) { return Phase(*this, name); }
+
+    double elapsedSeconds() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Totals of the run so far, the events are those of the phase that went through the most
+    PhaseRecord total() const {
+        PhaseRecord sum;
+        sum.name = macro;
+        sum.wallSeconds = elapsedSeconds();
+        sum.cpuSeconds = processCpuSeconds() - startCpu;
+        sum.peakRssKB = peakResidentMemoryKB();
+        if (startHeapBytes >= 0)
+            sum.heapGrowthBytes = heapBytesInUse() - startHeapBytes;
+        if (startAllocations >= 0)
+            sum.allocations = allocationCount() - startAllocations;
+        for (const PhaseRecord& record : phases) {
+            sum.bytesRead += record.bytesRead;
+            sum.bytesWritten += record.bytesWritten;
+            sum.events = std::max(sum.events, record.events);
+        }
+        return sum;
+    }
+
+    // One line per phase on the console
+    void print(std::ostream& out) const {
+        char line[256];
+        out << "- Phase                 Wall (s)    CPU (s)  CPU/Wall   Read (MB)  Written (MB)   Events/s   Heap (MB)" << std::endl;
+        auto printRecord = [&](const PhaseRecord& record) {
+            std::snprintf(line, sizeof(line), "- %-20s %9.3f  %9.3f  %8.2f  %10.1f  %12.1f  %9.0f", record.name.c_str(),
+                          record.wallSeconds, record.cpuSeconds, record.cpuPerWall(), record.bytesRead / 1048576.0,
+                          record.bytesWritten / 1048576.0, record.eventsPerSecond());
+            out << line;
+            if (record.heapGrowthBytes != unavailableCounter) {
+                std::snprintf(line, sizeof(line), "  %+10.1f", record.heapGrowthBytes / 1048576.0);
+                out << line;
+            } else {
+                out << "         n/a";
+            }
+            out << std::endl;
+        };
+        for (const PhaseRecord& record : phases)
+            printRecord(record);
+        printRecord(total());
+    }
+
+    bool writeJSON(const std::string& path) const {
+        std::ofstream out(path);
+        if (!out.is_open())
+            return false;
+        PhaseRecord sum = total();
+        out << "{\n  \"macro\": \"" << escape(macro) << "\",\n  \"capture\": \"" << escape(capture) << "\",\n";
+        out << "  \"total\": ";
+        writeRecord(out, sum);
+        out << ",\n  \"phases\": [";
+        for (size_t i = 0; i < phases.size(); ++i) {
+            out << (i == 0 ? "\n    " : ",\n    ");
+            writeRecord(out, phases[i]);
+        }
+        out << "\n  ]\n}\n";
+        return out.good();
+    }
+
+    // Complete ("X") events of every phase on one track, and a counter track of the peak RSS
+    bool writeChromeTrace(const std::string& path) const {
+        std::ofstream out(path);
+        if (!out.is_open())
+            return false;
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        out << "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"" << escape(macro + " " + capture) << "\"}}";
+        for (const PhaseRecord& record : phases) {
+            long long startMicro = static_cast<long long>(record.startSeconds * 1e6);
+            out << ",\n  {\"name\": \"" << escape(record.name) << "\", \"cat\": \"phase\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1"
+                << ", \"ts\": " << startMicro << ", \"dur\": " << static_cast<long long>(record.wallSeconds * 1e6)
+                << ", \"args\": {\"cpuSeconds\": " << record.cpuSeconds << ", \"bytesRead\": " << record.bytesRead
+                << ", \"bytesWritten\": " << record.bytesWritten << ", \"events\": " << record.events
+                << ", \"heapGrowthBytes\": " << optional(record.heapGrowthBytes) << ", \"allocations\": " << optional(record.allocations) << "}}";
+            out << ",\n  {\"name\": \"peakRssMB\", \"ph\": \"C\", \"pid\": 1, \"ts\": "
+                << static_cast<long long>((record.startSeconds + record.wallSeconds) * 1e6)
+                << ", \"args\": {\"peakRssMB\": " << record.peakRssKB / 1024.0 << "}}";
+        }
+        out << "\n]}\n";
+        return out.good();
+    }
+
+private:
+    static std::string escape(const std::string& text) {
+        std::string escaped;
+        for (const char c : text) {
+            if (c == '"' || c == '\\')
+                escaped += '\\';
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    // A counter that may be unavailable, as a JSON value
+    static std::string optional(long long value) {
+        return value == unavailableCounter ? "null" : std::to_string(value);
+    }
+
+    static void writeRecord(std::ostream& out, const PhaseRecord& record) {
+        out << "{\"name\": \"" << escape(record.name) << "\", \"startSeconds\": " << record.startSeconds
+            << ", \"wallSeconds\": " << record.wallSeconds << ", \"cpuSeconds\": " << record.cpuSeconds
+            << ", \"cpuPerWall\": " << record.cpuPerWall() << ", \"bytesRead\": " << record.bytesRead
+            << ", \"bytesWritten\": " << record.bytesWritten << ", \"events\": " << record.events
+            << ", \"eventsPerSecond\": " << record.eventsPerSecond() << ", \"peakRssKB\": " << record.peakRssKB
+            << ", \"heapGrowthBytes\": " << optional(record.heapGrowthBytes) << ", \"allocations\": " << optional(record.allocations) << "}";
+    }
+
+    std::string macro;
+    std::string capture;
+    std::chrono::steady_clock::time_point start;
+    double startCpu = 0;
+    long long startHeapBytes = -1;
+    long long startAllocations = -1;
+    std::vector<PhaseRecord> phases;
+};
+
+#endif
@@ -0,0 +1,739 @@
+/*
+ *  Keysight CSV Parsing Engine
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * Shared reader for the .csv files written by the Keysight oscilloscope.
+ * The file is memory-mapped and scanned once: newlines and commas are found
+ * directly in the mapped bytes and every number is converted with
+ * std::from_chars, so no string or istringstream is built per line.
+ *
+ * parseKeysightCSVParallel() gives the same result using newline-aligned
+ * chunks parsed on a ROOT::TThreadExecutor.
+ *
+ * parseKeysightWaveforms() parses straight into a Waveforms container
+ * (waveform.h): one shared time axis and compact samples instead of two
+ * double columns per event. detectKeysightQuantization() finds the ADC step
+ * of the voltages, so they can be kept as int16 codes without losing anything.
+ *
+ * CSVBatchReader reads the file in bounded batches of rows for the
+ * streaming mode, where the capture is never held in memory as a whole.
+ *
+ * The old istringstream reader is kept as readKeysightCSVStream() so the
+ * benchmark macro can compare both paths and check they give the same data.
+ */
+
+#ifndef KEYSIGHT_CSV_H
+#define KEYSIGHT_CSV_H
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "ROOT/TThreadExecutor.hxx"
+#include "waveform.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX             // Keep std::min/std::max usable after <windows.h>
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Number of header lines written by the scope before the data
+const size_t keysightHeaderLines = 25;
+
+// Read-only memory mapping of a whole file ----------------------------------------------------------------------------------------------
+class MappedFile {
+public:
+    MappedFile() = default;
+    explicit MappedFile(const std::string& path) { open(path); }
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& path) {
+        close();
+#ifdef _WIN32
+        fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (fileHandle == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(fileHandle, &fileSize)) {
+            close();
+            return false;
+        }
+        mappedSize = static_cast<size_t>(fileSize.QuadPart);
+        opened = true;
+        if (mappedSize == 0)
+            return true;
+        mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mappingHandle == nullptr) {
+            close();
+            return false;
+        }
+        mappedData = static_cast<const char*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+        if (mappedData == nullptr) {
+            close();
+            return false;
+        }
+#else
+        fileDescriptor = ::open(path.c_str(), O_RDONLY);
+        if (fileDescriptor < 0)
+            return false;
+        struct stat fileStat;
+        if (fstat(fileDescriptor, &fileStat) != 0) {
+            close();
+            return false;
+        }
+        mappedSize = static_cast<size_t>(fileStat.st_size);
+        opened = true;
+        if (mappedSize == 0)
+            return true;
+        void* address = mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+        if (address == MAP_FAILED) {
+            close();
+            return false;
+        }
+        madvise(address, mappedSize, MADV_SEQUENTIAL);
+        mappedData = static_cast<const char*>(address);
+#endif
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (mappedData != nullptr)
+            UnmapViewOfFile(mappedData);
+        if (mappingHandle != nullptr)
+            CloseHandle(mappingHandle);
+        if (fileHandle != INVALID_HANDLE_VALUE)
+            CloseHandle(fileHandle);
+        mappingHandle = nullptr;
+        fileHandle = INVALID_HANDLE_VALUE;
+#else
+        if (mappedData != nullptr)
+            munmap(const_cast<char*>(mappedData), mappedSize);
+        if (fileDescriptor >= 0)
+            ::close(fileDescriptor);
+        fileDescriptor = -1;
+#endif
+        mappedData = nullptr;
+        mappedSize = 0;
+        opened = false;
+    }
+
+    bool isOpen() const { return opened; }
+    const char* begin() const { return mappedData; }
+    const char* end() const { return mappedData + mappedSize; }
+    size_t size() const { return mappedSize; }
+
+private:
+    const char* mappedData = nullptr;
+    size_t mappedSize = 0;
+    bool opened = false;
+#ifdef _WIN32
+    HANDLE fileHandle = INVALID_HANDLE_VALUE;
+    HANDLE mappingHandle = nullptr;
+#else
+    int fileDescriptor = -1;
+#endif
+};
+
+// Global min/max of the X (time) and Y (voltage) columns --------------------------------------------------------------------------------
+struct CSVRange {
+    double minX = std::numeric_limits<double>::max();
+    double maxX = std::numeric_limits<double>::lowest();
+    double minY = std::numeric_limits<double>::max();
+    double maxY = std::numeric_limits<double>::lowest();
+
+    // Update with a value of the given zero-based column
+    void update(size_t column, double value) {
+        if (column % 2 == 0) {  // X-axis columns
+            minX = std::min(minX, value);
+            maxX = std::max(maxX, value);
+        } else {                // Y-axis columns
+            minY = std::min(minY, value);
+            maxY = std::max(maxY, value);
+        }
+    }
+
+    void merge(const CSVRange& other) {
+        minX = std::min(minX, other.minX);
+        maxX = std::max(maxX, other.maxX);
+        minY = std::min(minY, other.minY);
+        maxY = std::max(maxY, other.maxY);
+    }
+};
+
+// Low level scanning helpers ------------------------------------------------------------------------------------------------------------
+
+// Return the end of the line starting at p (position of '\n' or end)
+inline const char* findLineEnd(const char* p, const char* end) {
+    const void* newline = memchr(p, '\n', static_cast<size_t>(end - p));
+    return newline ? static_cast<const char*>(newline) : end;
+}
+
+// Skip n lines starting at p and return the start of the next one
+inline const char* skipLines(const char* p, const char* end, size_t n) {
+    for (size_t i = 0; i < n && p < end; ++i) {
+        p = findLineEnd(p, end);
+        if (p < end)
+            ++p;
+    }
+    return p;
+}
+
+// Count the lines in [p, end) the way getline() would see them
+inline size_t countLines(const char* p, const char* end) {
+    size_t lines = 0;
+    while (p < end) {
+        const char* lineEnd = findLineEnd(p, end);
+        ++lines;
+        p = (lineEnd < end) ? lineEnd + 1 : end;
+    }
+    return lines;
+}
+
+// Parse one number at p as "iss >> value" would: whitespace and a leading '+' are skipped. On success p is
+// left right after the number.
+inline bool parseValue(const char*& p, const char* lineEnd, double& value) {
+    const char* q = p;
+    while (q < lineEnd && (*q == ' ' || *q == '\t' || *q == '\r'))
+        ++q;
+    if (q < lineEnd && *q == '+')
+        ++q;
+    if (q >= lineEnd)
+        return false;
+    auto result = std::from_chars(q, lineEnd, value);
+    if (result.ec != std::errc())
+        return false;
+    p = result.ptr;
+    return true;
+}
+
+// Parse one line calling sink(column, value) per number. Mirrors "iss >> value" followed by
+// ignoring a single ',': whitespace is skipped and the line stops at the first non-number.
+template <typename Sink>
+inline size_t parseLine(const char* p, const char* lineEnd, Sink&& sink) {
+    size_t column = 0;
+    double value;
+    while (parseValue(p, lineEnd, value)) {
+        sink(column, value);
+        ++column;
+        if (p < lineEnd && *p == ',')
+            ++p;
+    }
+    return column;
+}
+
+// Memory-mapped reader ------------------------------------------------------------------------------------------------------------------
+
+// Create one column per value of the first data row and return the start of the next line
+inline const char* parseFirstRow(const char* p, const char* end, std::vector<std::vector<double>>& data) {
+    const char* lineEnd = findLineEnd(p, end);
+    parseLine(p, lineEnd, [&](size_t, double value) {
+        data.push_back(std::vector<double>());
+        data.back().push_back(value);
+    });
+    return (lineEnd < end) ? lineEnd + 1 : end;
+}
+
+// Fill one column per CSV column and return the number of data rows. As in the original reader,
+// the first data row defines the number of columns and does not take part in the min/max.
+inline size_t parseKeysightCSV(const MappedFile& file, std::vector<std::vector<double>>& data, CSVRange& range) {
+    const char* p = skipLines(file.begin(), file.end(), keysightHeaderLines);
+    const char* end = file.end();
+    if (p >= end)
+        return 0;
+
+    // First row determines the number of columns
+    p = parseFirstRow(p, end, data);
+    size_t numColumns = data.size();
+
+    // Reserve every column once instead of growing them row by row
+    size_t expectedRows = 1 + countLines(p, end);
+    for (auto& column : data)
+        column.reserve(expectedRows);
+
+    // Rest of the file
+    size_t lineCount = 1;
+    const char* lineEnd;
+    while (p < end) {
+        lineEnd = findLineEnd(p, end);
+        parseLine(p, lineEnd, [&](size_t column, double value) {
+            if (column < numColumns) {
+                data[column].push_back(value);
+                range.update(column, value);
+            }
+        });
+        lineCount++;
+        p = (lineEnd < end) ? lineEnd + 1 : end;
+    }
+    return lineCount;
+}
+
+// Parallel memory-mapped reader ---------------------------------------------------------------------------------------------------------
+
+// Split [p, end) into numberOfChunks pieces that start right after a newline
+inline std::vector<const char*> splitInLineChunks(const char* p, const char* end, size_t numberOfChunks) {
+    std::vector<const char*> bounds;
+    bounds.push_back(p);
+    size_t length = static_cast<size_t>(end - p);
+    for (size_t chunk = 1; chunk < numberOfChunks; ++chunk) {
+        const char* cut = p + length * chunk / numberOfChunks;
+        if (cut <= bounds.back())
+            continue;
+        cut = findLineEnd(cut - 1, end);
+        cut = (cut < end) ? cut + 1 : end;
+        if (cut > bounds.back() && cut < end)
+            bounds.push_back(cut);
+    }
+    bounds.push_back(end);
+    return bounds;
+}
+
+// Same output as parseKeysightCSV(), but the rows after the first one are split in newline-aligned
+// chunks parsed on the pool. Rows are counted per chunk first, so every chunk writes straight into
+// its own row range of the columns; per-chunk min/max are merged at the end. If a row does not have
+// exactly one value per column the row layout would differ from the serial reader, so it falls back
+// to it to stay bit-identical.
+inline size_t parseKeysightCSVParallel(const MappedFile& file, std::vector<std::vector<double>>& data, CSVRange& range,
+                                       ROOT::TThreadExecutor& pool, size_t numberOfChunks) {
+    const char* p = skipLines(file.begin(), file.end(), keysightHeaderLines);
+    const char* end = file.end();
+    if (p >= end)
+        return 0;
+
+    p = parseFirstRow(p, end, data);
+    size_t numColumns = data.size();
+    std::vector<const char*> bounds = splitInLineChunks(p, end, std::max<size_t>(numberOfChunks, 1));
+    unsigned chunks = static_cast<unsigned>(bounds.size() - 1);
+
+    // Rows per chunk and the first row of each chunk
+    std::vector<size_t> chunkRows = pool.Map([&](unsigned chunk) {
+        return countLines(bounds[chunk], bounds[chunk + 1]);
+    }, ROOT::TSeqU(chunks));
+    std::vector<size_t> firstRow(chunks + 1, 1);
+    for (unsigned chunk = 0; chunk < chunks; ++chunk)
+        firstRow[chunk + 1] = firstRow[chunk] + chunkRows[chunk];
+    size_t lineCount = firstRow[chunks];
+    for (auto& column : data)
+        column.resize(lineCount);
+
+    // Parse every chunk into its rows
+    struct ChunkResult {
+        CSVRange range;
+        bool regular = true;
+    };
+    std::vector<ChunkResult> results = pool.Map([&](unsigned chunk) {
+        ChunkResult result;
+        size_t row = firstRow[chunk];
+        const char* q = bounds[chunk];
+        const char* chunkEnd = bounds[chunk + 1];
+        while (q < chunkEnd) {
+            const char* lineEnd = findLineEnd(q, chunkEnd);
+            size_t values = parseLine(q, lineEnd, [&](size_t column, double value) {
+                if (column < numColumns) {
+                    data[column][row] = value;
+                    result.range.update(column, value);
+                }
+            });
+            if (values != numColumns)
+                result.regular = false;
+            ++row;
+            q = (lineEnd < chunkEnd) ? lineEnd + 1 : chunkEnd;
+        }
+        return result;
+    }, ROOT::TSeqU(chunks));
+
+    // Merge the chunk results
+    CSVRange merged;
+    for (const auto& result : results) {
+        if (!result.regular) {
+            data.clear();
+            return parseKeysightCSV(file, data, range);
+        }
+        merged.merge(result.range);
+    }
+    range.merge(merged);
+    return lineCount;
+}
+
+// ADC quantization ----------------------------------------------------------------------------------------------------------------------
+
+// Voltages written by the scope are ADC codes: value = code * step + offset
+struct ADCQuantization {
+    bool found = false;
+    double step = 0;            // Volts per code
+    double offset = 0;          // Volts of code 0, a level near the middle of the values seen
+    size_t levels = 0;          // Distinct voltages in the rows looked at
+};
+
+// Look at the voltage columns of the first maxRows data rows: every distinct value must be a whole number
+// of steps away from the lowest one, within the rounding of the text (tolerance, in steps). Not found when
+// the values are not on a grid (e.g. averaged captures) or span more codes than an int16 holds.
+inline ADCQuantization detectKeysightQuantization(const MappedFile& file, size_t maxRows = 4096, double tolerance = 0.05) {
+    ADCQuantization quantization;
+    const char* p = skipLines(file.begin(), file.end(), keysightHeaderLines);
+    const char* end = file.end();
+    std::vector<double> levels;
+    for (size_t row = 0; row < maxRows && p < end; ++row) {
+        const char* lineEnd = findLineEnd(p, end);
+        parseLine(p, lineEnd, [&](size_t column, double value) {
+            if (column % 2 == 1)
+                levels.push_back(value);
+        });
+        p = (lineEnd < end) ? lineEnd + 1 : end;
+    }
+    std::sort(levels.begin(), levels.end());
+    levels.erase(std::unique(levels.begin(), levels.end()), levels.end());
+    quantization.levels = levels.size();
+    if (levels.size() < 2)
+        return quantization;
+
+    // Smallest gap between neighbouring levels is one step
+    double step = std::numeric_limits<double>::max();
+    for (size_t i = 1; i < levels.size(); ++i)
+        step = std::min(step, levels[i] - levels[i - 1]);
+
+    // Every level on the grid, then the step from the whole span
+    double lastCode = 0;
+    for (double level : levels) {
+        double code = (level - levels.front()) / step;
+        if (std::fabs(code - std::round(code)) > tolerance)
+            return quantization;
+        lastCode = std::round(code);
+    }
+    if (lastCode > std::numeric_limits<uint16_t>::max())
+        return quantization;
+    step = (levels.back() - levels.front()) / lastCode;
+
+    quantization.found = true;
+    quantization.step = step;
+    quantization.offset = levels.front() + std::round(lastCode / 2) * step;
+    return quantization;
+}
+
+// Waveform reader -----------------------------------------------------------------------------------------------------------------------
+
+// Parse the data rows into waveforms, one event per pair of columns, with samples of the given type
+// (int16 codes are value = code * scale + offset) and the time axis of the first column: t0 from
+// the first row and deltaT from the last two rows. Chunks are parsed on the pool when one is given.
+// Missing values of a short row are left as 0. range gets the same min/max as parseKeysightCSV().
+// inexactSamples, if given, gets the number of int16 samples more than a quarter step away from the
+// value in the file (off the grid or clipped). Returns the number of data rows.
+inline size_t parseKeysightWaveforms(const MappedFile& file, Waveforms& waveforms, CSVRange& range, WaveformSampleType type,
+                                     ROOT::TThreadExecutor* pool, size_t numberOfChunks, double scale = 1, double offset = 0,
+                                     size_t* inexactSamples = nullptr) {
+    const char* p = skipLines(file.begin(), file.end(), keysightHeaderLines);
+    const char* end = file.end();
+    if (p >= end)
+        return 0;
+
+    // First row determines the number of columns
+    std::vector<double> firstValues;
+    const char* lineEnd = findLineEnd(p, end);
+    parseLine(p, lineEnd, [&](size_t, double value) { firstValues.push_back(value); });
+    p = (lineEnd < end) ? lineEnd + 1 : end;
+    size_t numColumns = firstValues.size();
+    size_t events = numColumns / 2;
+    if (events == 0)
+        return 0;
+
+    std::vector<const char*> bounds = splitInLineChunks(p, end, pool != nullptr ? std::max<size_t>(numberOfChunks, 1) : 1);
+    unsigned chunks = static_cast<unsigned>(bounds.size() - 1);
+    auto runChunks = [&](auto task) {
+        std::vector<decltype(task(0u))> results;
+        if (pool != nullptr) {
+            results = pool->Map(task, ROOT::TSeqU(chunks));
+        } else {
+            for (unsigned chunk = 0; chunk < chunks; ++chunk)
+                results.push_back(task(chunk));
+        }
+        return results;
+    };
+
+    // Rows per chunk and the first row of each chunk
+    std::vector<size_t> chunkRows = runChunks([&](unsigned chunk) {
+        return countLines(bounds[chunk], bounds[chunk + 1]);
+    });
+    std::vector<size_t> firstRow(chunks + 1, 1);
+    for (unsigned chunk = 0; chunk < chunks; ++chunk)
+        firstRow[chunk + 1] = firstRow[chunk] + chunkRows[chunk];
+    size_t lineCount = firstRow[chunks];
+
+    waveforms.allocate(events, lineCount, type, scale, offset);
+    double exactness = 0.25 * std::fabs(scale);
+    auto isInexact = [&](size_t event, size_t row, double value) {
+        return type == kWaveformInt16 && std::fabs(waveforms.get(event, row) - value) > exactness;
+    };
+    size_t inexact = 0;
+    for (size_t event = 0; event < events; ++event) {
+        waveforms.set(event, 0, firstValues[2 * event + 1]);
+        inexact += isInexact(event, 0, firstValues[2 * event + 1]);
+    }
+
+    // Parse every chunk into its rows, keeping the last two times of the chunk
+    struct ChunkResult {
+        CSVRange range;
+        size_t rows = 0;
+        size_t inexact = 0;
+        double lastTime = 0;
+        double secondLastTime = 0;
+    };
+    std::vector<ChunkResult> results = runChunks([&](unsigned chunk) {
+        ChunkResult result;
+        size_t row = firstRow[chunk];
+        const char* q = bounds[chunk];
+        const char* chunkEnd = bounds[chunk + 1];
+        while (q < chunkEnd) {
+            const char* rowEnd = findLineEnd(q, chunkEnd);
+            parseLine(q, rowEnd, [&](size_t column, double value) {
+                if (column < numColumns) {
+                    result.range.update(column, value);
+                    if (column == 0) {
+                        result.secondLastTime = result.lastTime;
+                        result.lastTime = value;
+                    } else if (column % 2 == 1 && column / 2 < events) {
+                        waveforms.set(column / 2, row, value);
+                        result.inexact += isInexact(column / 2, row, value);
+                    }
+                }
+            });
+            ++result.rows;
+            ++row;
+            q = (rowEnd < chunkEnd) ? rowEnd + 1 : chunkEnd;
+        }
+        return result;
+    });
+
+    // Merge the chunk results in row order
+    double lastTime = firstValues[0];
+    double secondLastTime = firstValues[0];
+    for (const auto& result : results) {
+        range.merge(result.range);
+        inexact += result.inexact;
+        if (result.rows >= 2) {
+            secondLastTime = result.secondLastTime;
+            lastTime = result.lastTime;
+        } else if (result.rows == 1) {
+            secondLastTime = lastTime;
+            lastTime = result.lastTime;
+        }
+    }
+    waveforms.setTimeAxis(firstValues[0], lastTime - secondLastTime);
+    if (inexactSamples != nullptr)
+        *inexactSamples = inexact;
+    return lineCount;
+}
+
+// Streaming reader ----------------------------------------------------------------------------------------------------------------------
+
+// Reads the CSV in fixed-size blocks and hands out bounded batches of rows, so memory use does not
+// depend on the file size. Batches are row-major with columns() values per row; missing values of a
+// short row are left as 0 and values beyond the first row's column count are ignored.
+class CSVBatchReader {
+public:
+    CSVBatchReader() = default;
+    ~CSVBatchReader() { close(); }
+
+    CSVBatchReader(const CSVBatchReader&) = delete;
+    CSVBatchReader& operator=(const CSVBatchReader&) = delete;
+
+    // Open filename, skip the header and read the first row to find the number of columns. A header line
+    // "Points,<n>" gives the number of data rows, see headerPoints().
+    bool open(const std::string& filename, size_t blockBytes = 4 << 20) {
+        close();
+        file = fopen(filename.c_str(), "rb");
+        if (file == nullptr)
+            return false;
+        block.resize(std::max<size_t>(blockBytes, 4096));
+        const char* lineBegin;
+        const char* lineEnd;
+        for (size_t i = 0; i < keysightHeaderLines; ++i) {
+            if (!nextLine(lineBegin, lineEnd))
+                return true;
+            const char key[] = "Points,";
+            size_t keyLength = sizeof(key) - 1;
+            if (static_cast<size_t>(lineEnd - lineBegin) > keyLength && memcmp(lineBegin, key, keyLength) == 0) {
+                size_t points = 0;
+                if (std::from_chars(lineBegin + keyLength, lineEnd, points).ec == std::errc())
+                    pointsInHeader = points;
+            }
+        }
+        if (nextLine(lineBegin, lineEnd)) {
+            parseLine(lineBegin, lineEnd, [&](size_t, double value) { firstRow.push_back(value); });
+            pendingFirstRow = true;
+        }
+        return true;
+    }
+
+    void close() {
+        if (file != nullptr)
+            fclose(file);
+        file = nullptr;
+        blockBegin = blockEnd = 0;
+        endOfFile = false;
+        pendingFirstRow = false;
+        firstRow.clear();
+        totalBytes = 0;
+        pointsInHeader = 0;
+    }
+
+    size_t columns() const { return firstRow.size(); }
+    size_t headerPoints() const { return pointsInHeader; }   // 0 if the header does not give it
+    size_t bytesRead() const { return totalBytes; }
+
+    // Read up to maxRows rows into batch, returns the number of rows read (0 at the end of the file)
+    size_t readBatch(std::vector<double>& batch, size_t maxRows) {
+        size_t numColumns = columns();
+        if (numColumns == 0 || maxRows == 0)
+            return 0;
+        if (batch.size() < maxRows * numColumns)
+            batch.resize(maxRows * numColumns);
+
+        size_t rows = 0;
+        if (pendingFirstRow) {
+            std::copy(firstRow.begin(), firstRow.end(), batch.begin());
+            pendingFirstRow = false;
+            rows = 1;
+        }
+        const char* lineBegin;
+        const char* lineEnd;
+        while (rows < maxRows && nextLine(lineBegin, lineEnd)) {
+            double* row = &batch[rows * numColumns];
+            std::fill(row, row + numColumns, 0.0);
+            parseLine(lineBegin, lineEnd, [&](size_t column, double value) {
+                if (column < numColumns)
+                    row[column] = value;
+            });
+            ++rows;
+        }
+        return rows;
+    }
+
+private:
+    // Next complete line of the file, refilling the block when needed (getline semantics for the last line)
+    bool nextLine(const char*& lineBegin, const char*& lineEnd) {
+        while (true) {
+            const char* start = block.data() + blockBegin;
+            const char* stop = block.data() + blockEnd;
+            const void* newline = memchr(start, '\n', static_cast<size_t>(stop - start));
+            if (newline != nullptr) {
+                lineBegin = start;
+                lineEnd = static_cast<const char*>(newline);
+                blockBegin = static_cast<size_t>(lineEnd - block.data()) + 1;
+                return true;
+            }
+            if (endOfFile) {
+                if (start == stop)
+                    return false;
+                lineBegin = start;
+                lineEnd = stop;
+                blockBegin = blockEnd;
+                return true;
+            }
+
+            // Keep the partial line at the front and read more (growing the block for very long lines)
+            size_t remaining = blockEnd - blockBegin;
+            memmove(block.data(), block.data() + blockBegin, remaining);
+            blockBegin = 0;
+            blockEnd = remaining;
+            if (blockEnd == block.size())
+                block.resize(block.size() * 2);
+            size_t readBytes = fread(block.data() + blockEnd, 1, block.size() - blockEnd, file);
+            blockEnd += readBytes;
+            totalBytes += readBytes;
+            if (readBytes == 0)
+                endOfFile = true;
+        }
+    }
+
+    FILE* file = nullptr;
+    std::vector<char> block;
+    size_t blockBegin = 0;
+    size_t blockEnd = 0;
+    bool endOfFile = false;
+    bool pendingFirstRow = false;
+    std::vector<double> firstRow;
+    size_t totalBytes = 0;
+    size_t pointsInHeader = 0;
+};
+
+// Number of data rows after the header, counted with a small read buffer
+inline size_t countCSVRows(const std::string& filename) {
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (file == nullptr)
+        return 0;
+    std::vector<char> buffer(4 << 20);
+    size_t lines = 0;
+    char last = '\n';
+    size_t readBytes;
+    while ((readBytes = fread(buffer.data(), 1, buffer.size(), file)) > 0) {
+        lines += static_cast<size_t>(std::count(buffer.data(), buffer.data() + readBytes, '\n'));
+        last = buffer[readBytes - 1];
+    }
+    fclose(file);
+    if (last != '\n')
+        ++lines;
+    return lines > keysightHeaderLines ? lines - keysightHeaderLines : 0;
+}
+
+// Original istringstream reader, kept as reference for benchmarks -----------------------------------------------------------------------
+inline size_t readKeysightCSVStream(const std::string& filename, std::vector<std::vector<double>>& data, CSVRange& range) {
+    std::ifstream file(filename);
+    if (!file.is_open())
+        return 0;
+
+    std::string line;
+    for (size_t i = 0; i < keysightHeaderLines; ++i)
+        getline(file, line);
+
+    getline(file, line);
+    std::istringstream header(line);
+    double value;
+    size_t lineCount = 1;
+    size_t numColumns = 0;
+    while (header >> value) {
+        data.push_back(std::vector<double>());
+        data.back().push_back(value);
+        numColumns++;
+        if (header.peek() == ',')
+            header.ignore();
+    }
+
+    while (getline(file, line)) {
+        std::istringstream iss(line);
+        size_t colIndex = 0;
+        while (iss >> value) {
+            if (colIndex < numColumns) {
+                data[colIndex].push_back(value);
+                range.update(colIndex, value);
+            }
+            if (iss.peek() == ',')
+                iss.ignore();
+            colIndex++;
+        }
+        lineCount++;
+    }
+    return lineCount;
+}
+
+#endif
@@ -0,0 +1,370 @@
+/*
+ *  Live Monitor by Charly
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * This code is a ROOT macro that follows a capture while the oscilloscope
+ * is still taking data, instead of waiting for the whole run to end before
+ * running csvRead.cpp and chargeHisto.cpp.
+ *
+ * The Keysight CSV has one row per time point and one pair of columns per
+ * event, so an event is only complete when its file is. The scope is set
+ * to save the run as a sequence of segment files (one CSV per acquisition
+ * batch) in captureFolder. The macro polls the folder, and every segment
+ * whose size stopped changing is parsed in parallel and added to the
+ * charge and baseline histograms, which are never rebuilt. Every
+ * refreshSeconds the histogram PNGs and a ROOT file are rewritten and the
+ * gain and mean number of photoelectrons so far are printed, so the single
+ * photoelectron peak can be watched while it forms.
+ *
+ * scopeSimulator.cpp writes segments the same way, to try the macro
+ * without a scope.
+ *
+ * Run it with: root -l -b -q liveMonitor.cpp
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include "TSystem.h"
+#include "TString.h"
+#include "TRegexp.h"
+#include "TH1D.h"
+#include "TCanvas.h"
+#include "TFile.h"
+#include "ROOT/TThreadExecutor.hxx"
+#include "keysightCSV.h"
+#include "chargeAnalysis.h"
+#include "baselineEstimation.h"
+#include "waveform.h"
+#include "signalWindow.h"
+
+using namespace std;
+
+using std::chrono::steady_clock;
+using std::chrono::duration;
+
+// EDITABLE Variables
+//--------------------------------------------------------------------------------------------------------------
+// Folder where the scope saves the segment files of the run
+string captureFolder = "/home/martinus/Escritorio/ledchar/live"; // <-- EDIT THIS --
+
+// Wildcard on the names of the segment files
+string filePattern = "*.csv";
+
+// Also process the segments already in the folder when the macro starts
+bool processExisting = true;
+
+// Seconds between two looks at the folder
+double pollSeconds = 1.0;
+
+// A segment is read once its size has not changed for this many seconds
+double settleSeconds = 2.0;
+
+// Seconds between two refreshes of the PNG and ROOT outputs
+double refreshSeconds = 10.0;
+
+// Stop after this many seconds without new segments (0 = run until the macro is stopped)
+double idleStopSeconds = 0;
+
+// First and last time point of the charge integration window
+double minTimeValue = 3000;
+double maxTimeValue = 4000;
+
+// Window from the mean waveform of a strided sample of the events of the first segment (see signalWindow.h);
+// minTimeValue and maxTimeValue are used when no pulse is found
+bool autoWindow = true;
+
+// Baseline estimator and RMS cut of every event, as baselineOptions of chargeHisto.cpp (see baselineEstimation.h):
+// {method, truncateFraction, rmsCut}. The RMS cut compares the events of the same segment, rmsCut = 0 keeps every event
+BaselineOptions baselineOptions = {kBaselineMedian, 0.1, 5};
+
+// Bins of the histograms. Their ranges are taken from the first segment.
+int chargeBins = 400;
+int baselineBins = 200;
+
+// Threads used to parse and integrate every segment (0 = all cores)
+unsigned int numberOfThreads = 0;
+//--------------------------------------------------------------------------------------------------------------
+
+// Size of a segment file the last time it was seen, and since when
+struct SegmentState {
+    long long size = -1;
+    steady_clock::time_point since;
+    bool done = false;
+};
+
+// Histograms and charges of the run so far
+struct LiveRun {
+    TH1D* charges = nullptr;
+    TH1D* baseline = nullptr;
+    ChargeAccumulator* accumulator = nullptr;
+    ChargeWindow window;
+    size_t resolution = 0;
+    size_t segments = 0;
+    size_t events = 0;
+};
+
+// Function to list the segment files of the folder ---------------------------------------------------------------------------------------
+vector<string> findSegments() {
+    vector<string> segments;
+    void* directory = gSystem->OpenDirectory(captureFolder.c_str());
+    if (directory == nullptr) {
+        return segments;
+    }
+
+    TRegexp wildcard(filePattern.c_str(), kTRUE);
+    while (const char* entry = gSystem->GetDirEntry(directory)) {
+        string name = entry;
+        if (name == "." || name == ".." || !TString(entry).Contains(wildcard)) {
+            continue;
+        }
+        segments.push_back(captureFolder + "/" + name);
+    }
+    gSystem->FreeDirectory(directory);
+
+    sort(segments.begin(), segments.end());
+    return segments;
+}
+
+// Function to add one finished segment to the run ----------------------------------------------------------------------------------------
+// Returns 0, 1 or 5 for a segment that could not be read or does not match the run (the run is unchanged and
+// the segment is skipped), 2 or 3 for an integration window that does not fit the events
+int addSegment(const string& path, LiveRun& run, ROOT::TThreadExecutor& pool) {
+
+    // Read data from CSV, on the pool
+    Waveforms waveforms;
+    CSVRange range;
+    size_t resolution = 0;
+    {
+        MappedFile file(path);
+        if (!file.isOpen()) {
+            cerr << "Error: Could not open file " << path << endl;
+            return 1;
+        }
+        resolution = parseKeysightWaveforms(file, waveforms, range, kWaveformFloat32, &pool, pool.GetPoolSize() * 4);
+    }
+    if (waveforms.empty() || resolution < 2) {
+        cerr << "Error: No events found in " << path << endl;
+        return 1;
+    }
+
+    // The first segment fixes the window and the histogram ranges
+    if (run.accumulator == nullptr) {
+        run.resolution = resolution;
+        run.window.baselinePortion = baselinePortionFor(resolution);
+        run.window.minTimeValue = minTimeValue;
+        run.window.maxTimeValue = maxTimeValue;
+        if (autoWindow) {
+            DetectedWindow detected = detectSignalWindow(waveforms);
+            if (detected.found) {
+                run.window.minTimeValue = detected.minTimeValue;
+                run.window.maxTimeValue = detected.maxTimeValue;
+                cout << "Integration window from the first segment: " << detected.minTimeValue << " to " << detected.maxTimeValue << " points" << endl;
+            } else {
+                cout << " - WARNING - No pulse found in the first segment, using minTimeValue and maxTimeValue" << endl;
+            }
+        }
+        if (run.window.maxTimeValue > resolution) {
+            cerr << " - ERROR - maxTimeValue > resolution" << endl;
+            return 2;
+        } else if (run.window.minTimeValue <= 0) {
+            cerr << " - ERROR - Invalid minTimeValue" << endl;
+            return 3;
+        }
+        run.accumulator = new ChargeAccumulator(waveforms.deltaT()/50.0);
+    } else if (resolution != run.resolution) {
+        cerr << "Error: " << path << " has " << resolution << " points per event instead of " << run.resolution << endl;
+        return 5;
+    }
+
+    // Charges and baseline of every event, added in event order
+    vector<EventSums> eventSums = sumEventsParallel(pool, waveforms.events(), [&](size_t event) {
+        EventSums sums = sumEvent(waveforms, event, run.window);
+        estimateEventBaseline(sums, waveforms, event, run.window, baselineOptions);
+        return sums;
+    }, pool.GetPoolSize() * 4);
+    flagBaselineOutliers(eventSums, baselineOptions.rmsCut);
+    size_t firstNew = run.accumulator->get().areas.size();
+    for (const EventSums& sums : eventSums) {
+        run.accumulator->add(sums);
+    }
+    const vector<double>& areas = run.accumulator->get().areas;
+
+    if (run.charges == nullptr) {
+        // Ranges from the first segment, with room on both sides: its charges kept and all of its voltages
+        vector<double> kept = keptValues(areas);
+        double minArea = kept.empty() ? 0 : *min_element(kept.begin(), kept.end()) * chargeMultiplier;
+        double maxArea = kept.empty() ? 0 : *max_element(kept.begin(), kept.end()) * chargeMultiplier;
+        double margin = max(maxArea - minArea, 1e-6);
+        string name = captureFolder.substr(captureFolder.find_last_of("/") + 1);
+        run.charges = new TH1D("LiveCharge", ("Charge Histogram - " + name).c_str(), chargeBins, min(0.0, minArea - 0.05 * margin), maxArea + margin);
+        run.charges->SetDirectory(nullptr);
+        run.charges->GetXaxis()->SetTitle("Picocoulombs");
+        double baselineMargin = max(range.maxY - range.minY, 1e-6) * 0.25;
+        run.baseline = new TH1D("LiveBaseline", ("Baseline Voltage - " + name).c_str(), baselineBins, range.minY - baselineMargin, range.maxY + baselineMargin);
+        run.baseline->SetDirectory(nullptr);
+        run.baseline->GetXaxis()->SetTitle("Volts");
+    }
+
+    // Fill only what is new: charges of this segment and its baseline points (1..baselinePortion, as csvRead)
+    for (size_t event = firstNew; event < areas.size(); ++event) {
+        if (!std::isnan(areas[event]))
+            run.charges->Fill(areas[event] * chargeMultiplier);
+    }
+    for (size_t event = 0; event < waveforms.events(); ++event) {
+        for (size_t point = 1; point <= static_cast<size_t>(run.window.baselinePortion) && point < resolution; ++point) {
+            run.baseline->Fill(waveforms.get(event, point));
+        }
+    }
+
+    run.segments++;
+    run.events += waveforms.events();
+    return 0;
+}
+
+// Function to rewrite the PNG and ROOT outputs -------------------------------------------------------------------------------------------
+// Returns 0, or 7 if the ROOT file could not be written
+int refreshOutputs(const LiveRun& run) {
+    if (run.charges == nullptr) {
+        return 0;
+    }
+    string name = captureFolder.substr(captureFolder.find_last_of("/") + 1);
+    gSystem->mkdir((captureFolder + "/images").c_str(), kTRUE);
+
+    // Histograms
+    TCanvas *canvas = new TCanvas("liveCanvas", "Live Histograms", 1920, 1080);
+    canvas->SetGrid();
+    run.charges->Draw();
+    canvas->SaveAs((captureFolder + "/images/Live_Charge_Histogram_" + name + ".png").c_str());
+    canvas->Clear();
+    canvas->SetGrid();
+    run.baseline->Draw();
+    canvas->SaveAs((captureFolder + "/images/Live_Baseline_Voltage_Histogram_" + name + ".png").c_str());
+    delete canvas;
+
+    // ROOT file written aside and renamed, so it is never seen half written
+    string rootFilename = captureFolder + "/" + name + "_live.root";
+    string temporaryFilename = rootFilename + ".tmp";
+    auto *f = new TFile(temporaryFilename.c_str(), "RECREATE");
+    if (f->IsZombie()) {
+        cerr << "Error: Could not create " << temporaryFilename << endl;
+        delete f;
+        return 7;
+    }
+    run.charges->Write();
+    run.baseline->Write();
+    f->Close();
+    delete f;
+    if (gSystem->Rename(temporaryFilename.c_str(), rootFilename.c_str()) != 0) {
+        cerr << "Error: Could not replace " << rootFilename << endl;
+        return 7;
+    }
+
+    // Gain and mean number of photoelectrons so far
+    GainEstimate estimate = estimateGain(keptValues(run.accumulator->get().areas));
+    cout << "- " << run.segments << " segments, " << run.events << " events (" << run.accumulator->excludedEvents()
+         << " excluded for their baseline RMS): mean charge " << estimate.meanCharge * chargeMultiplier
+         << " pC, gain " << estimate.gain << " +- " << estimate.gainError << ", mean PE " << estimate.meanPE << " +- " << estimate.meanPEError << endl;
+    return 0;
+}
+
+// Main function --------------------------------------------------------------------------------------------------------------------------
+int liveMonitor() {
+
+    //Mode for ROOT graphics
+    gROOT->SetBatch(kTRUE);  // Set to kTRUE to run in batch mode (no GUI)
+
+    // Welcome message
+    cout << " " << endl;
+    cout << "   ***   Live Monitor by Charly   ***   " << endl;
+    cout << " " << endl;
+    cout << "Watching " << captureFolder << "/" << filePattern << " every " << pollSeconds << " seconds..." << endl;
+    cout << " " << endl;
+
+    ROOT::TThreadExecutor pool(numberOfThreads);
+    LiveRun run;
+    map<string, SegmentState> segments;
+    if (!processExisting) {
+        for (const string& path : findSegments()) {
+            segments[path].done = true;
+        }
+    }
+
+    auto lastNewData = steady_clock::now();
+    auto lastRefresh = steady_clock::now();
+    bool pendingRefresh = false;
+    size_t skippedSegments = 0;
+    int status = 0;
+    while (status == 0) {
+        auto now = steady_clock::now();
+
+        // Segments whose size has settled are added, oldest name first
+        for (const string& path : findSegments()) {
+            SegmentState& state = segments[path];
+            if (state.done) {
+                continue;
+            }
+            FileStat_t fileStat;
+            if (gSystem->GetPathInfo(path.c_str(), fileStat) != 0) {
+                continue;
+            }
+            if (fileStat.fSize != state.size) {
+                state.size = fileStat.fSize;
+                state.since = now;
+                lastNewData = now;
+                continue;
+            }
+            if (state.size > 0 && duration<double>(now - state.since).count() >= settleSeconds) {
+                cout << "Adding " << path << endl;
+                int segmentStatus = addSegment(path, run, pool);
+                state.done = true;
+                lastNewData = now;
+                // A bad segment is skipped and the run goes on; a window that does not fit the events stops it
+                if (segmentStatus == 2 || segmentStatus == 3) {
+                    status = segmentStatus;
+                    break;
+                } else if (segmentStatus != 0) {
+                    cerr << " - WARNING - Skipping " << path << " (error " << segmentStatus << ")" << endl;
+                    skippedSegments++;
+                    continue;
+                }
+                pendingRefresh = true;
+            }
+        }
+
+        // Outputs
+        if (status == 0 && pendingRefresh && duration<double>(now - lastRefresh).count() >= refreshSeconds) {
+            status = refreshOutputs(run);
+            lastRefresh = now;
+            pendingRefresh = false;
+            if (status != 0) {
+                break;
+            }
+        }
+
+        if (idleStopSeconds > 0 && duration<double>(now - lastNewData).count() >= idleStopSeconds) {
+            cout << "No new segments for " << idleStopSeconds << " seconds, stopping." << endl;
+            break;
+        }
+        this_thread::sleep_for(duration<double>(pollSeconds));
+    }
+
+    // Last outputs
+    if (pendingRefresh) {
+        int refreshStatus = refreshOutputs(run);
+        if (status == 0) {
+            status = refreshStatus;
+        }
+    }
+    cout << " " << endl;
+    cout << "- SUMMARY ---------------------------------------------------------------------------------------------" << endl;
+    cout << "- Segments: " << run.segments << ", events: " << run.events << ", segments skipped: " << skippedSegments << endl;
+    cout << "- Charge Histogram, Baseline Voltage Histogram and " << captureFolder.substr(captureFolder.find_last_of("/") + 1) << "_live.root in " << captureFolder << endl;
+    cout << "-------------------------------------------------------------------------------------------------------" << endl;
+    return status;
+}
@@ -0,0 +1,339 @@
+/*
+ *  Pulse Processing
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * Digital pulse processing of baseline-subtracted events, as an alternative
+ * to integrating a fixed window: every pulse of an event is found and
+ * measured on its own, so noise, single pulses and pile-up can be told apart.
+ *
+ * A PulseFinder takes one sample at a time with O(1) work per sample:
+ *   - moving-average filter of `smoothing` points (running sum over a ring),
+ *   - trigger when the filtered signal crosses `threshold`, and end of the
+ *     pulse when it falls below hysteresis * threshold,
+ *   - the filtered samples of the pulse (and a few before the trigger) are
+ *     kept until it ends, then its peak, constant-fraction time, width at
+ *     half maximum and charge are measured once,
+ *   - pile-up: a second peak inside the pulse, or a pulse starting less than
+ *     pileUpGap points after the previous one ended (both are flagged).
+ *
+ * Pulses are stored in PulseColumns, one vector per quantity, so a quantity
+ * of all pulses can be histogrammed or written to a TTree branch directly.
+ */
+
+#ifndef PULSE_PROCESSING_H
+#define PULSE_PROCESSING_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <string>
+#include <vector>
+#include "TFile.h"
+#include "TTree.h"
+#include "TH1D.h"
+#include "ROOT/TThreadExecutor.hxx"
+#include "streamingHistogram.h"
+
+// Options of the pulse processing
+struct PulseOptions {
+    int polarity = -1;              // -1 for negative pulses (PMT), +1 for positive ones
+    size_t smoothing = 4;           // Points of the moving average (1 = no filter)
+    double threshold = 5.0e-3;      // Trigger level on the filtered signal in volts
+    double hysteresis = 0.5;        // The pulse ends below hysteresis * threshold
+    double cfdFraction = 0.3;       // Time of the pulse where its leading edge crosses this fraction of the amplitude
+    size_t pileUpGap = 20;          // Pulses starting closer than this to the end of the previous one are pile-up (points)
+    size_t pretrigger = 16;         // Filtered points kept before the trigger, for the leading edge
+};
+
+// Flags of a pulse
+enum PulseFlag : uint8_t {
+    kPulsePileUp = 1,               // More than one peak inside the pulse, or too close to another pulse of the event
+    kPulseMultiPeak = 2,            // More than one peak inside the pulse
+    kPulseTruncated = 4             // Open at the start or end of the event
+};
+
+// Pulses of many events, one column per quantity
+struct PulseColumns {
+    std::vector<uint32_t> event;    // Event number (one-based)
+    std::vector<float> time;        // Constant-fraction time in points from the start of the event
+    std::vector<float> amplitude;   // Peak of the filtered signal in volts (positive for either polarity)
+    std::vector<float> width;       // Full width at half maximum in points
+    std::vector<float> charge;      // Charge in picocoulombs, from the unfiltered samples of the pulse
+    std::vector<uint8_t> flags;     // PulseFlag bits
+
+    size_t size() const { return event.size(); }
+
+    void append(const PulseColumns& other) {
+        event.insert(event.end(), other.event.begin(), other.event.end());
+        time.insert(time.end(), other.time.begin(), other.time.end());
+        amplitude.insert(amplitude.end(), other.amplitude.begin(), other.amplitude.end());
+        width.insert(width.end(), other.width.begin(), other.width.end());
+        charge.insert(charge.end(), other.charge.begin(), other.charge.end());
+        flags.insert(flags.end(), other.flags.begin(), other.flags.end());
+    }
+
+    // Pulses without any flag
+    size_t cleanPulses() const {
+        return static_cast<size_t>(std::count(flags.begin(), flags.end(), 0));
+    }
+};
+
+// Streaming pulse finder over the samples of one event -----------------------------------------------------------------------------------
+class PulseFinder {
+public:
+    // chargeFactor turns a sum of volts over points into picocoulombs (deltaT / 50 ohm * 1e12)
+    PulseFinder(const PulseOptions& options, double chargeFactor)
+        : options(options), chargeFactor(chargeFactor), ring(std::max<size_t>(1, options.smoothing), 0.0) {}
+
+    // Start an event with its baseline (in volts) and number
+    void begin(double eventBaseline, uint32_t eventNumber) {
+        baseline = eventBaseline;
+        number = eventNumber;
+        point = 0;
+        ringSum = 0;
+        std::fill(ring.begin(), ring.end(), 0.0);
+        history.clear();
+        inPulse = false;
+        lastEnd = -static_cast<long>(options.pileUpGap) - 1;
+        lastPulse = std::numeric_limits<size_t>::max();
+    }
+
+    // Add the next sample of the event, in volts
+    void push(double voltage, PulseColumns& out) {
+        double signal = options.polarity * (voltage - baseline);
+
+        // Moving average: the filtered value belongs to the middle of the last `smoothing` points
+        size_t slot = point % ring.size();
+        ringSum += signal - ring[slot];
+        ring[slot] = signal;
+        size_t filled = std::min(point + 1, ring.size());
+        double filtered = ringSum / filled;
+
+        if (!inPulse) {
+            history.push_back({filtered, signal});
+            if (history.size() > options.pretrigger + 1)
+                history.pop_front();
+            if (filtered >= options.threshold && point + 1 >= ring.size())
+                open();
+        } else {
+            history.push_back({filtered, signal});
+            trackPeaks(filtered);
+            if (filtered < options.hysteresis * options.threshold)
+                close(out, false);
+        }
+        point++;
+    }
+
+    // End of the event: a pulse still open is truncated
+    void finish(PulseColumns& out) {
+        if (inPulse)
+            close(out, true);
+    }
+
+private:
+    struct Sample {
+        double filtered;
+        double signal;
+    };
+
+    void open() {
+        inPulse = true;
+        start = point + 1 - history.size();
+        peakValue = history.back().filtered;
+        valley = peakValue;
+        peaks = 1;
+        falling = false;
+    }
+
+    // A new peak needs the signal to fall by the trigger level from the last peak and rise again by as much
+    void trackPeaks(double filtered) {
+        if (!falling) {
+            peakValue = std::max(peakValue, filtered);
+            if (filtered <= peakValue - options.threshold) {
+                falling = true;
+                valley = filtered;
+            }
+        } else {
+            valley = std::min(valley, filtered);
+            if (filtered >= valley + options.threshold) {
+                falling = false;
+                peaks++;
+                peakValue = filtered;
+            }
+        }
+    }
+
+    void close(PulseColumns& out, bool truncated) {
+        // Peak of the filtered signal
+        size_t peak = 0;
+        for (size_t i = 1; i < history.size(); ++i)
+            if (history[i].filtered > history[peak].filtered)
+                peak = i;
+        double amplitude = history[peak].filtered;
+
+        // Constant-fraction time on the leading edge, linearly interpolated
+        double level = options.cfdFraction * amplitude;
+        double cfd = static_cast<double>(peak);
+        for (size_t i = peak; i > 0; --i) {
+            if (history[i - 1].filtered < level) {
+                double a = history[i - 1].filtered;
+                double b = history[i].filtered;
+                cfd = (i - 1) + (b > a ? (level - a) / (b - a) : 0);
+                break;
+            }
+        }
+
+        // Width at half maximum
+        double half = 0.5 * amplitude;
+        size_t left = peak;
+        while (left > 0 && history[left - 1].filtered >= half)
+            left--;
+        size_t right = peak;
+        while (right + 1 < history.size() && history[right + 1].filtered >= half)
+            right++;
+
+        // Charge of the unfiltered samples of the pulse
+        double sum = 0;
+        for (const Sample& sample : history)
+            sum += sample.signal;
+
+        // The filter delays the signal by (smoothing - 1) / 2 points
+        double delay = 0.5 * (ring.size() - 1);
+        uint8_t flags = 0;
+        if (truncated || start == 0)
+            flags |= kPulseTruncated;
+        if (peaks > 1)
+            flags |= kPulseMultiPeak | kPulsePileUp;
+        if (static_cast<long>(start) - lastEnd <= static_cast<long>(options.pileUpGap)) {
+            flags |= kPulsePileUp;
+            if (lastPulse < out.size())
+                out.flags[lastPulse] |= kPulsePileUp;
+        }
+
+        lastPulse = out.size();
+        out.event.push_back(number);
+        out.time.push_back(static_cast<float>(start + cfd - delay));
+        out.amplitude.push_back(static_cast<float>(amplitude));
+        out.width.push_back(static_cast<float>(right - left + 1));
+        out.charge.push_back(static_cast<float>(sum * chargeFactor));
+        out.flags.push_back(flags);
+
+        lastEnd = static_cast<long>(start + history.size());
+        inPulse = false;
+        history.clear();
+    }
+
+    PulseOptions options;
+    double chargeFactor;
+    std::vector<double> ring;
+    double ringSum = 0;
+    std::deque<Sample> history;     // Pretrigger points, then the points of the open pulse
+    double baseline = 0;
+    uint32_t number = 0;
+    size_t point = 0;
+    bool inPulse = false;
+    size_t start = 0;
+    double peakValue = 0;
+    double valley = 0;
+    int peaks = 0;
+    bool falling = false;
+    long lastEnd = 0;
+    size_t lastPulse = 0;
+};
+
+// Pulses of one event of resolution samples, with its baseline in volts
+inline void findPulses(const double* samples, size_t resolution, double baseline, uint32_t eventNumber,
+                       const PulseOptions& options, double chargeFactor, PulseColumns& out) {
+    PulseFinder finder(options, chargeFactor);
+    finder.begin(baseline, eventNumber);
+    for (size_t point = 0; point < resolution; ++point)
+        finder.push(samples[point], out);
+    finder.finish(out);
+}
+
+// Pulses of numberOfEvents events on the pool, in event order. samplesOf(event) returns the samples of a
+// zero-based event and baselineOf(event) its baseline.
+template <typename SamplesFunction, typename BaselineFunction>
+PulseColumns findPulsesParallel(ROOT::TThreadExecutor& pool, size_t numberOfEvents, size_t resolution, SamplesFunction samplesOf,
+                                BaselineFunction baselineOf, const PulseOptions& options, double chargeFactor, size_t numberOfChunks) {
+    size_t chunks = std::max<size_t>(1, std::min(numberOfChunks, numberOfEvents));
+    std::vector<PulseColumns> chunkPulses = pool.Map([&](unsigned chunk) {
+        PulseColumns pulses;
+        PulseFinder finder(options, chargeFactor);
+        for (size_t event = numberOfEvents * chunk / chunks; event < numberOfEvents * (chunk + 1) / chunks; ++event) {
+            const double* samples = samplesOf(event);
+            finder.begin(baselineOf(event), static_cast<uint32_t>(event + 1));
+            for (size_t point = 0; point < resolution; ++point)
+                finder.push(samples[point], pulses);
+            finder.finish(pulses);
+        }
+        return pulses;
+    }, ROOT::TSeqU(chunks));
+
+    PulseColumns pulses;
+    for (const PulseColumns& chunk : chunkPulses)
+        pulses.append(chunk);
+    return pulses;
+}
+
+// Pulse tree and histograms -------------------------------------------------------------------------------------------------------------
+
+const char* const pulseTreeName = "pulses";
+
+// Write the pulses to a TTree (one entry per pulse, one branch per column) in filename, with histograms of
+// the amplitude and charge of the pulses without flags. Returns false on error.
+inline bool writePulseTree(const std::string& filename, const PulseColumns& pulses, const std::string& title) {
+    TFile file(filename.c_str(), "RECREATE");
+    if (file.IsZombie())
+        return false;
+
+    // Owned by the file, deleted by Close()
+    TTree* tree = new TTree(pulseTreeName, ("Pulses - " + title).c_str());
+    UInt_t event = 0;
+    Float_t time = 0, amplitude = 0, width = 0, charge = 0;
+    UChar_t flags = 0;
+    tree->Branch("event", &event, "event/i");
+    tree->Branch("time", &time, "time/F");
+    tree->Branch("amplitude", &amplitude, "amplitude/F");
+    tree->Branch("width", &width, "width/F");
+    tree->Branch("charge", &charge, "charge/F");
+    tree->Branch("flags", &flags, "flags/b");
+    for (size_t i = 0; i < pulses.size(); ++i) {
+        event = pulses.event[i];
+        time = pulses.time[i];
+        amplitude = pulses.amplitude[i];
+        width = pulses.width[i];
+        charge = pulses.charge[i];
+        flags = pulses.flags[i];
+        tree->Fill();
+    }
+
+    // Freedman-Diaconis bins from 0 to the largest value, as the Charge Histogram. Without pulses free of
+    // flags the histogram is written empty, with one bin over 0..1
+    auto histogram = [&](const char* name, const char* axis, const std::vector<float>& column) {
+        QuantileSketch sketch;
+        for (size_t i = 0; i < column.size(); ++i)
+            if (pulses.flags[i] == 0)
+                sketch.add(column[i]);
+        HistogramBinning binning;
+        if (sketch.count() > 0)
+            binning = binningFor(0, sketch.max() * 1.05, freedmanDiaconisWidth(sketch), sketch.count());
+        TH1D h(name, (std::string(name) + " - " + title).c_str(), binning.bins, binning.low, binning.high);
+        h.GetXaxis()->SetTitle(axis);
+        for (size_t i = 0; i < column.size(); ++i)
+            if (pulses.flags[i] == 0)
+                h.Fill(column[i]);
+        h.Write();
+    };
+    histogram("Pulse_Amplitude", "Volts", pulses.amplitude);
+    histogram("Pulse_Charge", "Picocoulombs", pulses.charge);
+
+    tree->Write();
+    file.Close();
+    return true;
+}
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ *  Scope Simulator by Charly
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * This code is a ROOT macro that behaves like the oscilloscope during a
+ * run saved as segment files: every secondsBetweenSegments it writes a
+ * new Keysight CSV with eventsPerSegment synthetic events to outputFolder,
+ * a block at a time over writeSeconds, so the file grows on disk as it
+ * does while the scope is saving it.
+ *
+ * It is meant to be run next to liveMonitor.cpp (with captureFolder set to
+ * the same folder) to try the live mode without a scope:
+ *   root -l -b -q scopeSimulator.cpp   (in one terminal)
+ *   root -l -b -q liveMonitor.cpp      (in another)
+ */
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include "TSystem.h"
+#include "syntheticCapture.h"
+
+using namespace std;
+
+// EDITABLE Variables
+//--------------------------------------------------------------------------------------------------------------
+// Folder where the segments are written
+string outputFolder = "/home/martinus/Escritorio/ledchar/live"; // <-- EDIT THIS --
+
+// Name of the segments: <segmentName>_0001.csv, <segmentName>_0002.csv, ...
+string segmentName = "segment";
+
+// Number of segments of the run
+size_t numberOfSegments = 10;
+
+// Events and points per event of every segment
+size_t eventsPerSegment = 256;
+size_t resolution = 6000;
+
+// Seconds from the start of one segment to the start of the next
+double secondsBetweenSegments = 5.0;
+
+// Seconds taken to write every segment
+double writeSeconds = 2.0;
+//--------------------------------------------------------------------------------------------------------------
+
+// Function to copy a file to its final name a block at a time -----------------------------------------------------------------------------
+bool writeSlowly(const string& source, const string& destination) {
+    ifstream input(source, ios::binary);
+    ofstream output(destination, ios::binary);
+    if (!input.is_open() || !output.is_open()) {
+        return false;
+    }
+    input.seekg(0, ios::end);
+    size_t bytes = static_cast<size_t>(input.tellg());
+    input.seekg(0, ios::beg);
+
+    const size_t blocks = 20;
+    vector<char> buffer(bytes / blocks + 1);
+    for (size_t block = 0; block < blocks && input; ++block) {
+        input.read(buffer.data(), buffer.size());
+        output.write(buffer.data(), input.gcount());
+        output.flush();
+        this_thread::sleep_for(chrono::duration<double>(writeSeconds / blocks));
+    }
+    return static_cast<bool>(output);
+}
+
+// Main function --------------------------------------------------------------------------------------------------------------------------
+int scopeSimulator() {
+
+    // Welcome message
+    cout << " " << endl;
+    cout << "   ***   Scope Simulator by Charly   ***   " << endl;
+    cout << " " << endl;
+
+    gSystem->mkdir(outputFolder.c_str(), kTRUE);
+    string temporaryFilename = outputFolder + "/." + segmentName + ".tmp";
+    for (size_t segment = 1; segment <= numberOfSegments; ++segment) {
+        auto start = chrono::steady_clock::now();
+
+        // Synthetic events, different in every segment
+        SyntheticCaptureConfig config;
+        config.numberOfEvents = eventsPerSegment;
+        config.resolution = resolution;
+        config.seed = config.seed + static_cast<unsigned>(segment);
+        if (!writeSyntheticCapture(temporaryFilename, config)) {
+            cerr << "Error: Could not create file " << temporaryFilename << endl;
+            return 1;
+        }
+
+        char number[16];
+        snprintf(number, sizeof(number), "_%04zu.csv", segment);
+        string filename = outputFolder + "/" + segmentName + number;
+        if (!writeSlowly(temporaryFilename, filename)) {
+            cerr << "Error: Could not write file " << filename << endl;
+            return 1;
+        }
+        cout << "Segment " << segment << " of " << numberOfSegments << ": " << filename << endl;
+
+        if (segment < numberOfSegments) {
+            this_thread::sleep_until(start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(secondsBetweenSegments)));
+        }
+    }
+    remove(temporaryFilename.c_str());
+    return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ *  Signal Window Detection
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * Chooses the charge integration window (minTimeValue, maxTimeValue) of a
+ * capture instead of reading it by eye from the overlapped plot of csvRead.
+ *
+ * A pre-pass averages a strided sample of the events (sampleEvents of them,
+ * spread over the whole capture) into a mean waveform. Its baseline and
+ * noise come from the baseline portion; the pulse region is the stretch
+ * around the largest excursion after the baseline portion where the mean
+ * stays above edgeFraction of the peak, widened by a margin on both sides.
+ * The mean of N events has sqrt(N) times less noise than one event, so a
+ * few dozen events are enough even when most of them carry no pulse.
+ */
+
+#ifndef SIGNAL_WINDOW_H
+#define SIGNAL_WINDOW_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "chargeAnalysis.h"
+
+// Options of the window detection
+struct WindowDetectionOptions {
+    size_t sampleEvents = 64;       // Events averaged, evenly strided over the capture
+    int polarity = -1;              // -1 for negative pulses (PMT), +1 for positive ones
+    double noiseSigmas = 5;         // The peak of the mean waveform must exceed this many baseline RMS
+    double edgeFraction = 0.05;     // The pulse region ends where the mean falls below this fraction of the peak
+    double marginFraction = 0.25;   // Margin added on both sides, as a fraction of the pulse region
+};
+
+// Result of the detection, points in the convention of ChargeWindow
+struct DetectedWindow {
+    bool found = false;
+    double minTimeValue = 0;
+    double maxTimeValue = 0;
+    size_t peakPoint = 0;           // Largest excursion of the mean waveform
+    double peakAmplitude = 0;       // In volts, from the baseline
+    double noise = 0;               // Baseline RMS of the mean waveform in volts
+    size_t eventsUsed = 0;
+};
+
+// Window of a capture of numberOfEvents events of resolution points. copyEvent(event, out) writes the
+// resolution samples (in volts) of a zero-based event to out.
+template <typename CopyFunction>
+DetectedWindow detectSignalWindow(size_t numberOfEvents, size_t resolution, CopyFunction copyEvent,
+                                  const WindowDetectionOptions& options = WindowDetectionOptions()) {
+    DetectedWindow detected;
+    size_t baselineEnd = std::min(resolution, static_cast<size_t>(baselinePortionFor(resolution)) + 1);
+    if (numberOfEvents == 0 || resolution < 4 || baselineEnd < 2 || baselineEnd >= resolution)
+        return detected;
+
+    // Mean waveform of the strided sample
+    size_t stride = std::max<size_t>(1, numberOfEvents / std::max<size_t>(1, options.sampleEvents));
+    std::vector<double> mean(resolution, 0.0);
+    std::vector<double> samples(resolution);
+    for (size_t event = 0; event < numberOfEvents && detected.eventsUsed < options.sampleEvents; event += stride) {
+        copyEvent(event, samples.data());
+        for (size_t point = 0; point < resolution; ++point)
+            mean[point] += samples[point];
+        detected.eventsUsed++;
+    }
+    for (double& value : mean)
+        value /= detected.eventsUsed;
+
+    // Baseline and noise of the mean waveform
+    double baseline = 0;
+    for (size_t point = 0; point < baselineEnd; ++point)
+        baseline += mean[point];
+    baseline /= baselineEnd;
+    double variance = 0;
+    for (size_t point = 0; point < baselineEnd; ++point)
+        variance += (mean[point] - baseline) * (mean[point] - baseline);
+    detected.noise = std::sqrt(variance / (baselineEnd - 1));
+
+    // Largest excursion after the baseline portion
+    std::vector<double> signal(resolution);
+    for (size_t point = 0; point < resolution; ++point)
+        signal[point] = options.polarity * (mean[point] - baseline);
+    size_t peak = std::max_element(signal.begin() + baselineEnd, signal.end()) - signal.begin();
+    detected.peakPoint = peak;
+    detected.peakAmplitude = signal[peak];
+    if (!(signal[peak] > options.noiseSigmas * detected.noise))
+        return detected;
+
+    // Pulse region around the peak, then the margin
+    double edge = std::max(options.edgeFraction * signal[peak], detected.noise);
+    size_t first = peak;
+    while (first > baselineEnd && signal[first - 1] >= edge)
+        first--;
+    size_t last = peak;
+    while (last + 1 < resolution && signal[last + 1] >= edge)
+        last++;
+    size_t margin = static_cast<size_t>(std::ceil(options.marginFraction * (last - first + 1)));
+    first = first > baselineEnd + margin ? first - margin : baselineEnd;
+    last = std::min(resolution - 1, last + margin);
+
+    detected.found = true;
+    detected.minTimeValue = static_cast<double>(first);
+    detected.maxTimeValue = static_cast<double>(last);
+    return detected;
+}
+
+// Detection over a waveform container
+inline DetectedWindow detectSignalWindow(const Waveforms& waveforms, const WindowDetectionOptions& options = WindowDetectionOptions()) {
+    return detectSignalWindow(waveforms.events(), waveforms.points(), [&](size_t event, double* out) {
+        waveforms.copyEvent(event, out);
+    }, options);
+}
+
+#endif
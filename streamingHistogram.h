@@ -0,0 +1,239 @@
+/*
+ *  Streaming Histograms
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * Histograms of any number of values in constant memory, instead of
+ * keeping every value to find the range and using 7*sqrt(N) bins.
+ *
+ * A first pass feeds the values to a QuantileSketch (a KLL sketch: a few
+ * thousand weighted values whatever the count, exact minimum and maximum).
+ * Its quartiles give the Freedman-Diaconis bin width 2*IQR/N^(1/3). A second
+ * pass counts the values in BinnedCounts. Sketches and counts built on
+ * different threads merge: the counts exactly, the sketch with the same
+ * error bound as a single one.
+ */
+
+#ifndef STREAMING_HISTOGRAM_H
+#define STREAMING_HISTOGRAM_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+#include "TH1.h"
+
+// Mergeable quantile sketch ------------------------------------------------------------------------------------------------------------------
+// Level h keeps values of weight 2^h. A full level is sorted and every other value moves up a level with
+// twice the weight (starting at the first or second value, alternately), so the total weight is always
+// the number of values added. The rank error is about 1.7/k of the count.
+class QuantileSketch {
+public:
+    explicit QuantileSketch(size_t k = 200) : k(std::max<size_t>(k, 8)) {}
+
+    void add(double value) {
+        if (levels.empty())
+            grow();
+        levels[0].push_back(value);
+        stored++;
+        total++;
+        minimum = std::min(minimum, value);
+        maximum = std::max(maximum, value);
+        if (stored >= totalCapacity)
+            compress();
+    }
+
+    void merge(const QuantileSketch& other) {
+        while (levels.size() < other.levels.size())
+            grow();
+        for (size_t level = 0; level < other.levels.size(); ++level)
+            levels[level].insert(levels[level].end(), other.levels[level].begin(), other.levels[level].end());
+        stored += other.stored;
+        total += other.total;
+        minimum = std::min(minimum, other.minimum);
+        maximum = std::max(maximum, other.maximum);
+        while (stored >= totalCapacity)
+            compress();
+    }
+
+    // Value below which a fraction of the values lies, the exact minimum and maximum at 0 and 1
+    double quantile(double fraction) const {
+        if (total == 0)
+            return 0;
+        if (fraction <= 0)
+            return minimum;
+        if (fraction >= 1)
+            return maximum;
+        std::vector<std::pair<double, uint64_t>> weighted;
+        weighted.reserve(stored);
+        for (size_t level = 0; level < levels.size(); ++level)
+            for (const double value : levels[level])
+                weighted.emplace_back(value, uint64_t(1) << level);
+        std::sort(weighted.begin(), weighted.end());
+        double rank = fraction * total;
+        uint64_t cumulative = 0;
+        for (const auto& item : weighted) {
+            cumulative += item.second;
+            if (cumulative >= rank)
+                return item.first;
+        }
+        return maximum;
+    }
+
+    uint64_t count() const { return total; }
+    double min() const { return minimum; }
+    double max() const { return maximum; }
+
+private:
+    // New top level. The capacity of a level is smaller by 2/3 for every level below the top one.
+    void grow() {
+        levels.emplace_back();
+        offsets.push_back(0);
+        capacities.resize(levels.size());
+        totalCapacity = 0;
+        for (size_t level = 0; level < levels.size(); ++level) {
+            double depth = static_cast<double>(levels.size() - 1 - level);
+            capacities[level] = std::max<size_t>(2, static_cast<size_t>(std::ceil(k * std::pow(2.0 / 3.0, depth))));
+            totalCapacity += capacities[level];
+        }
+    }
+
+    // Compact the lowest full level into the next one
+    void compress() {
+        for (size_t level = 0; level < levels.size(); ++level) {
+            if (levels[level].size() < capacities[level])
+                continue;
+            if (level + 1 == levels.size())
+                grow();
+            std::vector<double>& values = levels[level];
+            std::sort(values.begin(), values.end());
+
+            // An odd value out stays at this level
+            double leftover = 0;
+            bool odd = values.size() % 2 == 1;
+            if (odd) {
+                leftover = values.back();
+                values.pop_back();
+            }
+            offsets[level] ^= 1;
+            for (size_t i = offsets[level]; i < values.size(); i += 2)
+                levels[level + 1].push_back(values[i]);
+            stored -= values.size() / 2;
+            values.clear();
+            if (odd)
+                values.push_back(leftover);
+            return;
+        }
+    }
+
+    size_t k;
+    std::vector<std::vector<double>> levels;
+    std::vector<unsigned char> offsets;
+    std::vector<size_t> capacities;
+    size_t totalCapacity = 0;
+    size_t stored = 0;
+    uint64_t total = 0;
+    double minimum = std::numeric_limits<double>::max();
+    double maximum = std::numeric_limits<double>::lowest();
+};
+
+// Binning --------------------------------------------------------------------------------------------------------------------------------------
+struct HistogramBinning {
+    int bins = 1;
+    double low = 0;
+    double high = 1;
+
+    double width() const { return (high - low) / bins; }
+};
+
+// Freedman-Diaconis bin width of the sketched values, 0 if their quartiles are equal
+inline double freedmanDiaconisWidth(const QuantileSketch& sketch) {
+    if (sketch.count() < 2)
+        return 0;
+    double iqr = sketch.quantile(0.75) - sketch.quantile(0.25);
+    return 2 * iqr / std::cbrt(static_cast<double>(sketch.count()));
+}
+
+// Bins of the given width from low, as many as needed for high to fall inside the last one (bins are
+// [low, high) as in ROOT), or 7*sqrt(count) bins if the width is 0. With quantum > 0 (the step of quantized
+// values, such as the ADC step) the width is a whole number of steps and the edges start half a step below
+// low, so they fall between the steps of values low + k*quantum and no bin is left empty or gets one step
+// more than its neighbours. Beyond maxBins the width grows, still a whole number of steps.
+inline HistogramBinning binningFor(double low, double high, double width, uint64_t count, double quantum = 0, int maxBins = 100000) {
+    HistogramBinning binning;
+    if (!(high > low)) {
+        double half = quantum > 0 ? 0.5 * quantum : 0.5;
+        binning.low = low - half;
+        binning.high = high + half;
+        return binning;
+    }
+    if (!(width > 0))
+        width = (high - low) / std::max(1.0, 7 * std::sqrt(static_cast<double>(count)));
+    if (quantum > 0) {
+        width = std::max(1.0, std::round(width / quantum)) * quantum;
+        low = low - 0.5 * quantum;
+    }
+    double bins = std::floor((high - low) / width) + 1;
+    if (bins > maxBins) {
+        width = (high - low) / (maxBins - 1);
+        if (quantum > 0)
+            width = std::ceil(width / quantum) * quantum;
+        bins = std::min<double>(maxBins, std::floor((high - low) / width) + 1);
+    }
+    binning.bins = static_cast<int>(bins);
+    binning.low = low;
+    binning.high = low + binning.bins * width;
+    return binning;
+}
+
+// Freedman-Diaconis bins over the exact range of the sketched values
+inline HistogramBinning freedmanDiaconisBinning(const QuantileSketch& sketch, double quantum = 0) {
+    return binningFor(sketch.min(), sketch.max(), freedmanDiaconisWidth(sketch), sketch.count(), quantum);
+}
+
+// Counts -----------------------------------------------------------------------------------------------------------------------------------------
+// Integer bin counts of a fixed binning, with underflow and overflow. Partial counts of the same binning
+// merge exactly, whatever the order.
+class BinnedCounts {
+public:
+    BinnedCounts() = default;
+    explicit BinnedCounts(const HistogramBinning& binning) : binning(binning), counts(binning.bins + 2, 0) {}
+
+    void add(double value) {
+        int bin = 0;
+        if (value >= binning.low) {
+            double position = (value - binning.low) / binning.width();
+            bin = position < binning.bins ? static_cast<int>(position) + 1 : binning.bins + 1;
+        }
+        counts[bin]++;
+    }
+
+    void merge(const BinnedCounts& other) {
+        for (size_t bin = 0; bin < counts.size() && bin < other.counts.size(); ++bin)
+            counts[bin] += other.counts[bin];
+    }
+
+    uint64_t entries() const {
+        uint64_t sum = 0;
+        for (const uint64_t count : counts)
+            sum += count;
+        return sum;
+    }
+
+    // Copy the counts into a histogram made with the same binning (ROOT bin numbers, 0 is the underflow)
+    void fill(TH1& histogram) const {
+        for (size_t bin = 0; bin < counts.size(); ++bin)
+            histogram.SetBinContent(static_cast<int>(bin), static_cast<double>(counts[bin]));
+        histogram.SetEntries(static_cast<double>(entries()));
+    }
+
+    const HistogramBinning& getBinning() const { return binning; }
+
+private:
+    HistogramBinning binning;
+    std::vector<uint64_t> counts;
+};
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ *  Synthetic Keysight Capture Generator
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * Writes a .csv file with the same layout as the Keysight oscilloscope
+ * exports: 25 header lines followed by one row per time point, with a
+ * (time, voltage) column pair per event. Used by the benchmark macro so
+ * performance can be measured without real scope files.
+ *
+ * Every event has Gaussian noise around its own baseline offset, and a
+ * Poisson number of photoelectrons (mean meanPE) at the pulse position with
+ * some time jitter. Each photoelectron is a pulse of Gaussian height
+ * (pulseAmplitude, relative spread speSpread) with a rise and a decay time,
+ * so the charge spectrum has a pedestal and 1, 2, 3... PE peaks as a PMT.
+ */
+
+#ifndef SYNTHETIC_CAPTURE_H
+#define SYNTHETIC_CAPTURE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "keysightCSV.h"
+
+// Parameters of the synthetic capture
+struct SyntheticCaptureConfig {
+    size_t numberOfEvents = 256;
+    size_t resolution = 6000;          // Points per event
+    double t0 = -2.0e-7;               // Time of the first point in seconds
+    double deltaT = 1.0e-10;           // Time between points in seconds
+    double baselineNoise = 1.0e-3;     // Baseline RMS in volts
+    double baselineOffsetSpread = 2.0e-4;  // RMS of the baseline offset between events in volts
+    double meanPE = 1.5;               // Mean number of photoelectrons per event (Poisson)
+    double pulseAmplitude = 2.0e-2;    // Single photoelectron pulse height in volts (negative polarity)
+    double speSpread = 0.35;           // Relative RMS of the single photoelectron height
+    double pulsePosition = 0.58;       // Pulse peak as a fraction of the window
+    double timeJitter = 1.0e-9;        // RMS of the photoelectron arrival time in seconds
+    double pulseRise = 1.0e-9;         // Pulse rise time constant in seconds (0 = instant rise)
+    double pulseWidth = 3.0e-9;        // Pulse decay time in seconds
+    double adcStep = 0;                // Volts per ADC code, voltages are rounded to it (0 = not quantized)
+    unsigned seed = 12345;
+};
+
+// Number of events needed to reach roughly targetBytes with the given resolution
+inline size_t syntheticEventsForSize(size_t targetBytes, size_t resolution) {
+    const size_t bytesPerPair = 28;    // "-1.234567E-07,-1.234567E-03,"
+    size_t events = targetBytes / (resolution * bytesPerPair);
+    return events > 0 ? events : 1;
+}
+
+// Write the capture to filename, returns false if the file could not be created
+inline bool writeSyntheticCapture(const std::string& filename, const SyntheticCaptureConfig& config) {
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (file == nullptr)
+        return false;
+
+    // Header lines
+    fprintf(file, "Model,SYNTHETIC\n");
+    fprintf(file, "Events,%zu\n", config.numberOfEvents);
+    fprintf(file, "Points,%zu\n", config.resolution);
+    for (size_t i = 3; i < keysightHeaderLines; ++i)
+        fprintf(file, "Header line %zu\n", i + 1);
+
+    // Baseline offset and photoelectrons of every event, drawn before the rows are written
+    std::mt19937 generator(config.seed);
+    std::normal_distribution<double> noise(0.0, config.baselineNoise);
+    std::normal_distribution<double> offset(0.0, config.baselineOffsetSpread);
+    std::poisson_distribution<int> photoelectrons(config.meanPE > 0 ? config.meanPE : 1e-12);
+    std::normal_distribution<double> height(1.0, config.speSpread);
+    std::normal_distribution<double> jitter(0.0, config.timeJitter);
+
+    // Pulse shape exp(-t/decay) - exp(-t/rise) from its onset, scaled to a peak of 1
+    const double rise = config.pulseRise > 0 && config.pulseRise < config.pulseWidth ? config.pulseRise : 0;
+    const double decay = config.pulseWidth;
+    const double peakDelay = rise > 0 ? std::log(decay / rise) * rise * decay / (decay - rise) : 0;
+    const double peakShape = rise > 0 ? std::exp(-peakDelay / decay) - std::exp(-peakDelay / rise) : 1;
+    auto shape = [&](double t) {
+        return rise > 0 ? (std::exp(-t / decay) - std::exp(-t / rise)) / peakShape : std::exp(-t / decay);
+    };
+
+    struct Pulse {
+        double onset;
+        double height;
+    };
+    const double peakTime = config.t0 + config.pulsePosition * config.resolution * config.deltaT;
+    std::vector<double> baselines(config.numberOfEvents);
+    std::vector<std::vector<Pulse>> pulses(config.numberOfEvents);
+    for (size_t event = 0; event < config.numberOfEvents; ++event) {
+        baselines[event] = config.baselineOffsetSpread > 0 ? offset(generator) : 0;
+        int count = config.meanPE > 0 ? photoelectrons(generator) : 0;
+        for (int pe = 0; pe < count; ++pe) {
+            double arrival = config.timeJitter > 0 ? jitter(generator) : 0;
+            pulses[event].push_back({peakTime - peakDelay + arrival, config.pulseAmplitude * std::max(0.0, height(generator))});
+        }
+    }
+
+    // Pulses are left out after 20 decay times, well below the noise
+    const double pulseLength = 20 * decay;
+    std::vector<char> rowBuffer(config.numberOfEvents * 32 + 2);
+    for (size_t point = 0; point < config.resolution; ++point) {
+        double time = config.t0 + point * config.deltaT;
+
+        char* out = rowBuffer.data();
+        for (size_t event = 0; event < config.numberOfEvents; ++event) {
+            double voltage = baselines[event] + noise(generator);
+            for (const Pulse& pulse : pulses[event]) {
+                double t = time - pulse.onset;
+                if (t >= 0 && t < pulseLength)
+                    voltage -= pulse.height * shape(t);
+            }
+            if (config.adcStep > 0)
+                voltage = std::round(voltage / config.adcStep) * config.adcStep;
+            out += snprintf(out, 32, event + 1 < config.numberOfEvents ? "%.6E,%.6E," : "%.6E,%.6E", time, voltage);
+        }
+        *out++ = '\n';
+        fwrite(rowBuffer.data(), 1, static_cast<size_t>(out - rowBuffer.data()), file);
+    }
+
+    fclose(file);
+    return true;
+}
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ *  Waveform Container
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * Samples of all events of a capture in one contiguous buffer: event after
+ * event, every event starting on a 64-byte boundary, so per-event loops read
+ * memory linearly. All events share one time axis, t0 + point * deltaT.
+ *
+ * Samples can be kept as float64, float32 (4x smaller than the two double
+ * columns per event of the CSV) or int16 codes, where a sample is
+ * code * scale + offset volts (8x smaller).
+ *
+ * A Waveforms object can also be a read-only view over float64 samples owned
+ * by someone else, e.g. the memory-mapped event store.
+ */
+
+#ifndef WAVEFORM_H
+#define WAVEFORM_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+const size_t waveformAlignment = 64;
+
+// Sample encodings of the container
+enum WaveformSampleType {
+    kWaveformFloat64 = 0,
+    kWaveformFloat32 = 1,
+    kWaveformInt16 = 2
+};
+
+inline size_t waveformSampleBytes(WaveformSampleType type) {
+    switch (type) {
+        case kWaveformFloat32: return sizeof(float);
+        case kWaveformInt16: return sizeof(int16_t);
+        default: return sizeof(double);
+    }
+}
+
+inline const char* waveformSampleName(WaveformSampleType type) {
+    switch (type) {
+        case kWaveformFloat32: return "float32";
+        case kWaveformInt16: return "int16";
+        default: return "float64";
+    }
+}
+
+class Waveforms {
+public:
+    // Allocate events x points zeroed samples. int16 samples are code * scale + offset volts.
+    void allocate(size_t events, size_t points, WaveformSampleType type, double scale = 1, double offset = 0) {
+        numberOfEvents = events;
+        numberOfPoints = points;
+        type_ = type;
+        scale_ = scale;
+        offset_ = offset;
+        size_t sampleBytes = waveformSampleBytes(type);
+        stride_ = (points * sampleBytes + waveformAlignment - 1) / waveformAlignment * waveformAlignment / sampleBytes;
+        external = nullptr;
+        storage.assign(events * stride_ * sampleBytes + waveformAlignment, 0);
+    }
+
+    // Read-only view over float64 events that start stride samples apart
+    void view(const double* samples, size_t events, size_t points, size_t stride) {
+        storage.clear();
+        storage.shrink_to_fit();
+        numberOfEvents = events;
+        numberOfPoints = points;
+        type_ = kWaveformFloat64;
+        scale_ = 1;
+        offset_ = 0;
+        stride_ = stride;
+        external = reinterpret_cast<const unsigned char*>(samples);
+    }
+
+    void setTimeAxis(double t0, double deltaT) {
+        t0_ = t0;
+        deltaT_ = deltaT;
+    }
+
+    size_t events() const { return numberOfEvents; }
+    size_t points() const { return numberOfPoints; }
+    size_t stride() const { return stride_; }
+    WaveformSampleType sampleType() const { return type_; }
+    double scale() const { return scale_; }
+    double offset() const { return offset_; }
+    double t0() const { return t0_; }
+    double deltaT() const { return deltaT_; }
+    bool empty() const { return numberOfEvents == 0 || numberOfPoints == 0; }
+
+    // Time of a zero-based point in seconds
+    double time(size_t point) const { return t0_ + point * deltaT_; }
+
+    // Bytes held by the samples
+    size_t bytes() const { return numberOfEvents * stride_ * waveformSampleBytes(type_); }
+
+    // Raw samples of a zero-based event, T must match sampleType()
+    template <typename T>
+    const T* event(size_t index) const { return reinterpret_cast<const T*>(base()) + index * stride_; }
+
+    template <typename T>
+    T* event(size_t index) { return reinterpret_cast<T*>(const_cast<unsigned char*>(base())) + index * stride_; }
+
+    // Store a value in volts, encoded in the sample type (not for views)
+    void set(size_t index, size_t point, double value) {
+        switch (type_) {
+            case kWaveformFloat32:
+                event<float>(index)[point] = static_cast<float>(value);
+                break;
+            case kWaveformInt16:
+                event<int16_t>(index)[point] = encode(value);
+                break;
+            default:
+                event<double>(index)[point] = value;
+                break;
+        }
+    }
+
+    // Value in volts
+    double get(size_t index, size_t point) const {
+        switch (type_) {
+            case kWaveformFloat32: return event<float>(index)[point];
+            case kWaveformInt16: return event<int16_t>(index)[point] * scale_ + offset_;
+            default: return event<double>(index)[point];
+        }
+    }
+
+    // All points of an event in volts
+    void copyEvent(size_t index, double* out) const {
+        switch (type_) {
+            case kWaveformFloat32: {
+                const float* samples = event<float>(index);
+                std::copy(samples, samples + numberOfPoints, out);
+                break;
+            }
+            case kWaveformInt16: {
+                const int16_t* samples = event<int16_t>(index);
+                for (size_t point = 0; point < numberOfPoints; ++point)
+                    out[point] = samples[point] * scale_ + offset_;
+                break;
+            }
+            default: {
+                const double* samples = event<double>(index);
+                std::copy(samples, samples + numberOfPoints, out);
+                break;
+            }
+        }
+    }
+
+    // Nearest int16 code of a value in volts, clamped to the int16 range
+    int16_t encode(double value) const {
+        double code = std::round((value - offset_) / scale_);
+        code = std::min(32767.0, std::max(-32768.0, code));
+        return static_cast<int16_t>(code);
+    }
+
+private:
+    const unsigned char* base() const {
+        if (external != nullptr)
+            return external;
+        uintptr_t address = reinterpret_cast<uintptr_t>(storage.data());
+        return storage.data() + (waveformAlignment - address % waveformAlignment) % waveformAlignment;
+    }
+
+    std::vector<unsigned char> storage;
+    const unsigned char* external = nullptr;
+    size_t numberOfEvents = 0;
+    size_t numberOfPoints = 0;
+    size_t stride_ = 0;
+    WaveformSampleType type_ = kWaveformFloat64;
+    double scale_ = 1;
+    double offset_ = 0;
+    double t0_ = 0;
+    double deltaT_ = 0;
+};
+
+#endif
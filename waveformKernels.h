@@ -0,0 +1,393 @@
+/*
+ *  Waveform Kernels
+ *  Andres Bello University - SAPHIR
+ *  Chile
+ *
+ * Vectorized reductions used by the charge analysis: sum of the baseline
+ * points and, over the integration window, the sum of (v - baseline)
+ * together with its minimum and maximum.
+ *
+ * Samples can be double or float; float samples are widened and summed in
+ * double. int16 ADC codes have their own kernels in integer arithmetic
+ * (exact 64-bit sums and min/max codes), scaled once by the caller.
+ *
+ * Each kernel has a scalar version and, on x86-64 with GCC/Clang (ROOT's
+ * interpreter included), AVX2 and AVX-512 versions. The best level the CPU
+ * supports is chosen at run time; setSimdLevel() can force a lower one
+ * (e.g. for benchmarks). Vector versions add in a different order than the
+ * scalar loop, so sums can differ in the last bits.
+ */
+
+#ifndef WAVEFORM_KERNELS_H
+#define WAVEFORM_KERNELS_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define WAVEFORM_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+// Instruction set levels of the kernels
+enum class SimdLevel { kScalar = 0, kAVX2 = 1, kAVX512 = 2 };
+
+inline const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::kAVX512: return "AVX-512";
+        case SimdLevel::kAVX2: return "AVX2";
+        default: return "Scalar";
+    }
+}
+
+// Sum of (v - baseline) over a range, with its minimum and maximum
+struct WindowStats {
+    double sum = 0;
+    double min = std::numeric_limits<double>::max();
+    double max = std::numeric_limits<double>::lowest();
+};
+
+// Sum of int16 codes over a range, with the minimum and maximum code
+struct CodeStats {
+    int64_t sum = 0;
+    int min = std::numeric_limits<int16_t>::max();
+    int max = std::numeric_limits<int16_t>::min();
+};
+
+// Scalar kernels ------------------------------------------------------------------------------------------------------------------------
+template <typename T>
+inline double sumSamplesScalar(const T* v, size_t n) {
+    double sum = 0;
+    for (size_t i = 0; i < n; ++i)
+        sum += v[i];
+    return sum;
+}
+
+template <typename T>
+inline WindowStats windowStatsScalar(const T* v, size_t n, double baseline) {
+    WindowStats stats;
+    for (size_t i = 0; i < n; ++i) {
+        double corrected = v[i] - baseline;
+        stats.sum += corrected;
+        stats.min = std::min(stats.min, corrected);
+        stats.max = std::max(stats.max, corrected);
+    }
+    return stats;
+}
+
+inline int64_t sumCodesScalar(const int16_t* v, size_t n) {
+    int64_t sum = 0;
+    for (size_t i = 0; i < n; ++i)
+        sum += v[i];
+    return sum;
+}
+
+inline CodeStats codeStatsScalar(const int16_t* v, size_t n) {
+    CodeStats stats;
+    for (size_t i = 0; i < n; ++i) {
+        stats.sum += v[i];
+        stats.min = std::min(stats.min, static_cast<int>(v[i]));
+        stats.max = std::max(stats.max, static_cast<int>(v[i]));
+    }
+    return stats;
+}
+
+#ifdef WAVEFORM_KERNELS_X86
+// AVX2 kernels --------------------------------------------------------------------------------------------------------------------------
+
+// Four samples as doubles (float samples are widened, the sums are always in double)
+__attribute__((target("avx2"))) inline __m256d loadAVX2(const double* v) { return _mm256_loadu_pd(v); }
+__attribute__((target("avx2"))) inline __m256d loadAVX2(const float* v) { return _mm256_cvtps_pd(_mm_loadu_ps(v)); }
+
+__attribute__((target("avx2"))) inline double horizontalSumAVX2(__m256d x) {
+    __m128d low = _mm256_castpd256_pd128(x);
+    __m128d high = _mm256_extractf128_pd(x, 1);
+    low = _mm_add_pd(low, high);
+    return _mm_cvtsd_f64(_mm_add_sd(low, _mm_unpackhi_pd(low, low)));
+}
+
+template <typename T>
+__attribute__((target("avx2"))) inline double sumSamplesAVX2(const T* v, size_t n) {
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        sum0 = _mm256_add_pd(sum0, loadAVX2(v + i));
+        sum1 = _mm256_add_pd(sum1, loadAVX2(v + i + 4));
+    }
+    double sum = horizontalSumAVX2(_mm256_add_pd(sum0, sum1));
+    for (; i < n; ++i)
+        sum += v[i];
+    return sum;
+}
+
+template <typename T>
+__attribute__((target("avx2"))) inline WindowStats windowStatsAVX2(const T* v, size_t n, double baseline) {
+    const __m256d base = _mm256_set1_pd(baseline);
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    __m256d low = _mm256_set1_pd(std::numeric_limits<double>::max());
+    __m256d high = _mm256_set1_pd(std::numeric_limits<double>::lowest());
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256d x0 = _mm256_sub_pd(loadAVX2(v + i), base);
+        __m256d x1 = _mm256_sub_pd(loadAVX2(v + i + 4), base);
+        sum0 = _mm256_add_pd(sum0, x0);
+        sum1 = _mm256_add_pd(sum1, x1);
+        low = _mm256_min_pd(low, _mm256_min_pd(x0, x1));
+        high = _mm256_max_pd(high, _mm256_max_pd(x0, x1));
+    }
+
+    WindowStats stats;
+    stats.sum = horizontalSumAVX2(_mm256_add_pd(sum0, sum1));
+    alignas(32) double lanes[4];
+    _mm256_store_pd(lanes, low);
+    stats.min = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+    _mm256_store_pd(lanes, high);
+    stats.max = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+    for (; i < n; ++i) {
+        double corrected = v[i] - baseline;
+        stats.sum += corrected;
+        stats.min = std::min(stats.min, corrected);
+        stats.max = std::max(stats.max, corrected);
+    }
+    return stats;
+}
+
+// int16 codes: pairs are added into 32-bit lanes with madd, and the lanes are widened to 64 bits every
+// codeBlock vectors, before they can overflow
+const size_t codeBlock = 16384;
+
+__attribute__((target("avx2"))) inline int64_t horizontalSumEpi32AVX2(__m256i x) {
+    __m256i wide = _mm256_add_epi64(_mm256_cvtepi32_epi64(_mm256_castsi256_si128(x)), _mm256_cvtepi32_epi64(_mm256_extracti128_si256(x, 1)));
+    alignas(32) int64_t lanes[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), wide);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("avx2"))) inline CodeStats codeStatsAVX2(const int16_t* v, size_t n, bool withMinMax = true) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i low = _mm256_set1_epi16(std::numeric_limits<int16_t>::max());
+    __m256i high = _mm256_set1_epi16(std::numeric_limits<int16_t>::min());
+    CodeStats stats;
+    size_t i = 0;
+    while (i + 16 <= n) {
+        size_t blockEnd = std::min(n - n % 16, i + 16 * codeBlock);
+        __m256i sum = _mm256_setzero_si256();
+        for (; i < blockEnd; i += 16) {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v + i));
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(x, ones));
+            if (withMinMax) {
+                low = _mm256_min_epi16(low, x);
+                high = _mm256_max_epi16(high, x);
+            }
+        }
+        stats.sum += horizontalSumEpi32AVX2(sum);
+    }
+
+    alignas(32) int16_t lanes[16];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), low);
+    stats.min = *std::min_element(lanes, lanes + 16);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), high);
+    stats.max = *std::max_element(lanes, lanes + 16);
+    for (; i < n; ++i) {
+        stats.sum += v[i];
+        stats.min = std::min(stats.min, static_cast<int>(v[i]));
+        stats.max = std::max(stats.max, static_cast<int>(v[i]));
+    }
+    return stats;
+}
+
+__attribute__((target("avx2"))) inline int64_t sumCodesAVX2(const int16_t* v, size_t n) {
+    return codeStatsAVX2(v, n, false).sum;
+}
+
+// AVX-512 kernels -----------------------------------------------------------------------------------------------------------------------
+
+// Eight samples as doubles
+__attribute__((target("avx512f"))) inline __m512d loadAVX512(const double* v) { return _mm512_loadu_pd(v); }
+__attribute__((target("avx512f"))) inline __m512d loadAVX512(const float* v) { return _mm512_cvtps_pd(_mm256_loadu_ps(v)); }
+
+template <typename T>
+__attribute__((target("avx512f"))) inline double sumSamplesAVX512(const T* v, size_t n) {
+    __m512d sum0 = _mm512_setzero_pd();
+    __m512d sum1 = _mm512_setzero_pd();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        sum0 = _mm512_add_pd(sum0, loadAVX512(v + i));
+        sum1 = _mm512_add_pd(sum1, loadAVX512(v + i + 8));
+    }
+    if (i + 8 <= n) {
+        sum0 = _mm512_add_pd(sum0, loadAVX512(v + i));
+        i += 8;
+    }
+    double sum = _mm512_reduce_add_pd(_mm512_add_pd(sum0, sum1));
+    for (; i < n; ++i)
+        sum += v[i];
+    return sum;
+}
+
+template <typename T>
+__attribute__((target("avx512f"))) inline WindowStats windowStatsAVX512(const T* v, size_t n, double baseline) {
+    const __m512d base = _mm512_set1_pd(baseline);
+    __m512d sum0 = _mm512_setzero_pd();
+    __m512d sum1 = _mm512_setzero_pd();
+    __m512d low = _mm512_set1_pd(std::numeric_limits<double>::max());
+    __m512d high = _mm512_set1_pd(std::numeric_limits<double>::lowest());
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512d x0 = _mm512_sub_pd(loadAVX512(v + i), base);
+        __m512d x1 = _mm512_sub_pd(loadAVX512(v + i + 8), base);
+        sum0 = _mm512_add_pd(sum0, x0);
+        sum1 = _mm512_add_pd(sum1, x1);
+        low = _mm512_min_pd(low, _mm512_min_pd(x0, x1));
+        high = _mm512_max_pd(high, _mm512_max_pd(x0, x1));
+    }
+
+    WindowStats stats;
+    stats.sum = _mm512_reduce_add_pd(_mm512_add_pd(sum0, sum1));
+    stats.min = _mm512_reduce_min_pd(low);
+    stats.max = _mm512_reduce_max_pd(high);
+    for (; i < n; ++i) {
+        double corrected = v[i] - baseline;
+        stats.sum += corrected;
+        stats.min = std::min(stats.min, corrected);
+        stats.max = std::max(stats.max, corrected);
+    }
+    return stats;
+}
+
+// int16 codes, as the AVX2 version on 32 codes at a time (needs AVX-512BW)
+__attribute__((target("avx512f,avx512bw"))) inline CodeStats codeStatsAVX512(const int16_t* v, size_t n, bool withMinMax = true) {
+    const __m512i ones = _mm512_set1_epi16(1);
+    __m512i low = _mm512_set1_epi16(std::numeric_limits<int16_t>::max());
+    __m512i high = _mm512_set1_epi16(std::numeric_limits<int16_t>::min());
+    CodeStats stats;
+    size_t i = 0;
+    while (i + 32 <= n) {
+        size_t blockEnd = std::min(n - n % 32, i + 32 * codeBlock);
+        __m512i sum = _mm512_setzero_si512();
+        for (; i < blockEnd; i += 32) {
+            __m512i x = _mm512_loadu_si512(v + i);
+            sum = _mm512_add_epi32(sum, _mm512_madd_epi16(x, ones));
+            if (withMinMax) {
+                low = _mm512_min_epi16(low, x);
+                high = _mm512_max_epi16(high, x);
+            }
+        }
+        stats.sum += _mm512_reduce_add_epi64(_mm512_add_epi64(_mm512_cvtepi32_epi64(_mm512_castsi512_si256(sum)),
+                                                              _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(sum, 1))));
+    }
+
+    alignas(64) int16_t lanes[32];
+    _mm512_store_si512(lanes, low);
+    stats.min = *std::min_element(lanes, lanes + 32);
+    _mm512_store_si512(lanes, high);
+    stats.max = *std::max_element(lanes, lanes + 32);
+    for (; i < n; ++i) {
+        stats.sum += v[i];
+        stats.min = std::min(stats.min, static_cast<int>(v[i]));
+        stats.max = std::max(stats.max, static_cast<int>(v[i]));
+    }
+    return stats;
+}
+
+__attribute__((target("avx512f,avx512bw"))) inline int64_t sumCodesAVX512(const int16_t* v, size_t n) {
+    return codeStatsAVX512(v, n, false).sum;
+}
+#endif
+
+// Runtime dispatch ----------------------------------------------------------------------------------------------------------------------
+
+// Best level supported by this CPU
+inline SimdLevel detectSimdLevel() {
+#ifdef WAVEFORM_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SimdLevel::kAVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return SimdLevel::kAVX2;
+#endif
+    return SimdLevel::kScalar;
+}
+
+inline SimdLevel& activeSimdLevel() {
+    static SimdLevel level = detectSimdLevel();
+    return level;
+}
+
+// The int16 AVX-512 kernels also need AVX-512BW
+inline bool cpuSupportsAVX512BW() {
+#ifdef WAVEFORM_KERNELS_X86
+    static bool supported = (__builtin_cpu_init(), __builtin_cpu_supports("avx512bw"));
+    return supported;
+#else
+    return false;
+#endif
+}
+
+// Force a level, never above what the CPU supports. Returns the level in use.
+inline SimdLevel setSimdLevel(SimdLevel level) {
+    activeSimdLevel() = std::min(level, detectSimdLevel());
+    return activeSimdLevel();
+}
+
+// Sum of n double or float samples (the baseline mean is sumSamples(v, n) / n)
+template <typename T>
+inline double sumSamples(const T* v, size_t n) {
+#ifdef WAVEFORM_KERNELS_X86
+    switch (activeSimdLevel()) {
+        case SimdLevel::kAVX512: return sumSamplesAVX512(v, n);
+        case SimdLevel::kAVX2: return sumSamplesAVX2(v, n);
+        default: break;
+    }
+#endif
+    return sumSamplesScalar(v, n);
+}
+
+// Sum, minimum and maximum of (v - baseline) over n double or float samples
+template <typename T>
+inline WindowStats windowStats(const T* v, size_t n, double baseline) {
+#ifdef WAVEFORM_KERNELS_X86
+    switch (activeSimdLevel()) {
+        case SimdLevel::kAVX512: return windowStatsAVX512(v, n, baseline);
+        case SimdLevel::kAVX2: return windowStatsAVX2(v, n, baseline);
+        default: break;
+    }
+#endif
+    return windowStatsScalar(v, n, baseline);
+}
+
+// Exact sum of n int16 codes
+inline int64_t sumCodes(const int16_t* v, size_t n) {
+#ifdef WAVEFORM_KERNELS_X86
+    switch (activeSimdLevel()) {
+        case SimdLevel::kAVX512:
+            if (cpuSupportsAVX512BW())
+                return sumCodesAVX512(v, n);
+            return sumCodesAVX2(v, n);
+        case SimdLevel::kAVX2: return sumCodesAVX2(v, n);
+        default: break;
+    }
+#endif
+    return sumCodesScalar(v, n);
+}
+
+// Exact sum, minimum and maximum of n int16 codes
+inline CodeStats codeStats(const int16_t* v, size_t n) {
+#ifdef WAVEFORM_KERNELS_X86
+    switch (activeSimdLevel()) {
+        case SimdLevel::kAVX512:
+            if (cpuSupportsAVX512BW())
+                return codeStatsAVX512(v, n);
+            return codeStatsAVX2(v, n);
+        case SimdLevel::kAVX2: return codeStatsAVX2(v, n);
+        default: break;
+    }
+#endif
+    return codeStatsScalar(v, n);
+}
+
+#endif